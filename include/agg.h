@@ -0,0 +1,92 @@
+#ifndef _AGG_H
+#define _AGG_H
+
+#include <stdint.h>
+
+// Streaming min / max / mean per interval, constant memory : one running interval and
+// the last closed one. Intervals are keyed by a meter time stamp (YYMMDDhhmm), a new
+// stamp closes the running interval, so missed telegrams only lower the sample count.
+
+enum AGG_ID : uint8_t {
+  AGG_P = 0,        // W, consumed - injected
+  AGG_P_CONS,       // W
+  AGG_P_INJ,        // W
+  AGG_U_L1,         // 0.1 V
+  AGG_U_L2,
+  AGG_U_L3,
+  AGG_I_L1,         // 0.01 A
+  AGG_I_L2,
+  AGG_I_L3,
+  AGG_P_L1,         // W, negative when injecting
+  AGG_P_L2,
+  AGG_P_L3,
+  AGG_COUNT
+};
+
+// One telegram
+struct AGG_SAMPLE {
+  int32_t val[AGG_COUNT];
+  uint32_t E_consumed;  // Wh
+  uint32_t E_injected;
+};
+
+struct AGG {
+  uint32_t stamp = 0;       // interval start, YYMMDDhhmm
+  uint16_t n = 0;           // samples
+  int32_t min[AGG_COUNT];
+  int32_t max[AGG_COUNT];
+  int32_t sum[AGG_COUNT];   // 900 samples of +-2 MW at most
+  uint32_t E_consumed = 0;  // at interval end
+  uint32_t E_injected = 0;
+};
+
+struct AGG_STREAM {
+  AGG cur;
+  AGG last;                 // last closed interval
+  uint32_t seq = 0;         // intervals closed
+};
+
+int32_t agg_avg(const AGG *a, uint8_t id) {
+  return (a->n > 0) ? a->sum[id] / (int32_t)a->n : 0;
+}
+
+// Interval stamps from meter date (YYMMDD) and time (hhmmss)
+uint32_t agg_minute(uint32_t date, uint32_t time) {
+  return date * 10000 + time / 100;
+}
+
+uint32_t agg_quarter(uint32_t minute) {
+  return minute - (minute % 100) % 15;
+}
+
+// A sample of stamp closes the running interval
+bool agg_closes(const AGG_STREAM *s, uint32_t stamp) {
+  return (s->cur.n > 0) && ((stamp != s->cur.stamp) || (s->cur.n == 0xFFFF));
+}
+
+// Add a sample to the interval starting at stamp, returns true when the previous one closed
+bool agg_push(AGG_STREAM *s, uint32_t stamp, const AGG_SAMPLE *v) {
+  AGG *a = &s->cur;
+  bool closed = false;
+  if ((stamp != a->stamp) || (a->n == 0xFFFF)) {
+    if (a->n > 0) {
+      s->last = *a;
+      s->seq++;
+      closed = true;
+    }
+    a->stamp = stamp;
+    a->n = 0;
+  }
+  for (int i = 0; i < AGG_COUNT; i++) {
+    int32_t x = v->val[i];
+    if ((a->n == 0) || (x < a->min[i])) a->min[i] = x;
+    if ((a->n == 0) || (x > a->max[i])) a->max[i] = x;
+    a->sum[i] = (a->n == 0) ? x : a->sum[i] + x;
+  }
+  a->E_consumed = v->E_consumed;
+  a->E_injected = v->E_injected;
+  a->n++;
+  return closed;
+}
+
+#endif  /* _AGG_H */
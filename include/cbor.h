@@ -0,0 +1,56 @@
+#ifndef _CBOR_H
+#define _CBOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Minimal CBOR (RFC 8949) encoder into a caller buffer, no allocation.
+// Only what the MQTT payloads need : maps, unsigned and negative integers.
+
+struct CBOR {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  bool overflow;
+};
+
+void cbor_init(CBOR *c, uint8_t *buf, size_t size) {
+  c->buf = buf;
+  c->size = size;
+  c->len = 0;
+  c->overflow = false;
+}
+
+// Major type (3 bits) and argument, shortest form
+void cbor_head(CBOR *c, uint8_t major, uint32_t val) {
+  uint8_t n;
+  uint8_t ai;
+  if (val < 24) { ai = val; n = 0; }
+  else if (val <= 0xFF) { ai = 24; n = 1; }
+  else if (val <= 0xFFFF) { ai = 25; n = 2; }
+  else { ai = 26; n = 4; }
+  if (c->len + 1 + n > c->size) {
+    c->overflow = true;
+    return;
+  }
+  c->buf[c->len++] = (major << 5) | ai;
+  while (n > 0) {
+    n--;
+    c->buf[c->len++] = (val >> (8 * n)) & 0xFF;
+  }
+}
+
+void cbor_map(CBOR *c, uint32_t pairs) {
+  cbor_head(c, 5, pairs);
+}
+
+void cbor_uint(CBOR *c, uint32_t val) {
+  cbor_head(c, 0, val);
+}
+
+void cbor_int(CBOR *c, int32_t val) {
+  if (val >= 0) cbor_head(c, 0, val);
+  else cbor_head(c, 1, (uint32_t)(-(val + 1)));
+}
+
+#endif  /* _CBOR_H */
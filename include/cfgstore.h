@@ -0,0 +1,191 @@
+#ifndef _CFGSTORE_H
+#define _CFGSTORE_H
+
+#include <Arduino.h>
+#include <crc16.h>
+extern "C" {
+#include <spi_flash.h>
+}
+
+// Configuration records in the flash sector reserved for the EEPROM library and a spare
+// sector, read and written directly : no 4 KB RAM copy.
+//
+// A sector holds CFG_SLOTS slots written in turn, each one a complete record (sequence,
+// schema version, length, CRC). Written slots are always a prefix of the sector, so loading
+// finds the last one with a binary search over the headers (6 reads of 16 bytes), then
+// walks back to the last valid record : a torn write only loses that save. Once a sector is
+// full the next record goes to slot 0 of the other one, and only when it reads back right
+// is the full sector erased : a power loss at any point leaves a valid record, the load
+// takes the highest seq of both sectors.
+//
+// The spare is the sector below the EEPROM one : the file system ends on an 8 KB block, so
+// the 4 MB layouts (d1_mini 4m1m, 4m2m) leave it free. In a layout where the file system
+// reaches the EEPROM sector, CFG_SPARE_ADDR is 0 and the store erases its only sector once
+// every CFG_SLOTS saves, the only moment a power loss loses the configuration.
+
+#define CFG_SLOT 64
+#define CFG_SLOTS (SPI_FLASH_SEC_SIZE / CFG_SLOT)
+#define CFG_MAGIC 0x46433150    // "P1CF"
+
+extern "C" uint32_t _EEPROM_start;
+#define CFG_STORE_ADDR ((uint32_t)((uintptr_t)&_EEPROM_start - 0x40200000))
+
+#ifndef CFG_SPARE_ADDR
+extern "C" uint32_t _FS_end;
+#define CFG_SPARE_ADDR ((((uintptr_t)&_FS_end - 0x40200000) <= CFG_STORE_ADDR - SPI_FLASH_SEC_SIZE) ? \
+                        (CFG_STORE_ADDR - SPI_FLASH_SEC_SIZE) : 0)
+#endif
+
+struct CFG_HEAD {
+  uint32_t magic;
+  uint32_t seq;         // save count, highest is the newest
+  uint16_t version;     // schema of data
+  uint16_t len;         // bytes of data
+  uint16_t crc;         // of seq, version, len and data
+  uint16_t pad;
+};
+
+#define CFG_DATA (CFG_SLOT - sizeof(CFG_HEAD))
+
+struct CFG_REC {
+  CFG_HEAD h;
+  uint8_t data[CFG_DATA];
+};
+
+struct CFG_STORE {
+  uint32_t addr[2] = { 0, 0 };  // sectors in flash, addr[1] 0 : no spare
+  uint8_t cur = 0;      // sector written to
+  uint16_t used = 0;    // slots written in it since its erase
+  int8_t retire = -1;   // full sector to erase once a record is in cur, -1 : none
+  uint32_t seq = 0;     // of the last record
+  int16_t slot = -1;    // slot of the last valid record in cur, -1 : none
+  uint32_t saves = 0;
+  uint32_t erases = 0;
+  uint32_t errors = 0;
+  uint32_t load_us = 0;
+};
+
+uint16_t cfg_store_crc(const CFG_REC *r) {
+  uint16_t crc = crc16_update(0, (const char *)&r->h.seq, 8);
+  return crc16_update(crc, (const char *)r->data, r->h.len);
+}
+
+bool cfg_store_read(uint32_t addr, int slot, CFG_REC *r, size_t size) {
+  return ESP.flashRead(addr + slot * CFG_SLOT, (uint32_t *)r, size);
+}
+
+bool cfg_store_erased(uint32_t addr, int slot) {
+  CFG_HEAD h;
+  if (!cfg_store_read(addr, slot, (CFG_REC *)&h, sizeof(h))) return false;
+  return (h.magic == 0xFFFFFFFF) && (h.seq == 0xFFFFFFFF);
+}
+
+// Slots written in a sector : binary search for the first erased header
+uint16_t cfg_store_used(uint32_t addr) {
+  int lo = 0;
+  int hi = CFG_SLOTS;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (cfg_store_erased(addr, mid)) hi = mid; else lo = mid + 1;
+  }
+  return lo;
+}
+
+// Every byte of a sector erased, not only its headers : an erase cut by a power loss
+bool cfg_store_blank(uint32_t addr) {
+  for (int i = 0; i < CFG_SLOTS; i++) {
+    CFG_REC r;
+    if (!cfg_store_read(addr, i, &r, sizeof(r))) return false;
+    for (size_t k = 0; k < sizeof(r); k++) if (((const uint8_t *)&r)[k] != 0xFF) return false;
+  }
+  return true;
+}
+
+// Newest valid record of both sectors : its data into data (size bytes at most, the rest is
+// left as is), returns its length and version, 0 : none. Saves go on in its sector, in
+// sector addr if there is none.
+int cfg_store_load(CFG_STORE *s, uint32_t addr, uint32_t spare, void *data, size_t size, uint16_t *version) {
+  uint32_t t0 = micros();
+  s->addr[0] = addr;
+  s->addr[1] = spare;
+  s->cur = 0;
+  s->retire = -1;
+  s->slot = -1;
+  s->seq = 0;
+  int len = 0;
+  for (int k = 0; k < (spare ? 2 : 1); k++) {
+    uint16_t used = cfg_store_used(s->addr[k]);
+    if (k == 0) s->used = used;
+    for (int i = used - 1; i >= 0; i--) {
+      CFG_REC r;
+      if (!cfg_store_read(s->addr[k], i, &r, sizeof(r))) continue;
+      if ((r.h.magic != CFG_MAGIC) || (r.h.len > CFG_DATA) || (r.h.crc != cfg_store_crc(&r))) continue;
+      if ((s->slot < 0) || ((int32_t)(r.h.seq - s->seq) > 0)) {
+        s->cur = k;
+        s->used = used;
+        s->slot = i;
+        s->seq = r.h.seq;
+        *version = r.h.version;
+        len = r.h.len;
+        memcpy(data, r.data, (len < (int)size) ? len : size);
+      }
+      break;
+    }
+  }
+  s->load_us = micros() - t0;
+  return len;
+}
+
+// Current sector full : on to the other one, erased first if it is not (the full one still
+// holds the newest record), the full one is erased after the next record. No spare : the
+// only sector is erased in place.
+bool cfg_store_next(CFG_STORE *s) {
+  int next = s->addr[1] ? 1 - s->cur : s->cur;
+  if ((next == s->cur) || !cfg_store_blank(s->addr[next])) {
+    if (!ESP.flashEraseSector(s->addr[next] / SPI_FLASH_SEC_SIZE)) return false;
+    s->erases++;
+  }
+  s->retire = (next == s->cur) ? -1 : s->cur;
+  s->cur = next;
+  s->used = 0;
+  return true;
+}
+
+// Write a new record in the next slot, read back to check it, once more in the next
+// slot if it fails
+bool cfg_store_save(CFG_STORE *s, const void *data, size_t len, uint16_t version) {
+  CFG_REC r;
+  CFG_REC check;
+  if (len > CFG_DATA) return false;
+  memset(&r, 0xFF, sizeof(r));
+  r.h.magic = CFG_MAGIC;
+  r.h.seq = s->seq + 1;
+  r.h.version = version;
+  r.h.len = len;
+  memcpy(r.data, data, len);
+  r.h.crc = cfg_store_crc(&r);
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if ((s->used >= CFG_SLOTS) && !cfg_store_next(s)) {
+      s->errors++;
+      return false;
+    }
+    int slot = s->used++;
+    uint32_t addr = s->addr[s->cur];
+    if (ESP.flashWrite(addr + slot * CFG_SLOT, (const uint32_t *)&r, sizeof(r)) &&
+        cfg_store_read(addr, slot, &check, sizeof(check)) && (memcmp(&r, &check, sizeof(r)) == 0)) {
+      s->slot = slot;
+      s->seq = r.h.seq;
+      s->saves++;
+      if (s->retire >= 0) {   // newest record safe in cur : the full sector can go
+        if (ESP.flashEraseSector(s->addr[s->retire] / SPI_FLASH_SEC_SIZE)) s->erases++;
+        else s->errors++;     // erased before its next use
+        s->retire = -1;
+      }
+      return true;
+    }
+    s->errors++;
+  }
+  return false;
+}
+
+#endif  /* _CFGSTORE_H */
@@ -0,0 +1,62 @@
+#ifndef _CONN_H
+#define _CONN_H
+
+#include <Arduino.h>
+
+// Connection lifecycle : up / down state with counters and, for connections opened by
+// the device, the time of the next attempt. After a loss the first attempt is
+// immediate, each failure then doubles the delay from backoff_min up to backoff_max,
+// with a random 50-100 % of it so devices don't all retry a restarted broker together.
+
+struct CONN {
+  const char *name;
+  uint32_t backoff_min;         // ms
+  uint32_t backoff_max;
+  bool up = false;
+  uint8_t fails = 0;            // failed attempts since the last connection
+  uint32_t next = 0;            // ms, next attempt
+  uint32_t since = 0;           // ms, last state change
+  uint32_t attempts = 0;
+  uint32_t connects = 0;
+  uint32_t losses = 0;
+  uint32_t blocked_us = 0;      // time spent in connection attempts
+  uint32_t blocked_max_us = 0;
+  CONN(const char *name, uint32_t backoff_min, uint32_t backoff_max)
+    : name(name), backoff_min(backoff_min), backoff_max(backoff_max) {}
+};
+
+bool conn_due(const CONN *c) {
+  return !c->up && ((int32_t)(millis() - c->next) >= 0);
+}
+
+void conn_up(CONN *c) {
+  c->up = true;
+  c->fails = 0;
+  c->connects++;
+  c->since = millis();
+}
+
+void conn_down(CONN *c) {
+  if (c->up) c->losses++;
+  c->up = false;
+  c->since = millis();
+  c->next = c->since;
+}
+
+// Result of an attempt which blocked dt us
+void conn_attempt(CONN *c, bool ok, uint32_t dt) {
+  c->attempts++;
+  c->blocked_us += dt;
+  if (dt > c->blocked_max_us) c->blocked_max_us = dt;
+  if (ok) {
+    conn_up(c);
+    return;
+  }
+  uint32_t delay = c->backoff_min;
+  for (int i = 0; (i < c->fails) && (delay < c->backoff_max); i++) delay *= 2;
+  if (delay > c->backoff_max) delay = c->backoff_max;
+  if (c->fails < 255) c->fails++;
+  c->next = millis() + delay / 2 + random(delay / 2 + 1);
+}
+
+#endif  /* _CONN_H */
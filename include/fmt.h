@@ -0,0 +1,123 @@
+#ifndef _FMT_H
+#define _FMT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Text output into a caller buffer, no allocation and no printf : integers, fixed-point
+// values and JSON members. The text is always 0 terminated, cut at the buffer size.
+
+struct FMT {
+  char *buf;
+  size_t size;
+  size_t len;
+  bool overflow;
+  bool first;       // nothing written yet in the current JSON object / array
+};
+
+void fmt_init(FMT *f, char *buf, size_t size) {
+  f->buf = buf;
+  f->size = size;
+  f->len = 0;
+  f->overflow = false;
+  f->first = true;
+  buf[0] = 0;
+}
+
+void fmt_char(FMT *f, char c) {
+  if (f->len + 1 >= f->size) {
+    f->overflow = true;
+    return;
+  }
+  f->buf[f->len++] = c;
+  f->buf[f->len] = 0;
+}
+
+void fmt_str(FMT *f, const char *s) {
+  while (*s) fmt_char(f, *s++);
+}
+
+// At least width digits, padded with pad ("%05u" : 5, '0')
+void fmt_uint(FMT *f, uint32_t v, uint8_t width = 0, char pad = ' ') {
+  char d[10];
+  int n = 0;
+  do {
+    d[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v > 0);
+  for (int i = n; i < width; i++) fmt_char(f, pad);
+  while (n > 0) fmt_char(f, d[--n]);
+}
+
+void fmt_int(FMT *f, int32_t v) {
+  if (v < 0) fmt_char(f, '-');
+  fmt_uint(f, (v < 0) ? -(uint32_t)v : v);
+}
+
+// Fixed-point value with dec decimals (184, 2 -> "1.84")
+void fmt_ufixed(FMT *f, uint32_t v, uint8_t dec) {
+  uint32_t div = 1;
+  for (int i = 0; i < dec; i++) div *= 10;
+  fmt_uint(f, v / div);
+  if (dec == 0) return;
+  fmt_char(f, '.');
+  fmt_uint(f, v % div, dec, '0');
+}
+
+void fmt_fixed(FMT *f, int32_t v, uint8_t dec) {
+  if (v < 0) fmt_char(f, '-');
+  fmt_ufixed(f, (v < 0) ? -(uint32_t)v : v, dec);
+}
+
+// JSON : fmt_open(f, '{'), members with fmt_key, fmt_close(f, '}').
+// Arrays : fmt_open(f, '['), fmt_next before each item, fmt_close(f, ']').
+void fmt_open(FMT *f, char c) {
+  fmt_char(f, c);
+  f->first = true;
+}
+
+void fmt_close(FMT *f, char c) {
+  fmt_char(f, c);
+  f->first = false;
+}
+
+void fmt_next(FMT *f) {
+  if (!f->first) fmt_char(f, ',');
+  f->first = false;
+}
+
+void fmt_key(FMT *f, const char *key) {
+  fmt_next(f);
+  fmt_char(f, '"');
+  fmt_str(f, key);
+  fmt_str(f, "\": ");
+}
+
+void fmt_json_uint(FMT *f, const char *key, uint32_t v) {
+  fmt_key(f, key);
+  fmt_uint(f, v);
+}
+
+void fmt_json_int(FMT *f, const char *key, int32_t v) {
+  fmt_key(f, key);
+  fmt_int(f, v);
+}
+
+void fmt_json_fixed(FMT *f, const char *key, int32_t v, uint8_t dec) {
+  fmt_key(f, key);
+  fmt_fixed(f, v, dec);
+}
+
+void fmt_json_ufixed(FMT *f, const char *key, uint32_t v, uint8_t dec) {
+  fmt_key(f, key);
+  fmt_ufixed(f, v, dec);
+}
+
+void fmt_json_str(FMT *f, const char *key, const char *s) {
+  fmt_key(f, key);
+  fmt_char(f, '"');
+  for (; *s; s++) if ((*s >= ' ') && (*s != '"') && (*s != '\\')) fmt_char(f, *s);  // no escapes
+  fmt_char(f, '"');
+}
+
+#endif  /* _FMT_H */
@@ -0,0 +1,253 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <crc16.h>
+#include <agg.h>
+#include <fmt.h>
+
+// Time-series log in LittleFS : one fixed size record per closed minute and quarter-hour
+// interval (agg.h).
+//
+// Each log is a ring of append-only segment files "<dir>/<first record number, hex>",
+// the oldest segment is removed when the ring is full. A segment stays below one flash
+// block (4 KB), so an append copies at most one block, and LittleFS moves the blocks
+// around the whole partition (wear levelling).
+//
+// Closed records are kept in RAM and written HIST_BATCH minutes at a time, both logs
+// together, so flash is written 96 times a day :
+//   data   : 1440 minute + 96 quarter records x 48 bytes = ~74 KB/day
+//   erases : 2 tail block copies per write + segment rotation + metadata commits,
+//            about 250 block erases/day
+// On the 1 MB LittleFS partition of a d1_mini (~250 blocks) this is about one erase per
+// block and per day, 100k erase cycles last far longer than the device. A reset loses
+// the records not written yet, at most HIST_BATCH minutes.
+//
+// Boot only lists the segment directory and reads the size of the newest segment.
+//
+// Stamps are meter time, in record order except once a year : on the last Sunday of
+// October the meter goes back from 03:00 to 02:00 and the 02:xx records come twice. Range
+// queries (hist_seek, hist_range) return both, in record order.
+
+#define HIST_SEG_RECS 64    // records per segment, 64 x 48 = 3 KB
+#define HIST_MIN_SEGS 45    // minute log : 45 x 64 records = 2 days
+#define HIST_QTR_SEGS 48    // quarter log : 48 x 64 records = 32 days
+#define HIST_BATCH 15       // minute records kept in RAM before a write
+#define HIST_DST_SCAN 120   // records scanned back by a seek into the repeated hour, 2 hours of minutes
+
+struct HIST_REC {
+  uint32_t stamp;       // YYMMDDhhmm, interval start (meter time)
+  uint32_t E_consumed;  // Wh, at interval end
+  uint32_t E_injected;
+  int32_t P_avg;        // W, consumed - injected
+  int32_t P_min;
+  int32_t P_max;
+  int16_t P_L[3];       // W, average per phase
+  uint16_t U_L[3];      // 0.1 V, average
+  uint16_t I_L[3];      // 0.01 A, max
+  uint16_t n;           // telegrams
+  uint16_t crc;         // CRC16 of the fields above
+};
+
+struct HIST_LOG {
+  const char *dir;
+  uint16_t segs_max;
+  HIST_REC *batch;      // closed records not written yet
+  uint8_t batch_size;
+  uint8_t pending = 0;
+  uint16_t segs = 0;
+  uint32_t first = 0;   // first record of the oldest segment
+  uint32_t next = 0;    // next record written to flash
+  uint32_t writes = 0;
+  uint32_t errors = 0;
+  HIST_LOG(const char *dir, uint16_t segs_max, HIST_REC *batch, uint8_t batch_size)
+    : dir(dir), segs_max(segs_max), batch(batch), batch_size(batch_size) {}
+};
+
+void hist_path(HIST_LOG *h, uint32_t seg, char *path) {
+  sprintf(path, "%s/%08x", h->dir, seg);
+}
+
+// Segments are numbered by their first record : a multiple of HIST_SEG_RECS
+uint32_t hist_seg(uint32_t n) {
+  return n - n % HIST_SEG_RECS;
+}
+
+void hist_scan(HIST_LOG *h) {
+  uint32_t last = 0;
+  size_t last_size = 0;
+  h->segs = 0;
+  Dir dir = LittleFS.openDir(h->dir);
+  while (dir.next()) {
+    uint32_t seg = strtoul(dir.fileName().c_str(), NULL, 16);
+    if ((h->segs == 0) || (seg < h->first)) h->first = seg;
+    if ((h->segs == 0) || (seg > last)) {
+      last = seg;
+      last_size = dir.fileSize();
+    }
+    h->segs++;
+  }
+  h->next = (h->segs > 0) ? last + last_size / sizeof(HIST_REC) : 0;
+  if (last_size % sizeof(HIST_REC)) {
+    // torn write : drop the partial record
+    char path[24];
+    hist_path(h, last, path);
+    File f = LittleFS.open(path, "r+");
+    if (f) {
+      f.truncate((h->next - last) * sizeof(HIST_REC));
+      f.close();
+    }
+  }
+}
+
+void hist_begin(HIST_LOG *h) {
+  LittleFS.mkdir(h->dir);
+  hist_scan(h);
+}
+
+// Write the closed records, starting a new segment (and dropping the oldest) when needed
+void hist_write(HIST_LOG *h) {
+  int i = 0;
+  while (i < h->pending) {
+    if ((h->segs == 0) || (h->next == hist_seg(h->next))) {
+      h->segs++;
+      if (h->segs == 1) h->first = h->next;
+      if (h->segs > h->segs_max) {
+        char path[24];
+        hist_path(h, h->first, path);
+        LittleFS.remove(path);
+        hist_scan(h);
+        h->segs++;
+      }
+    }
+    int n = HIST_SEG_RECS - (h->next - hist_seg(h->next));
+    if (n > h->pending - i) n = h->pending - i;
+    char path[24];
+    hist_path(h, hist_seg(h->next), path);
+    File f = LittleFS.open(path, "a");
+    size_t len = n * sizeof(HIST_REC);
+    if (!f || (f.write((const uint8_t *)&h->batch[i], len) != len)) {
+      // keep going, the records are lost but the ring stays consistent
+      h->errors++;
+      if (f) f.close();
+      hist_scan(h);
+      break;
+    }
+    f.close();
+    h->next += n;
+    h->writes++;
+    i += n;
+  }
+  h->pending = 0;
+}
+
+void hist_rec(HIST_REC *r, const AGG *a) {
+  r->stamp = a->stamp;
+  r->E_consumed = a->E_consumed;
+  r->E_injected = a->E_injected;
+  r->P_avg = agg_avg(a, AGG_P);
+  r->P_min = a->min[AGG_P];
+  r->P_max = a->max[AGG_P];
+  for (int l = 0; l < 3; l++) {
+    r->P_L[l] = agg_avg(a, AGG_P_L1 + l);
+    r->U_L[l] = agg_avg(a, AGG_U_L1 + l);
+    r->I_L[l] = a->max[AGG_I_L1 + l];
+  }
+  r->n = a->n;
+  r->crc = crc16_update(0, (const char *)r, offsetof(HIST_REC, crc));
+}
+
+// Queue a closed interval, written by the next hist_write()
+void hist_add(HIST_LOG *h, const AGG *a) {
+  if ((a->n == 0) || (h->pending >= h->batch_size)) return;
+  hist_rec(&h->batch[h->pending++], a);
+}
+
+// Records kept : [first, hist_end()), the last ones still in RAM
+uint32_t hist_end(HIST_LOG *h) {
+  return h->next + h->pending;
+}
+
+bool hist_read(HIST_LOG *h, uint32_t n, HIST_REC *r) {
+  if ((n < h->first) || (n >= hist_end(h))) return false;
+  if (n >= h->next) {
+    *r = h->batch[n - h->next];
+    return true;
+  }
+  char path[24];
+  hist_path(h, hist_seg(n), path);
+  File f = LittleFS.open(path, "r");
+  if (!f) return false;
+  bool ok = f.seek((n - hist_seg(n)) * sizeof(HIST_REC), SeekSet) &&
+            (f.read((uint8_t *)r, sizeof(HIST_REC)) == sizeof(HIST_REC));
+  f.close();
+  return ok && (r->crc == crc16_update(0, (const char *)r, offsetof(HIST_REC, crc)));
+}
+
+// Stamp in the hour logged twice when summer time ends (02:00 - 02:59, last Sunday of
+// October) : any day from the 25th, the weekday is not worth computing
+bool hist_repeated(uint32_t stamp) {
+  uint32_t mmdd = stamp / 10000 % 10000;
+  return (mmdd >= 1025) && (mmdd <= 1031) && (stamp / 100 % 100 == 2);
+}
+
+// First record at or after stamp : binary search, stamps are in order outside the repeated
+// hour. A stamp in it may have found its second time, the records before are scanned.
+uint32_t hist_seek(HIST_LOG *h, uint32_t stamp) {
+  uint32_t lo = h->first;
+  uint32_t hi = hist_end(h);
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    HIST_REC r;
+    if (!hist_read(h, mid, &r) || (r.stamp < stamp)) lo = mid + 1; else hi = mid;
+  }
+  if (!hist_repeated(stamp)) return lo;
+  for (uint32_t n = (lo - h->first > HIST_DST_SCAN) ? lo - HIST_DST_SCAN : h->first; n < lo; n++) {
+    HIST_REC r;
+    if (hist_read(h, n, &r) && (r.stamp >= stamp)) return n;
+  }
+  return lo;
+}
+
+// Record of a range query after hist_seek(from) : 0 in [from, to], -1 out of it, skip it,
+// 1 past to, the query is over (a record of the repeated hour past to is skipped, the second
+// time of the hour may follow)
+int hist_range(uint32_t stamp, uint32_t from, uint32_t to) {
+  if (stamp > to) return hist_repeated(stamp) ? -1 : 1;
+  return (stamp < from) ? -1 : 0;
+}
+
+void hist_text(const HIST_REC *r, char *st) {
+  sprintf(st, "%010u %4u %9u %9u %6i %6i %6i %6i %6i %6i %3u.%u %3u.%u %3u.%u %2u.%02u %2u.%02u %2u.%02u",
+          r->stamp, r->n, r->E_consumed, r->E_injected, r->P_avg, r->P_min, r->P_max,
+          r->P_L[0], r->P_L[1], r->P_L[2],
+          r->U_L[0] / 10, r->U_L[0] % 10, r->U_L[1] / 10, r->U_L[1] % 10, r->U_L[2] / 10, r->U_L[2] % 10,
+          r->I_L[0] / 100, r->I_L[0] % 100, r->I_L[1] / 100, r->I_L[1] % 100, r->I_L[2] / 100, r->I_L[2] % 100);
+}
+
+void hist_json(const HIST_REC *r, FMT *f) {
+  fmt_open(f, '{');
+  fmt_json_uint(f, "t", r->stamp);
+  fmt_json_uint(f, "n", r->n);
+  fmt_json_uint(f, "E_consumed", r->E_consumed);
+  fmt_json_uint(f, "E_injected", r->E_injected);
+  fmt_json_int(f, "P_avg", r->P_avg);
+  fmt_json_int(f, "P_min", r->P_min);
+  fmt_json_int(f, "P_max", r->P_max);
+  fmt_key(f, "P_L");
+  fmt_open(f, '[');
+  for (int i = 0; i < 3; i++) { fmt_next(f); fmt_int(f, r->P_L[i]); }
+  fmt_close(f, ']');
+  fmt_key(f, "U_L");
+  fmt_open(f, '[');
+  for (int i = 0; i < 3; i++) { fmt_next(f); fmt_ufixed(f, r->U_L[i], 1); }
+  fmt_close(f, ']');
+  fmt_key(f, "I_L_max");
+  fmt_open(f, '[');
+  for (int i = 0; i < 3; i++) { fmt_next(f); fmt_ufixed(f, r->I_L[i], 2); }
+  fmt_close(f, ']');
+  fmt_close(f, '}');
+}
+
+#endif  /* _HISTORY_H */
@@ -0,0 +1,229 @@
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+#include <fmt.h>
+
+// Minimal HTTP server for live readings :
+//   GET /api/now      JSON of the last decoded values, connection closed after it,
+//                     503 before the first telegram
+//   GET /api/stream   Server-Sent Events, one event per decoded telegram
+//
+// An event is rendered once per telegram into one of two buffers and every client sends
+// it from there with its own cursor, as the relay ports do with the telegram. A client
+// still sending an event when its buffer is reused (two telegrams later) is dropped.
+// Nothing blocks : requests are read and events written as the sockets allow.
+
+#define HTTP_MAX_CLIENTS 4
+#define HTTP_REQ_SIZE 64        // start of the request kept, enough for the request line
+#define HTTP_TIMEOUT 2000       // ms to receive a request
+#define HTTP_CHUNK 512          // max bytes written per client per run
+#define HTTP_EVENT_SIZE 1024    // largest event 861 bytes, every field and M-Bus channel at max
+
+enum HTTP_STATE : uint8_t {
+  HTTP_FREE = 0,
+  HTTP_REQUEST,     // reading the request
+  HTTP_HEAD,        // sending the response header
+  HTTP_BODY,        // /api/now : sending the JSON, then close
+  HTTP_STREAM       // /api/stream : sending events
+};
+
+struct HTTP_EVENT {
+  uint32_t seq = 0;
+  int len = 0;              // "id: <seq>\ndata: <json>\n\n"
+  int json = 0;             // offset of the JSON
+  int json_len = 0;
+  char buf[HTTP_EVENT_SIZE];
+};
+
+struct HTTP_CLIENT {
+  WiFiClient client;
+  uint8_t state = HTTP_FREE;
+  bool stream = false;
+  char req[HTTP_REQ_SIZE];
+  uint8_t req_len = 0;
+  uint32_t tail = 0;        // last 4 request bytes, end of header at "\r\n\r\n"
+  uint32_t since = 0;       // ms, connection accepted
+  const char *head = NULL;  // response header
+  int pos = 0;
+  uint32_t seq = 0;         // event being sent
+};
+
+struct HTTP_SERVER {
+  WiFiServer server;
+  uint32_t seq = 0;         // events rendered
+  HTTP_EVENT ev[2];         // ev[seq & 1] is the last one
+  uint32_t requests = 0;
+  uint32_t rejected = 0;
+  uint32_t dropped = 0;
+  HTTP_CLIENT cl[HTTP_MAX_CLIENTS];
+  HTTP_SERVER(uint16_t port) : server(port) {}
+};
+
+const char http_json_head[] =
+  "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nCache-Control: no-cache\r\n"
+  "Access-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n";
+const char http_stream_head[] =
+  "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+  "Access-Control-Allow-Origin: *\r\nConnection: keep-alive\r\n\r\nretry: 3000\n\n";
+const char http_404[] =
+  "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n"
+  "GET /api/now or /api/stream\n";
+const char http_503[] =
+  "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n\r\n";
+
+void http_close(HTTP_CLIENT *c) {
+  c->client.stop();
+  c->state = HTTP_FREE;
+}
+
+// Any client connected : events are only rendered then
+bool http_active(const HTTP_SERVER *h) {
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    if (h->cl[i].state != HTTP_FREE) return true;
+  }
+  return false;
+}
+
+void http_accept(HTTP_SERVER *h) {
+  WiFiClient client = h->server.available();
+  if (!client) return;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    HTTP_CLIENT *c = &h->cl[i];
+    if (c->state == HTTP_FREE) {
+      c->client = client;
+      c->client.setNoDelay(true);
+      c->state = HTTP_REQUEST;
+      c->req_len = 0;
+      c->tail = 0;
+      c->since = millis();
+      return;
+    }
+  }
+  client.write((const uint8_t *)http_503, sizeof(http_503) - 1);
+  client.stop();
+  h->rejected++;
+}
+
+bool http_path(const HTTP_CLIENT *c, const char *path) {
+  int n = strlen(path);
+  return (c->req_len > n) && (memcmp(c->req, path, n) == 0) && ((c->req[n] == ' ') || (c->req[n] == '?'));
+}
+
+// Read what has arrived of the request, answer once the header is complete
+void http_request(HTTP_SERVER *h, HTTP_CLIENT *c) {
+  uint8_t buf[64];
+  int n;
+  while ((c->state == HTTP_REQUEST) && ((n = c->client.available()) > 0)) {
+    if (n > (int)sizeof(buf)) n = sizeof(buf);
+    n = c->client.read(buf, n);
+    if (n <= 0) break;
+    for (int i = 0; (i < n) && (c->state == HTTP_REQUEST); i++) {
+      if (c->req_len < HTTP_REQ_SIZE) c->req[c->req_len++] = buf[i];
+      c->tail = (c->tail << 8) | buf[i];
+      if (c->tail != 0x0D0A0D0A) continue;
+      h->requests++;
+      c->stream = http_path(c, "GET /api/stream");
+      if (c->stream) c->head = http_stream_head;
+      else if (!http_path(c, "GET /api/now")) c->head = http_404;
+      else c->head = (h->seq > 0) ? http_json_head : http_503;   // nothing to send yet
+      c->state = HTTP_HEAD;
+      c->pos = 0;
+    }
+  }
+  if ((c->state == HTTP_REQUEST) && (millis() - c->since > HTTP_TIMEOUT)) http_close(c);
+}
+
+// Start a new event : returns a formatter for its JSON, the event buffer is the one of
+// two events ago, its clients are too slow
+void http_event_begin(HTTP_SERVER *h, FMT *f) {
+  uint32_t seq = h->seq + 1;
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    HTTP_CLIENT *c = &h->cl[i];
+    if ((c->state < HTTP_BODY) || (c->seq == 0) || (seq - c->seq != 2)) continue;
+    if ((c->state == HTTP_BODY) || (c->pos < h->ev[c->seq & 1].len)) {
+      http_close(c);
+      h->dropped++;
+    }
+  }
+  HTTP_EVENT *e = &h->ev[seq & 1];
+  e->seq = seq;
+  fmt_init(f, e->buf, sizeof(e->buf) - 2);
+  fmt_str(f, "id: ");
+  fmt_uint(f, seq);
+  fmt_str(f, "\ndata: ");
+  e->json = f->len;
+}
+
+void http_event_end(HTTP_SERVER *h, FMT *f) {
+  HTTP_EVENT *e = &h->ev[(h->seq + 1) & 1];
+  e->json_len = f->len - e->json;
+  f->size += 2;
+  fmt_str(f, "\n\n");
+  e->len = f->len;
+  h->seq++;
+}
+
+// Write what fits in the socket, returns false when the socket is full
+bool http_write(HTTP_CLIENT *c, const char *p, int len, int *room) {
+  while ((*room > 0) && (c->pos < len)) {
+    int n = len - c->pos;
+    if (n > *room) n = *room;
+    n = c->client.write((const uint8_t *)p + c->pos, n);
+    if (n <= 0) return false;
+    c->pos += n;
+    *room -= n;
+  }
+  return c->pos == len;
+}
+
+void http_send(HTTP_SERVER *h, HTTP_CLIENT *c) {
+  int room = c->client.availableForWrite();
+  if (room > HTTP_CHUNK) room = HTTP_CHUNK;
+  if (c->state == HTTP_HEAD) {
+    if (!http_write(c, c->head, strlen(c->head), &room)) return;
+    if (c->head != (c->stream ? http_stream_head : http_json_head)) {
+      http_close(c);  // error page sent
+      return;
+    }
+    c->state = c->stream ? HTTP_STREAM : HTTP_BODY;
+    c->seq = 0;
+    c->pos = 0;
+  }
+  // start with the last event, once there is one
+  if (c->seq == 0) {
+    if (h->seq == 0) return;
+    c->seq = h->seq;
+  }
+  if (c->state == HTTP_BODY) {
+    const HTTP_EVENT *e = &h->ev[c->seq & 1];
+    c->pos += e->json;
+    bool done = http_write(c, e->buf, e->json + e->json_len, &room);
+    c->pos -= e->json;
+    if (done) http_close(c);
+    return;
+  }
+  while (c->state == HTTP_STREAM) {
+    const HTTP_EVENT *e = &h->ev[c->seq & 1];
+    if (!http_write(c, e->buf, e->len, &room)) return;
+    if (c->seq == h->seq) return;
+    c->seq = h->seq;  // done with this one, on to the last event
+    c->pos = 0;
+  }
+}
+
+void http_poll(HTTP_SERVER *h) {
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    HTTP_CLIENT *c = &h->cl[i];
+    if (c->state == HTTP_FREE) continue;
+    if (!c->client.connected()) {
+      http_close(c);
+      continue;
+    }
+    if (c->state == HTTP_REQUEST) http_request(h, c);
+    if (c->state >= HTTP_HEAD) http_send(h, c);
+  }
+}
+
+#endif  /* _HTTP_H */
@@ -0,0 +1,63 @@
+#ifndef _LAT_H
+#define _LAT_H
+
+#include <stdint.h>
+
+// Latency histograms : fixed size, LAT_SUB log buckets per power of 2 (values within 25%),
+// adding a value is a few instructions. Build with -DLAT_STATS=0 to remove them.
+
+#ifndef LAT_STATS
+#define LAT_STATS 1
+#endif
+
+#define LAT_SUB 4                     // buckets per power of 2
+#define LAT_BUCKETS (20 * LAT_SUB)    // up to 2^21 us (2 s), longer in the last bucket
+
+struct LAT_HIST {
+  uint32_t count = 0;
+  uint32_t max = 0;
+  uint32_t bucket[LAT_BUCKETS] = {};
+};
+
+// 0..3 have their own bucket, then [2^e, 2^(e+1)) is split in 4
+int lat_bucket(uint32_t us) {
+  if (us < LAT_SUB) return us;
+  int e = 31 - __builtin_clz(us);
+  int b = (e - 1) * LAT_SUB + ((us >> (e - 2)) & (LAT_SUB - 1));
+  return (b < LAT_BUCKETS) ? b : LAT_BUCKETS - 1;
+}
+
+// Lowest value of a bucket
+uint32_t lat_floor(int b) {
+  if (b < LAT_SUB) return b;
+  return (uint32_t)(LAT_SUB + b % LAT_SUB) << (b / LAT_SUB - 1);
+}
+
+void lat_add(LAT_HIST *h, uint32_t us) {
+  h->bucket[lat_bucket(us)]++;
+  h->count++;
+  if (us > h->max) h->max = us;
+}
+
+// Upper bound of the pct percentile
+uint32_t lat_pct(const LAT_HIST *h, uint32_t pct) {
+  if (h->count == 0) return 0;
+  uint32_t rank = ((uint64_t)h->count * pct + 99) / 100;
+  uint32_t n = 0;
+  for (int b = 0; b < LAT_BUCKETS - 1; b++) {
+    n += h->bucket[b];
+    if (n >= rank) {
+      uint32_t v = lat_floor(b + 1) - 1;
+      return (v < h->max) ? v : h->max;
+    }
+  }
+  return h->max;
+}
+
+#if LAT_STATS
+#define LAT_ADD(h, us) lat_add(&(h), (us))
+#else
+#define LAT_ADD(h, us) ((void)0)
+#endif
+
+#endif  /* _LAT_H */
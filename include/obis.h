@@ -0,0 +1,328 @@
+#ifndef _OBIS_H
+#define _OBIS_H
+
+#include <stdint.h>
+#include <string.h>
+
+// OBIS fields decoded from the P1 telegram
+enum OBIS_ID : uint8_t {
+  OBIS_NONE = 0,
+  OBIS_DATETIME,      // 0-0:1.0.0   YYMMDDhhmmssX
+  OBIS_E_CONS_1,      // 1-0:1.8.1   Wh
+  OBIS_E_CONS_2,      // 1-0:1.8.2   Wh
+  OBIS_E_INJ_1,       // 1-0:2.8.1   Wh
+  OBIS_E_INJ_2,       // 1-0:2.8.2   Wh
+  OBIS_P_CONS,        // 1-0:1.7.0   W
+  OBIS_P_INJ,         // 1-0:2.7.0   W
+  OBIS_P_CONS_L1,     // 1-0:21.7.0  W
+  OBIS_P_CONS_L2,     // 1-0:41.7.0  W
+  OBIS_P_CONS_L3,     // 1-0:61.7.0  W
+  OBIS_P_INJ_L1,      // 1-0:22.7.0  W
+  OBIS_P_INJ_L2,      // 1-0:42.7.0  W
+  OBIS_P_INJ_L3,      // 1-0:62.7.0  W
+  OBIS_U_L1,          // 1-0:32.7.0  0.1 V
+  OBIS_U_L2,          // 1-0:52.7.0  0.1 V
+  OBIS_U_L3,          // 1-0:72.7.0  0.1 V
+  OBIS_I_L1,          // 1-0:31.7.0  0.01 A
+  OBIS_I_L2,          // 1-0:51.7.0  0.01 A
+  OBIS_I_L3,          // 1-0:71.7.0  0.01 A
+  OBIS_PEAK,          // 1-0:1.4.0   W (current quarter-hour average demand)
+  OBIS_COUNT
+};
+
+// Decimals of the values kept, relative to the telegram unit (kWh -> Wh : 3)
+constexpr uint8_t obis_decimals(OBIS_ID id) {
+  return ((id >= OBIS_U_L1) && (id <= OBIS_U_L3)) ? 1 :
+         ((id >= OBIS_I_L1) && (id <= OBIS_I_L3)) ? 2 :
+         (id == OBIS_DATETIME) ? 0 : 3;
+}
+
+constexpr uint8_t obis_strlen(const char *s) {
+  return (*s == 0) ? 0 : 1 + obis_strlen(s + 1);
+}
+
+constexpr uint16_t obis_pow10(int n) {
+  return (n <= 0) ? 1 : 10 * obis_pow10(n - 1);
+}
+
+struct OBIS_FIELD {
+  const char *code;
+  const char *unit;
+  uint8_t len;
+  uint8_t dec;        // decimals in the telegram
+  OBIS_ID id;
+  uint16_t scale;     // telegram digits to kept value
+  constexpr OBIS_FIELD(const char *code, const char *unit, uint8_t dec, OBIS_ID id)
+    : code(code), unit(unit), len(obis_strlen(code)), dec(dec), id(id),
+      scale(obis_pow10(obis_decimals(id) - dec)) {}
+};
+
+
+// Meter profiles, selected at build time (-DMETER_PROFILE=METER_DSMR5) : a build only
+// holds and looks up the fields of its meter.
+//
+// Smarty meters (Luxembourg) send their telegram as an AES-128-GCM encrypted DLMS frame,
+// which this firmware does not decrypt : METER_LUX_DECRYPTED reads the plain telegram
+// once decrypted by a bridge in front of the P1 port (with the key of the grid operator).
+#define METER_FLUVIUS 1   // Belgium, Fluvius (FLU5 header)
+#define METER_DSMR5   2   // Netherlands, DSMR 5.0.2
+#define METER_ESMR5   METER_DSMR5   // alias : ESMR 5.0 has the P1 layout of DSMR 5.0.2
+#define METER_LUX     3   // Luxembourg, Smarty as sent by the meter : not supported
+#define METER_LUX_DECRYPTED 4   // Luxembourg, Smarty telegram decrypted (single tariff registers)
+
+#ifndef METER_PROFILE
+#define METER_PROFILE METER_FLUVIUS
+#endif
+
+#if METER_PROFILE == METER_FLUVIUS
+#define METER_NAME "Fluvius"
+constexpr OBIS_FIELD obis_fields[] = {
+  // code          unit    dec  field
+  { "0-0:1.0.0",   "",     0,   OBIS_DATETIME },
+  { "1-0:1.8.1",   "kWh",  3,   OBIS_E_CONS_1 },
+  { "1-0:1.8.2",   "kWh",  3,   OBIS_E_CONS_2 },
+  { "1-0:2.8.1",   "kWh",  3,   OBIS_E_INJ_1 },
+  { "1-0:2.8.2",   "kWh",  3,   OBIS_E_INJ_2 },
+  { "1-0:1.4.0",   "kW",   3,   OBIS_PEAK },
+  { "1-0:1.7.0",   "kW",   3,   OBIS_P_CONS },
+  { "1-0:2.7.0",   "kW",   3,   OBIS_P_INJ },
+  { "1-0:21.7.0",  "kW",   3,   OBIS_P_CONS_L1 },
+  { "1-0:41.7.0",  "kW",   3,   OBIS_P_CONS_L2 },
+  { "1-0:61.7.0",  "kW",   3,   OBIS_P_CONS_L3 },
+  { "1-0:22.7.0",  "kW",   3,   OBIS_P_INJ_L1 },
+  { "1-0:42.7.0",  "kW",   3,   OBIS_P_INJ_L2 },
+  { "1-0:62.7.0",  "kW",   3,   OBIS_P_INJ_L3 },
+  { "1-0:32.7.0",  "V",    1,   OBIS_U_L1 },
+  { "1-0:52.7.0",  "V",    1,   OBIS_U_L2 },
+  { "1-0:72.7.0",  "V",    1,   OBIS_U_L3 },
+  { "1-0:31.7.0",  "A",    2,   OBIS_I_L1 },
+  { "1-0:51.7.0",  "A",    2,   OBIS_I_L2 },
+  { "1-0:71.7.0",  "A",    2,   OBIS_I_L3 },
+};
+#elif METER_PROFILE == METER_DSMR5
+#define METER_NAME "DSMR 5"
+constexpr OBIS_FIELD obis_fields[] = {
+  // code          unit    dec  field
+  { "0-0:1.0.0",   "",     0,   OBIS_DATETIME },
+  { "1-0:1.8.1",   "kWh",  3,   OBIS_E_CONS_1 },
+  { "1-0:1.8.2",   "kWh",  3,   OBIS_E_CONS_2 },
+  { "1-0:2.8.1",   "kWh",  3,   OBIS_E_INJ_1 },
+  { "1-0:2.8.2",   "kWh",  3,   OBIS_E_INJ_2 },
+  { "1-0:1.7.0",   "kW",   3,   OBIS_P_CONS },
+  { "1-0:2.7.0",   "kW",   3,   OBIS_P_INJ },
+  { "1-0:32.7.0",  "V",    1,   OBIS_U_L1 },
+  { "1-0:52.7.0",  "V",    1,   OBIS_U_L2 },
+  { "1-0:72.7.0",  "V",    1,   OBIS_U_L3 },
+  { "1-0:31.7.0",  "A",    0,   OBIS_I_L1 },
+  { "1-0:51.7.0",  "A",    0,   OBIS_I_L2 },
+  { "1-0:71.7.0",  "A",    0,   OBIS_I_L3 },
+  { "1-0:21.7.0",  "kW",   3,   OBIS_P_CONS_L1 },
+  { "1-0:41.7.0",  "kW",   3,   OBIS_P_CONS_L2 },
+  { "1-0:61.7.0",  "kW",   3,   OBIS_P_CONS_L3 },
+  { "1-0:22.7.0",  "kW",   3,   OBIS_P_INJ_L1 },
+  { "1-0:42.7.0",  "kW",   3,   OBIS_P_INJ_L2 },
+  { "1-0:62.7.0",  "kW",   3,   OBIS_P_INJ_L3 },
+};
+#elif METER_PROFILE == METER_LUX
+#error METER_LUX : Smarty frames are AES-128-GCM encrypted, use METER_LUX_DECRYPTED behind a decrypting bridge
+#elif METER_PROFILE == METER_LUX_DECRYPTED
+#define METER_NAME "Smarty (decrypted)"
+constexpr OBIS_FIELD obis_fields[] = {
+  // code          unit    dec  field
+  { "0-0:1.0.0",   "",     0,   OBIS_DATETIME },
+  { "1-0:1.8.0",   "kWh",  3,   OBIS_E_CONS_1 },
+  { "1-0:2.8.0",   "kWh",  3,   OBIS_E_INJ_1 },
+  { "1-0:1.7.0",   "kW",   3,   OBIS_P_CONS },
+  { "1-0:2.7.0",   "kW",   3,   OBIS_P_INJ },
+  { "1-0:32.7.0",  "V",    1,   OBIS_U_L1 },
+  { "1-0:52.7.0",  "V",    1,   OBIS_U_L2 },
+  { "1-0:72.7.0",  "V",    1,   OBIS_U_L3 },
+  { "1-0:31.7.0",  "A",    0,   OBIS_I_L1 },
+  { "1-0:51.7.0",  "A",    0,   OBIS_I_L2 },
+  { "1-0:71.7.0",  "A",    0,   OBIS_I_L3 },
+  { "1-0:21.7.0",  "kW",   3,   OBIS_P_CONS_L1 },
+  { "1-0:41.7.0",  "kW",   3,   OBIS_P_CONS_L2 },
+  { "1-0:61.7.0",  "kW",   3,   OBIS_P_CONS_L3 },
+  { "1-0:22.7.0",  "kW",   3,   OBIS_P_INJ_L1 },
+  { "1-0:42.7.0",  "kW",   3,   OBIS_P_INJ_L2 },
+  { "1-0:62.7.0",  "kW",   3,   OBIS_P_INJ_L3 },
+};
+#else
+#error Unknown METER_PROFILE
+#endif
+
+#define OBIS_FIELDS (sizeof(obis_fields) / sizeof(obis_fields[0]))
+
+
+// Dispatch : the code hashes to a slot holding its field, built and checked at compile time.
+// Codes not in the profile land on an empty slot or fail the compare.
+#define OBIS_HASH_SIZE 128
+#define OBIS_HASH_MUL 659
+
+constexpr uint8_t obis_key(const char *code, uint8_t len) {
+  uint32_t h = 0;
+  for (uint8_t i = 0; i < len; i++) h = h * OBIS_HASH_MUL + (uint8_t)code[i];
+  return (h ^ (h >> 7)) % OBIS_HASH_SIZE;
+}
+
+struct OBIS_DISPATCH {
+  uint8_t slot[OBIS_HASH_SIZE];   // field index + 1, 0 : none
+  uint16_t scale[OBIS_COUNT];     // per field, to write values back (rewrite)
+  bool collision;
+};
+
+constexpr OBIS_DISPATCH obis_dispatch_build() {
+  OBIS_DISPATCH d = {};
+  for (uint8_t i = 0; i < OBIS_COUNT; i++) d.scale[i] = 1;
+  for (uint8_t i = 0; i < OBIS_FIELDS; i++) {
+    uint8_t k = obis_key(obis_fields[i].code, obis_fields[i].len);
+    if (d.slot[k] != 0) d.collision = true;
+    d.slot[k] = i + 1;
+    d.scale[obis_fields[i].id] = obis_fields[i].scale;
+  }
+  return d;
+}
+
+constexpr OBIS_DISPATCH obis_dispatch = obis_dispatch_build();
+static_assert(!obis_dispatch.collision, "OBIS code hash collision, change OBIS_HASH_MUL");
+
+
+// M-Bus devices on channels 0-1: to 0-4: (gas, water, heat...), told apart by the device
+// type of 0-n:24.1.0. Their reading (0-n:24.2.x) carries the capture time of the device,
+// which changes every few minutes only.
+#define MBUS_CHANNELS 4
+
+// Device types (EN 13757-3)
+enum MBUS_TYPE : uint8_t {
+  MBUS_NONE = 0,
+  MBUS_GAS = 3,
+  MBUS_HEAT = 4,
+  MBUS_WARM_WATER = 6,
+  MBUS_WATER = 7,
+  MBUS_COOLING = 10,
+};
+
+struct MBUS_VAL {
+  uint8_t type;     // MBUS_TYPE, 0 : no device
+  char unit[4];     // "m3", "GJ"...
+  uint32_t date;    // YYMMDD capture time
+  uint32_t time;    // hhmmss
+  uint32_t value;   // 0.001 unit
+};
+
+const char *mbus_type_name(uint8_t type) {
+  switch (type) {
+    case MBUS_GAS: return "gas";
+    case MBUS_HEAT: return "heat";
+    case MBUS_WARM_WATER: return "warm_water";
+    case MBUS_WATER: return "water";
+    case MBUS_COOLING: return "cooling";
+  }
+  return "other";
+}
+
+// Decoded values, indexed by OBIS_ID
+struct OBIS_VAL {
+  uint32_t val[OBIS_COUNT];
+  uint32_t date;    // YYMMDD from OBIS_DATETIME
+  uint32_t time;    // hhmmss from OBIS_DATETIME
+  MBUS_VAL mbus[MBUS_CHANNELS];
+};
+
+const OBIS_FIELD *obis_lookup(const char *code, uint8_t len) {
+  uint8_t i = obis_dispatch.slot[obis_key(code, len)];
+  if (i == 0) return NULL;
+  const OBIS_FIELD *f = &obis_fields[i - 1];
+  if ((f->len != len) || (memcmp(f->code, code, len) != 0)) return NULL;
+  return f;
+}
+
+// Fixed-point value : digits up to '*' or ')', decimal point dropped ("001.84*A" -> 184)
+uint32_t obis_value(const char *p, const char *end) {
+  uint32_t val = 0;
+  while ((p < end) && (*p != '*') && (*p != ')')) {
+    if ((*p >= '0') && (*p <= '9')) val = val * 10 + (*p - '0');
+    p++;
+  }
+  return val;
+}
+
+// Value with any number of decimals to 3 decimals ("12785.12*m3" -> 12785120)
+uint32_t mbus_value(const char *p, const char *end) {
+  uint32_t val = 0;
+  int dec = -1;
+  while ((p < end) && (*p != '*') && (*p != ')')) {
+    if ((*p >= '0') && (*p <= '9') && (dec < 3)) {
+      val = val * 10 + (*p - '0');
+      if (dec >= 0) dec++;
+    }
+    if (*p == '.') dec = 0;
+    p++;
+  }
+  for (dec = (dec < 0) ? 0 : dec; dec < 3; dec++) val *= 10;
+  return val;
+}
+
+// M-Bus line, code "0-n:" already checked : device type or reading
+void mbus_parse_line(const char *line, const char *paren, const char *end, OBIS_VAL *ov) {
+  MBUS_VAL *m = &ov->mbus[line[2] - '1'];
+  const char *p = paren + 1;
+  int len = paren - line - 4;
+  if ((len == 6) && (memcmp(line + 4, "24.1.0", 6) == 0)) {
+    m->type = obis_value(p, end);
+    return;
+  }
+  // 0-n:24.2.1 (DSMR), 24.2.3 (Fluvius gas) : (YYMMDDhhmmssX)(value*unit)
+  if ((len != 6) || (memcmp(line + 4, "24.2.", 5) != 0) || (end - p < 17) || (p[14] != '(')) return;
+  m->date = obis_value(p, p + 6);
+  m->time = obis_value(p + 6, p + 12);
+  p += 15;
+  m->value = mbus_value(p, end);
+  const char *u = (const char *)memchr(p, '*', end - p);
+  int n = 0;
+  if (u != NULL) {
+    for (u++; (u < end) && (*u != ')') && (n < (int)sizeof(m->unit) - 1); u++) m->unit[n++] = *u;
+  }
+  m->unit[n] = 0;
+}
+
+// Decode one telegram line ("code(value*unit)"), without line terminator, returns its field
+OBIS_ID obis_parse_line(const char *line, const char *end, OBIS_VAL *ov) {
+  const char *paren = (const char *)memchr(line, '(', end - line);
+  if ((paren == NULL) || (paren - line > 16)) return OBIS_NONE;
+  if ((line[0] == '0') && (line[1] == '-') && (line[2] >= '1') && (line[2] <= '0' + MBUS_CHANNELS) && (line[3] == ':')) {
+    mbus_parse_line(line, paren, end, ov);
+    return OBIS_NONE;
+  }
+  const OBIS_FIELD *f = obis_lookup(line, paren - line);
+  if (f == NULL) return OBIS_NONE;
+  const char *p = paren + 1;
+  if (f->id == OBIS_DATETIME) {
+    ov->date = 0;
+    ov->time = 0;
+    if (end - p >= 12) {
+      ov->date = obis_value(p, p + 6);
+      ov->time = obis_value(p + 6, p + 12);
+    }
+    return f->id;
+  }
+  ov->val[f->id] = obis_value(p, end) * f->scale;
+  return f->id;
+}
+
+// Single pass over the telegram text, one line at a time
+void obis_parse(const char *buf, int len, OBIS_VAL *ov) {
+  const char *p = buf;
+  const char *end = buf + len;
+  memset(ov, 0, sizeof(OBIS_VAL));
+  while (p < end) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if (eol == NULL) eol = end;
+    const char *le = eol;
+    if ((le > p) && (le[-1] == '\r')) le--;
+    if (le > p) obis_parse_line(p, le, ov);
+    p = eol + 1;
+  }
+}
+
+#endif  /* _OBIS_H */
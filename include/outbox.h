@@ -0,0 +1,187 @@
+#ifndef _OUTBOX_H
+#define _OUTBOX_H
+
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <crc16.h>
+#include <history.h>
+
+// Store-and-forward queue of closed intervals for MQTT : the records that could not be
+// published (broker down, publish failed) are kept and replayed once connected.
+//
+// The newest OUTBOX_RAM records stay in RAM. When RAM is full they are appended to
+// OUTBOX_FILE in one write, up to OUTBOX_FILE_RECS records, beyond that new records are
+// dropped. The file holds the oldest records and is replayed first, then removed. It
+// survives a reboot, records of it being sent at that moment may be sent twice.
+//
+// Records are history records (history.h), replayed in the History JSON schema on their
+// own Backlog topics, not the min / avg / max payload of the live interval topics. Only
+// closed intervals are queued, values of each telegram are not.
+//
+// PubSubClient only publishes QoS 0, so a record is sent on a topic the device is
+// subscribed to and leaves the queue when the broker echoes it back, or after
+// OUTBOX_RETRIES sends without echo (subscription refused by the broker ACL...).
+// One record is in flight at a time, OUTBOX_RATE records per second at most.
+
+#define OUTBOX_RAM 16
+#define OUTBOX_FILE "/outbox"
+#define OUTBOX_FILE_RECS 1536       // 1536 x 52 bytes = 78 KB, a day of minutes and quarters
+#define OUTBOX_RATE 10              // records per second
+#define OUTBOX_ACK_TIMEOUT 2000     // ms
+#define OUTBOX_RETRIES 3
+
+enum OUTBOX_KIND : uint8_t {
+  OUTBOX_MINUTE = 0,
+  OUTBOX_QUARTER
+};
+
+struct OUTBOX_REC {
+  HIST_REC r;
+  uint8_t kind;
+  uint8_t pad[3];
+};
+
+struct OUTBOX {
+  OUTBOX_REC ram[OUTBOX_RAM];   // oldest first
+  uint8_t ram_n = 0;
+  uint32_t file_n = 0;          // records in the file
+  uint32_t file_rd = 0;         // of them already sent
+  bool file_torn = false;       // partial record at the end : no appends until it is removed
+  OUTBOX_REC head;              // oldest record, being sent
+  bool head_valid = false;
+  bool head_file = false;       // head is record file_rd of the file, else ram[0]
+  uint8_t tries = 0;
+  uint32_t sent_at = 0;         // ms
+  uint32_t queued = 0;
+  uint32_t sent = 0;            // publishes, retries included
+  uint32_t acked = 0;
+  uint32_t unacked = 0;         // given up waiting for the echo
+  uint32_t dropped = 0;         // queue full, interval lost
+  uint32_t spills = 0;
+  uint32_t errors = 0;          // file write / read errors
+};
+
+void outbox_begin(OUTBOX *o) {
+  File f = LittleFS.open(OUTBOX_FILE, "r");
+  o->file_n = f ? f.size() / sizeof(OUTBOX_REC) : 0;
+  o->file_rd = 0;
+  o->file_torn = f && (f.size() % sizeof(OUTBOX_REC) != 0);
+  if (f) f.close();
+}
+
+uint32_t outbox_depth(const OUTBOX *o) {
+  return o->file_n - o->file_rd + o->ram_n;
+}
+
+// Append the RAM records to the file. A failed append changes nothing : what it wrote is
+// cut off, the file is not appended to again if that fails
+bool outbox_spill(OUTBOX *o) {
+  if (o->file_torn || (o->file_n + o->ram_n > OUTBOX_FILE_RECS)) return false;
+  File f = LittleFS.open(OUTBOX_FILE, "a");
+  if (!f) {
+    o->errors++;
+    return false;
+  }
+  size_t len = o->ram_n * sizeof(OUTBOX_REC);
+  bool ok = (f.write((const uint8_t *)o->ram, len) == len);
+  if (!ok && !f.truncate(o->file_n * sizeof(OUTBOX_REC))) o->file_torn = true;
+  f.close();
+  if (!ok) {
+    o->errors++;
+    return false;
+  }
+  // a head taken from RAM is now the first record of the file (the file was empty)
+  if (o->head_valid && !o->head_file) o->head_file = true;
+  o->file_n += o->ram_n;
+  o->ram_n = 0;
+  o->spills++;
+  return true;
+}
+
+// Queue a closed interval, false : queue full, the caller counts it in dropped once it
+// gives up on it
+bool outbox_push(OUTBOX *o, uint8_t kind, const AGG *a) {
+  if (a->n == 0) return true;
+  if ((o->ram_n == OUTBOX_RAM) && !outbox_spill(o)) return false;
+  OUTBOX_REC *r = &o->ram[o->ram_n++];
+  hist_rec(&r->r, a);
+  r->kind = kind;
+  o->queued++;
+  return true;
+}
+
+// Oldest record, NULL : queue empty
+OUTBOX_REC *outbox_head(OUTBOX *o) {
+  while (!o->head_valid && (o->file_rd < o->file_n)) {
+    File f = LittleFS.open(OUTBOX_FILE, "r");
+    bool found = f;
+    bool ok = found && f.seek(o->file_rd * sizeof(OUTBOX_REC), SeekSet) &&
+              (f.read((uint8_t *)&o->head, sizeof(OUTBOX_REC)) == sizeof(OUTBOX_REC));
+    if (found) f.close();
+    if (!found) {
+      // file gone, nothing to replay from it
+      o->errors++;
+      o->file_n = o->file_rd = 0;
+      o->file_torn = false;
+      break;
+    }
+    if (ok && (o->head.r.crc == crc16_update(0, (const char *)&o->head.r, offsetof(HIST_REC, crc)))) {
+      o->head_valid = true;
+      o->head_file = true;
+    } else {
+      o->errors++;
+      o->file_rd++;
+    }
+  }
+  if (!o->head_valid && (o->file_rd >= o->file_n) && (o->ram_n > 0)) {
+    o->head = o->ram[0];
+    o->head_valid = true;
+    o->head_file = false;
+  }
+  return o->head_valid ? &o->head : NULL;
+}
+
+// Head delivered (or given up), on to the next record
+void outbox_pop(OUTBOX *o) {
+  if (!o->head_valid) return;
+  if (o->head_file) {
+    if (++o->file_rd >= o->file_n) {
+      LittleFS.remove(OUTBOX_FILE);
+      o->file_n = o->file_rd = 0;
+      o->file_torn = false;
+    }
+  } else {
+    o->ram_n--;
+    memmove(&o->ram[0], &o->ram[1], o->ram_n * sizeof(OUTBOX_REC));
+  }
+  o->head_valid = false;
+  o->tries = 0;
+}
+
+// Echo of a replayed record : stamp and kind of the head
+void outbox_ack(OUTBOX *o, uint8_t kind, uint32_t stamp) {
+  if (!o->head_valid || (o->tries == 0) || (o->head.kind != kind) || (o->head.r.stamp != stamp)) return;
+  o->acked++;
+  outbox_pop(o);
+}
+
+// Head to send now, NULL : nothing, waiting for the echo or for the rate limit
+OUTBOX_REC *outbox_next(OUTBOX *o) {
+  uint32_t now = millis();
+  if ((o->tries > 0) && (now - o->sent_at < OUTBOX_ACK_TIMEOUT)) return NULL;
+  if (o->tries >= OUTBOX_RETRIES) {
+    o->unacked++;
+    outbox_pop(o);
+  }
+  if ((o->sent > 0) && (now - o->sent_at < 1000 / OUTBOX_RATE)) return NULL;
+  return outbox_head(o);
+}
+
+// Head published
+void outbox_sent(OUTBOX *o) {
+  o->tries++;
+  o->sent++;
+  o->sent_at = millis();
+}
+
+#endif  /* _OUTBOX_H */
@@ -0,0 +1,123 @@
+#ifndef _P1_H
+#define _P1_H
+
+#include <stdint.h>
+#include <string.h>
+#include <obis.h>
+#include <crc16.h>
+
+// P1 telegram framing, no framework dependency so it also builds on a host
+
+#define P1_BUF_SIZE 2048
+
+struct P1_FRAME {
+  bool in_frame = false;
+  bool crc_valid = false;
+  int idx = 0;
+  int idx_crc = 0;
+  int idx_line = 0;
+  uint16_t crc = 0;
+  int32_t crc_received = -1;
+  OBIS_VAL ov;
+  uint16_t line_at[OBIS_COUNT];   // offset of each decoded field line, 0 : not received
+  uint16_t line_crc[OBIS_COUNT];  // CRC of the telegram before that line
+  uint16_t crc_line = 0;          // CRC before the current line
+  char *buf = NULL;
+  int size = 0;
+  uint32_t t_start = 0;     // us, arrival of '/'
+  uint32_t t_end = 0;       // us, arrival of the last CRC char
+  uint32_t period = 0;      // us between the last two telegrams
+  uint32_t frames = 0;
+  uint32_t crc_errors = 0;
+  uint32_t overflows = 0;
+  uint32_t restarts = 0;    // telegrams cut by a new '/' before their CRC
+};
+
+void p1_begin(P1_FRAME *f, char *buf, int size) {
+  f->buf = buf;
+  f->size = size;
+  f->in_frame = false;
+}
+
+// Hand the completed telegram over and continue receiving into buf
+char *p1_swap(P1_FRAME *f, char *buf) {
+  char *done = f->buf;
+  f->buf = buf;
+  return done;
+}
+
+// Feed one byte from the P1 port : framing, CRC and OBIS decoding as bytes arrive.
+// Returns true once the CRC of a telegram has been received, buf then holds
+// the complete telegram (CRLF terminated) and ov its decoded values.
+bool p1_rx(P1_FRAME *f, char ch) {
+  if (ch == '/') {
+    if (f->in_frame) f->restarts++;
+    f->in_frame = true;
+    f->idx = 0;
+    f->idx_crc = 0;
+    f->idx_line = 0;
+    f->crc = 0;
+    f->crc_line = 0;
+    memset(&f->ov, 0, sizeof(f->ov));
+    memset(f->line_at, 0, sizeof(f->line_at));
+  }
+  if (!f->in_frame) return false;
+  if (f->idx >= f->size - 3) {  // overflow, wait for next telegram
+    f->in_frame = false;
+    f->overflows++;
+    return false;
+  }
+  f->buf[f->idx++] = ch;
+
+  if (f->idx_crc > 0) {
+    f->idx_crc--;
+    if (f->idx_crc == 0) {
+      f->crc_received = crc16_parse(f->buf + f->idx - 4);
+      f->buf[f->idx++] = '\r';
+      f->buf[f->idx++] = '\n';
+      f->buf[f->idx] = 0;
+      f->in_frame = false;
+      f->crc_valid = (f->crc_received == f->crc);
+      f->frames++;
+      if (!f->crc_valid) f->crc_errors++;
+      return true;
+    }
+  } else {
+    f->crc = crc16_update(f->crc, (uint8_t)ch);
+    if (ch == '\n') {
+      int end = f->idx - 1;
+      if ((end > f->idx_line) && (f->buf[end-1] == '\r')) end--;
+      OBIS_ID id = obis_parse_line(f->buf + f->idx_line, f->buf + end, &f->ov);
+      if (id != OBIS_NONE) {
+        f->line_at[id] = f->idx_line;
+        f->line_crc[id] = f->crc_line;
+      }
+      f->idx_line = f->idx;
+      f->crc_line = f->crc;
+    }
+    if (ch == '!') f->idx_crc = 4;
+  }
+  return false;
+}
+
+// Feed a chunk of bytes read at once. t_last is the arrival time (us) of the last
+// byte and byte_us the time of one byte on the line, used to timestamp the start
+// and end of the telegram. Stops after a complete telegram, returns the bytes used.
+int p1_rx_buf(P1_FRAME *f, const char *buf, int n, uint32_t t_last, uint32_t byte_us, bool *done) {
+  *done = false;
+  for (int i = 0; i < n; i++) {
+    uint32_t t = t_last - (n - 1 - i) * byte_us;
+    if (buf[i] == '/') {
+      if (f->frames > 0) f->period = t - f->t_start;
+      f->t_start = t;
+    }
+    if (p1_rx(f, buf[i])) {
+      f->t_end = t;
+      *done = true;
+      return i + 1;
+    }
+  }
+  return n;
+}
+
+#endif  /* _P1_H */
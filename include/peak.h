@@ -0,0 +1,103 @@
+#ifndef _PEAK_H
+#define _PEAK_H
+
+#include <stdint.h>
+#include <agg.h>
+
+// Capacity tariff (Fluvius) : the month is billed on its highest quarter-hour average
+// import power, with a PEAK_FLOOR minimum.
+//
+// 1-0:1.4.0 is the import energy of the running quarter so far over 900 s (what the CLI
+// always showed scaled by 900 / QuarterTime), so the quarter average is forecast as
+// demand + P_import * remaining / 900. Meters without 1-0:1.4.0 fall back to the integral
+// of P_import over the telegrams received.
+//
+// Quarters are tracked by meter time stamp : a quarter closes when a telegram of another
+// quarter arrives, whatever was missed in between. It closes on its last forecast, or on
+// the demand alone (a lower bound) when its last PEAK_MAX_GAP seconds or more are missing.
+
+#define PEAK_FLOOR 2500     // W, minimum monthly peak billed
+#define PEAK_WARN 250       // W, forecast margin under the monthly peak raising a warning
+#define PEAK_MAX_GAP 60     // s, longest extrapolation trusted
+#define PEAK_MIN_LEFT 60    // s, shortest time the headroom is spread over
+
+enum PEAK_ALERT : uint8_t {
+  PEAK_OK = 0,
+  PEAK_WARNING,     // forecast within PEAK_WARN of the monthly peak
+  PEAK_NEW          // forecast above the monthly peak
+};
+
+struct PEAK {
+  uint32_t quarter = 0;       // running quarter, YYMMDDhhmm
+  uint16_t elapsed = 0;       // s into it at the last telegram
+  uint32_t energy = 0;        // W.s integrated from P_import in this quarter
+  uint32_t power = 0;         // W, P_import at the last telegram
+  uint32_t demand = 0;        // W, quarter energy so far / 900 s
+  uint32_t forecast = 0;      // W, running quarter average
+  int32_t headroom = 0;       // W of extra import possible until the end of the quarter (a minute at least)
+  uint8_t alert = PEAK_OK;
+  uint32_t last = 0;          // W, average of the last closed quarter
+  uint32_t month = 0;         // YYMM
+  uint32_t month_peak = 0;    // W
+  uint32_t month_peak_at = 0; // its quarter, YYMMDDhhmm
+  uint32_t incomplete = 0;    // quarters closed on a lower bound
+  bool saved = true;          // month peak persisted
+};
+
+void peak_month(PEAK *pk, uint32_t month) {
+  if (month == pk->month) return;
+  pk->month = month;
+  pk->month_peak = 0;
+  pk->month_peak_at = 0;
+  pk->saved = false;
+}
+
+uint32_t peak_limit(const PEAK *pk) {
+  return (pk->month_peak > PEAK_FLOOR) ? pk->month_peak : PEAK_FLOOR;
+}
+
+void peak_close(PEAK *pk) {
+  if (900 - pk->elapsed > PEAK_MAX_GAP) {
+    pk->last = pk->demand;
+    pk->incomplete++;
+  } else pk->last = pk->forecast;
+  peak_month(pk, pk->quarter / 1000000);
+  if (pk->last > pk->month_peak) {
+    pk->month_peak = pk->last;
+    pk->month_peak_at = pk->quarter;
+    pk->saved = false;
+  }
+}
+
+// New telegram : meter date (YYMMDD) and time (hhmmss), 1-0:1.4.0 and import power in W
+void peak_update(PEAK *pk, uint32_t date, uint32_t time, uint32_t demand, uint32_t power) {
+  uint32_t quarter = agg_quarter(agg_minute(date, time));
+  uint16_t elapsed = ((time / 100) % 100 % 15) * 60 + time % 100;
+  if (elapsed > 899) elapsed = 899;  // bad seconds from the meter
+  if (quarter != pk->quarter) {
+    if (pk->quarter != 0) peak_close(pk);
+    pk->quarter = quarter;
+    pk->energy = 0;
+  } else if (elapsed > pk->elapsed) {
+    uint32_t dt = elapsed - pk->elapsed;
+    if (dt > PEAK_MAX_GAP) dt = PEAK_MAX_GAP;
+    pk->energy += pk->power * dt;
+  }
+  pk->elapsed = elapsed;
+  pk->power = power;
+  pk->demand = (demand > 0) ? demand : pk->energy / 900;
+  pk->forecast = pk->demand + power * (900 - elapsed) / 900;
+  peak_month(pk, quarter / 1000000);
+
+  // margin spread over the rest of the quarter : in its last seconds that would be
+  // megawatts, so the last minute counts as a full one
+  int32_t limit = peak_limit(pk);
+  int32_t left = 900 - elapsed;
+  if (left < PEAK_MIN_LEFT) left = PEAK_MIN_LEFT;
+  pk->headroom = (limit - (int32_t)pk->forecast) * 900 / left;
+  if ((int32_t)pk->forecast > limit) pk->alert = PEAK_NEW;
+  else if ((int32_t)pk->forecast + PEAK_WARN > limit) pk->alert = PEAK_WARNING;
+  else pk->alert = PEAK_OK;
+}
+
+#endif  /* _PEAK_H */
@@ -0,0 +1,127 @@
+#ifndef _REWRITE_H
+#define _REWRITE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <p1.h>
+
+// Modified telegram : a rule table changes decoded values, each changed value is patched
+// over the original text (same width, at the line offset recorded while parsing) and the
+// CRC is resumed from its state before the first patched line. The original text is
+// never touched, both telegrams are served from the same buffer.
+
+#define RW_MAX_PATCH 8
+#define RW_PATCH_LEN 12
+
+enum RW_OP : uint8_t {
+  RW_ADD,     // v + param * unit
+  RW_MIN,     // min(v, param * unit)
+  RW_SCALE,   // v * param / 100
+};
+
+struct RW_RULE {
+  OBIS_ID id;
+  RW_OP op;
+  const uint32_t *param;
+  uint32_t unit;
+};
+
+struct RW_PATCH {
+  uint16_t pos;     // offset in the telegram
+  uint8_t len;
+  char text[RW_PATCH_LEN];
+};
+
+// Patches of one telegram, sorted by pos
+struct RW_SET {
+  uint8_t n = 0;
+  RW_PATCH patch[RW_MAX_PATCH];
+};
+
+// Contiguous bytes at pos of the patched text (len bytes), returns their count
+int rw_chunk(const RW_SET *rw, const char *buf, int len, int pos, const char **p) {
+  for (int i = 0; i < rw->n; i++) {
+    const RW_PATCH *pt = &rw->patch[i];
+    if (pos < pt->pos) {
+      *p = buf + pos;
+      return pt->pos - pos;
+    }
+    if (pos < pt->pos + pt->len) {
+      *p = pt->text + (pos - pt->pos);
+      return pt->pos + pt->len - pos;
+    }
+  }
+  *p = buf + pos;
+  return len - pos;
+}
+
+// Write v over a value text keeping its layout ("001.84" : 3 digits, '.', 2 digits),
+// all nines if it does not fit
+void rw_format(char *p, int len, uint32_t v) {
+  for (int i = len - 1; i >= 0; i--) {
+    if (p[i] == '.') continue;
+    p[i] = '0' + v % 10;
+    v /= 10;
+  }
+  if (v > 0) {
+    for (int i = 0; i < len; i++) if (p[i] != '.') p[i] = '9';
+  }
+}
+
+void rw_patch(RW_SET *rw, const char *buf, int line, uint32_t v) {
+  const char *s = (const char *)memchr(buf + line, '(', 20);
+  if ((s == NULL) || (rw->n >= RW_MAX_PATCH)) return;
+  s++;
+  // only plain fixed-point values ("001.84*A)"), anything else is left as is
+  int len = 0;
+  while ((len < RW_PATCH_LEN) && (((s[len] >= '0') && (s[len] <= '9')) || (s[len] == '.'))) len++;
+  if ((len == 0) || (len == RW_PATCH_LEN) || ((s[len] != '*') && (s[len] != ')'))) return;
+  // insert sorted, fields are mostly in telegram order already
+  int i = rw->n++;
+  while ((i > 0) && (rw->patch[i-1].pos > s - buf)) {
+    rw->patch[i] = rw->patch[i-1];
+    i--;
+  }
+  RW_PATCH *pt = &rw->patch[i];
+  pt->pos = s - buf;
+  pt->len = len;
+  memcpy(pt->text, s, len);
+  rw_format(pt->text, len, v);
+}
+
+// Apply the rules to the telegram just completed in f (text in buf, body_len bytes up to
+// '!'), val receives the values after the rules. Returns the CRC of the patched text.
+uint16_t rw_apply(RW_SET *rw, const RW_RULE *rules, int n, const P1_FRAME *f, const char *buf, int body_len, uint32_t *val) {
+  memcpy(val, f->ov.val, sizeof(f->ov.val));
+  for (int i = 0; i < n; i++) {
+    const RW_RULE *r = &rules[i];
+    uint32_t *v = &val[r->id];
+    uint32_t p = *r->param;
+    switch (r->op) {
+      case RW_ADD: *v += p * r->unit; break;
+      case RW_MIN: if (*v > p * r->unit) *v = p * r->unit; break;
+      case RW_SCALE: *v = (uint64_t)*v * p / 100; break;
+    }
+  }
+
+  rw->n = 0;
+  int first = OBIS_NONE;
+  for (int id = OBIS_DATETIME + 1; id < OBIS_COUNT; id++) {
+    if ((val[id] == f->ov.val[id]) || (f->line_at[id] == 0)) continue;
+    rw_patch(rw, buf, f->line_at[id], val[id] / obis_dispatch.scale[id]);
+    if ((first == OBIS_NONE) || (f->line_at[id] < f->line_at[first])) first = id;
+  }
+  if (rw->n == 0) return f->crc;
+
+  uint16_t crc = f->line_crc[first];
+  int pos = f->line_at[first];
+  while (pos < body_len) {
+    const char *p;
+    int len = rw_chunk(rw, buf, body_len, pos, &p);
+    crc = crc16_update(crc, p, len);
+    pos += len;
+  }
+  return crc;
+}
+
+#endif  /* _REWRITE_H */
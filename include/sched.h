@@ -0,0 +1,59 @@
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <Arduino.h>
+
+// Cooperative scheduler : a task runs when it has work (ready) or when its period is due.
+// Tasks run in priority order, once the loop budget is spent only priority 0 tasks
+// still run, the others stay due for the next loop.
+
+#define SCHED_LOOP_BUDGET 10000   // us
+
+struct TASK {
+  const char *name;
+  void (*run)();
+  bool (*ready)();      // NULL : periodic only
+  uint32_t period;      // ms, 0 : only when ready
+  uint8_t prio;         // 0 is highest
+  uint32_t budget;      // us, longer runs are counted as overruns
+  uint32_t next = 0;    // deadline (millis)
+  uint32_t runs = 0;
+  uint32_t overruns = 0;
+  uint32_t max_us = 0;
+};
+
+void sched_begin(TASK *t, int n) {
+  // sort by priority, table is small
+  for (int i = 1; i < n; i++) {
+    for (int j = i; (j > 0) && (t[j].prio < t[j-1].prio); j--) {
+      TASK k = t[j];
+      t[j] = t[j-1];
+      t[j-1] = k;
+    }
+  }
+  uint32_t now = millis();
+  for (int i = 0; i < n; i++) t[i].next = now + t[i].period;
+}
+
+void sched_run(TASK *t, int n) {
+  uint32_t start = micros();
+  for (int i = 0; i < n; i++) {
+    TASK *k = &t[i];
+    uint32_t now = millis();
+    bool due = (k->period > 0) && ((int32_t)(now - k->next) >= 0);
+    if (!due && ((k->ready == NULL) || !k->ready())) continue;
+    if ((k->prio > 0) && (micros() - start > SCHED_LOOP_BUDGET)) continue;
+    if (due) {
+      k->next += k->period;
+      if ((int32_t)(now - k->next) >= 0) k->next = now + k->period;  // late, don't burst
+    }
+    uint32_t t0 = micros();
+    k->run();
+    uint32_t dt = micros() - t0;
+    k->runs++;
+    if (dt > k->max_us) k->max_us = dt;
+    if (dt > k->budget) k->overruns++;
+  }
+}
+
+#endif  /* _SCHED_H */
@@ -4,20 +4,31 @@
 // Release : 2024.05
 
 
-#if !defined(ESP8266)
+#if !defined(ESP8266) && !defined(UNIT_TEST)
   #error This code is designed to run on ESP8266 and ESP8266-based boards!
 #endif
 
 // Include framework & embedded hardware libs
 #include <Arduino.h>
-#include <string>
 #include <Ticker.h>
 #include <LittleFS.h>
-#include <EEPROM.h>
 #include <ESP8266WiFi.h>
 #include <ESP8266mDNS.h>
 #include <PubSubClient.h>
 #include <ota.h>
+#include <sched.h>
+#include <cbor.h>
+#include <p1.h>
+#include <agg.h>
+#include <history.h>
+#include <peak.h>
+#include <rewrite.h>
+#include <lat.h>
+#include <fmt.h>
+#include <cfgstore.h>
+#include <http.h>
+#include <outbox.h>
+#include <conn.h>
 
 // Include project specific headers
 #include "cred.h"
@@ -30,22 +41,117 @@ int rx_led = D3;  // D3
 //int tx_led = D4;
 
 // Network vars
-bool wifi_connected = false;
-bool mqtt_connected = false;
-bool p1_connected = false;
-bool pm1_connected = false;
+#define MQTT_CONNECT_BUDGET 200     // ms, DNS and TCP connect each, and socket writes
+#define MQTT_HANDSHAKE_TIMEOUT 1    // s, CONNACK wait, only if the broker accepts but doesn't answer
+#define MQTT_BACKOFF_MIN 1000       // ms
+#define MQTT_BACKOFF_MAX 60000
+
+CONN wifi_conn("WiFi", 0, 0);       // reconnected by the SDK
+CONN mqtt_conn("MQTT", MQTT_BACKOFF_MIN, MQTT_BACKOFF_MAX);
+bool servers_started = false;       // begun once, they stay bound across WiFi reconnects
 
 WiFiClient espClient;
 PubSubClient mqtt_client(espClient);
-WiFiClient p1_client;
-WiFiServer p1_server(101);
-WiFiClient pm1_client;
-WiFiServer pm1_server(102);
+
+// P1 relay servers : each client keeps its own position in the last telegram
+#define RELAY_MAX_CLIENTS 3   // clients per port
+#define RELAY_MAX_SKIP 5      // consecutive telegrams skipped before a client is dropped
+#define RELAY_CHUNK 512       // max bytes written per client per loop
+
+struct RELAY_CLIENT {
+  WiFiClient client;
+  bool connected = false;
+  uint32_t seq = 0;      // telegram being sent
+  int pos = 0;           // bytes of it already sent
+  int len = 0;           // its length (0 : nothing to send)
+  uint8_t skip = 0;      // consecutive telegrams skipped
+  uint32_t sent = 0;     // telegrams sent
+  uint32_t skipped = 0;  // telegrams skipped or cut short
+  uint32_t bytes = 0;
+};
+
+struct RELAY {
+  WiFiServer server;
+  const char *name;
+  bool mod;
+  uint32_t rejected = 0;
+  uint32_t dropped = 0;
+  RELAY_CLIENT cl[RELAY_MAX_CLIENTS];
+  RELAY(uint16_t port, const char *name, bool mod) : server(port), name(name), mod(mod) {}
+};
+
+RELAY p1_relay(101, "P1", false);
+RELAY pm1_relay(102, "P1 Mod", true);
+
+HTTP_SERVER http(80);
+uint32_t http_dg_seq = 0;   // values of the last event
 
 #define MQTT_ON 1
 #define MQTT_TOPIC "home/smartmeter/"
 #define MQTT_TOPIC_SUB "home/smartmeter/cmd/#"
 #define MQTT_LWT "home/smartmeter/availability"
+#define MQTT_BUFFER 768   // max packet size, the interval messages are the largest
+
+// Legacy per field topics, selected by cfg.mqtt_topics
+#define MQTT_T_ENERGY     0x01
+#define MQTT_T_POWER      0x02
+#define MQTT_T_LINES      0x04
+#define MQTT_T_P_CONSUMED 0x08
+#define MQTT_T_P_INJECTED 0x10
+#define MQTT_T_E_CONSUMED 0x20
+#define MQTT_T_E_INJECTED 0x40
+#define MQTT_T_PEAK       0x80
+#define MQTT_T_ALL        (MQTT_T_ENERGY | MQTT_T_POWER | MQTT_T_LINES | MQTT_T_P_CONSUMED | \
+                           MQTT_T_P_INJECTED | MQTT_T_E_CONSUMED | MQTT_T_E_INJECTED | MQTT_T_PEAK)
+// every bit of the byte is a topic : any mqtt_topics value is valid, nothing to check at load
+static_assert(MQTT_T_ALL == 0xFF, "free topic bit, reject it in check_cfg");
+
+// Combined State message, selected by cfg.mqtt_state
+#define MQTT_STATE_OFF  0
+#define MQTT_STATE_JSON 1   // MQTT_TOPIC "State"
+#define MQTT_STATE_CBOR 2   // MQTT_TOPIC "StateBin", CBOR map with numeric keys
+
+// CBOR State keys, never renumber : add new keys at the end and bump the schema
+#define MQTT_CBOR_SCHEMA 1
+enum CBOR_KEY : uint8_t {
+  K_SCHEMA = 0,
+  K_DATE,           // YYMMDD (meter time)
+  K_TIME,           // hhmmss
+  K_E_CONSUMED,     // Wh
+  K_E_INJECTED,     // Wh
+  K_P_CONSUMED,     // W
+  K_P_INJECTED,     // W
+  K_U_L1,           // 0.1 V
+  K_U_L2,
+  K_U_L3,
+  K_I_L1,           // 0.01 A
+  K_I_L2,
+  K_I_L3,
+  K_P_L1,           // W, negative when injecting
+  K_P_L2,
+  K_P_L3,
+  K_PEAK,           // W, last quarter-hour peak
+  K_COUNT
+};
+
+// Interval messages (MQTT_TOPIC "Minute" and "Quarter") : [min, avg, max] per value
+const char *agg_names[AGG_COUNT] = { "P", "P_consumed", "P_injected", "U_L1", "U_L2", "U_L3",
+                                     "I_L1", "I_L2", "I_L3", "P_L1", "P_L2", "P_L3" };
+const uint8_t agg_decimals[AGG_COUNT] = { 0, 0, 0, 1, 1, 1, 2, 2, 2, 0, 0, 0 };
+
+struct MQTT_STATS {
+  uint32_t publishes = 0;
+  uint32_t bytes = 0;
+  uint32_t last_publishes = 0;   // totals at the previous second
+  uint32_t last_bytes = 0;
+  uint16_t publishes_s = 0;      // rates over the last second
+  uint16_t bytes_s = 0;
+  uint32_t last_replays = 0;
+  uint16_t replays_s = 0;
+};
+
+MQTT_STATS mqtt_stats;
+OUTBOX outbox;    // intervals not published yet
 
 // netcli vars
 bool netcli_connected = false;
@@ -53,44 +159,91 @@ bool netcli_disconnect = false;
 WiFiClient cli_client;
 WiFiServer cli_server(23);
 
+// Telnet output, written by cli_flush() once per loop as the socket allows. The telegram
+// dumps are a position in the last telegram, copied in as the buffer drains.
+#define CLI_OUT_SIZE 1024
+
+enum CLI_DUMP : uint8_t {
+  CLI_DUMP_ORIG = 1,
+  CLI_DUMP_MOD = 2
+};
+
+struct CLI_OUT {
+  char buf[CLI_OUT_SIZE];
+  int len = 0;              // bytes waiting
+  uint8_t dumps = 0;        // CLI_DUMP_xx to send, original first
+  uint32_t dump_seq = 0;    // telegram dumped
+  int dump_pos = 0;
+  uint32_t writes = 0;      // socket writes
+  uint32_t dropped = 0;     // bytes lost, client too slow
+  uint32_t cut = 0;         // dumps cut by the next telegram
+};
+
+CLI_OUT cli_out;
+
 // cli vars
-std::string line = "";
-std::string dbgdsp = "";
+#define CLI_LINE 80    // chars per command line
+#define CLI_ARGS 4     // words per command
+char line[CLI_LINE + 1] = "";
+uint8_t line_len = 0;
+char dbgdsp[120] = "";   // message shown on the CLI at the next run
 bool cli_dspOrigP1 = false;
 bool cli_dspModP1 = false;
 bool cli_dspEnergy = false;
 bool cli_dspPower = false;
 bool cli_dspPeak = false;
+bool cli_dspStats = false;
+void sched_print();
+void mqtt_print();
+void mbus_print();
+void net_print();
+int tg_length(bool mod);
+int tg_chunk(bool mod, int pos, const char **p);
+
+
+// Configuration vars, saved by cfgstore.h.
+// Schema : new fields go at the end and CFG_VERSION is bumped, records of an older
+// version load with the defaults of the fields they miss (see cfg_migrate).
+#define CFG_VERSION 1
+#define CFG_SAVE_DELAY 10000     // ms after the last change, a burst of changes is one save
+#define CFG_LOAD_TARGET 2000     // us, boot time config load
 
-
-// Configuration vars
 struct CFG {
   uint32_t I_Max_meter = 32;
   uint32_t I_Shift = 0;
+  uint32_t P_Scale = 100;  // %, L1 consumed power in the modified telegram
   bool send_p1 = true;
   bool send_pm1 = true;
   bool send_serial = true;
+  uint8_t mqtt_state = MQTT_STATE_OFF; // one combined State message per telegram
+  uint8_t mqtt_topics = MQTT_T_ALL;    // legacy per field topics
+  bool mqtt_intervals = true;          // closed minute and quarter-hour intervals
+  bool mqtt_peak = true;               // capacity tariff forecast and alert
   //bool Show_Stats = false;
 };
 
+static_assert(sizeof(CFG) <= CFG_DATA, "CFG does not fit a config store slot");
+
+// EEPROM image of the first releases (version 0)
+struct CFG_V0 {
+  uint32_t I_Max_meter;
+  uint32_t I_Shift;
+  uint8_t send_p1;
+  uint8_t send_pm1;
+  uint8_t send_serial;
+};
+
 CFG cfg;
-CFG cfg_old;
+CFG cfg_old;     // as saved
+CFG_STORE cfg_store;
+bool cfg_dirty = false;
+uint32_t cfg_changed_at = 0;
 
-uint8_t eeprom_to_save = 0;
 uint8_t cmd_clear = 255;
 
 
-// P1 data
+// P1 data : decoded values
 struct DG {
-  bool received = false;
-  bool decoded = false;
-  bool sent = false;
-  int idx = 0;
-  int idx_crc = 0;
-  uint16_t crc;
-  char crc_computed[5];
-  char crc_received[5];
-  bool crc_valid;
   uint32_t E_consumed_1 = 0;
   uint32_t E_consumed_2 = 0;
   uint32_t E_consumed = 0;
@@ -122,177 +275,771 @@ struct DG {
   uint32_t P_Mod_act_L1 = 0;
   uint32_t P_Mod_act_L2 = 0;
   uint32_t P_Mod_act_L3 = 0;
-  uint32_t CurrentPeak = 0;
-  uint32_t LastPeak = 0;
+  uint32_t CurrentPeak = 0;   // W, running quarter average forecast
+  uint32_t LastPeak = 0;      // W, last closed quarter average
+  uint32_t MonthPeak = 0;     // W, highest quarter of the month
+  int32_t PeakHeadroom = 0;   // W, negative over the limit
+  uint32_t PeakAlert = 0;
   uint32_t CurrentDate = 0;
   uint32_t CurrentTime = 0;
   uint32_t QuarterTime = 0;
-  char buf[2048];
-  char OrigP1[2048];
-  char ModP1[2048];
+  uint32_t decode_cycles = 0;
+  MBUS_VAL mbus[MBUS_CHANNELS] = {};
+};
+
+// Last decoded values for readers (MQTT, CLI), double-buffered :
+// seq counts updates and v[seq & 1] is the latest complete copy
+struct DG_SNAP {
+  DG v[2];
+  volatile uint32_t seq = 0;
+};
+
+// Last complete telegram text, shared by relay ports, serial and CLI.
+// The modified telegram is the same text with the rw patches, re-signed with mod_tail.
+struct TG {
+  char *buf = NULL;
+  int len = 0;
+  int body_len = 0;    // up to and including '!'
+  uint32_t seq = 0;
+  uint32_t t_end = 0;  // us, arrival of its CRC
+  RW_SET rw;
+  char mod_tail[6];    // CRC + CRLF
+};
+
+DG dg;          // values being built from the current telegram
+DG_SNAP dg_snap;
+DG mqtt_old;    // values last sent to MQTT
+uint32_t mqtt_seq = 0;
+
+P1_FRAME p1;
+TG tg;
+
+// Modified telegram rules, applied in order
+const RW_RULE rw_rules[] = {
+  // field          op         param              unit
+  { OBIS_I_L1,      RW_ADD,    &cfg.I_Shift,      100 },   // A to 0.01 A
+  { OBIS_I_L2,      RW_ADD,    &cfg.I_Shift,      100 },
+  { OBIS_I_L3,      RW_ADD,    &cfg.I_Shift,      100 },
+  { OBIS_I_L1,      RW_MIN,    &cfg.I_Max_meter,  100 },
+  { OBIS_I_L2,      RW_MIN,    &cfg.I_Max_meter,  100 },
+  { OBIS_I_L3,      RW_MIN,    &cfg.I_Max_meter,  100 },
+  { OBIS_P_CONS_L1, RW_SCALE,  &cfg.P_Scale,      1 },
+};
+const int rw_rules_count = sizeof(rw_rules) / sizeof(rw_rules[0]);
+PEAK peak;
+uint8_t mqtt_alert = 0xFF;   // alert level last sent to MQTT
+
+// Monthly peak, kept across reboots
+#define PEAK_FILE "/peak"
+
+struct PEAK_STORE {
+  uint32_t month;
+  uint32_t month_peak;
+  uint32_t month_peak_at;
+  uint16_t crc;
+};
+char p1_buf[2][P1_BUF_SIZE];
+uint32_t p1_cycles = 0;
+
+
+// Pipeline latency histograms (us), from the arrival of the telegram CRC unless noted.
+// Published every LAT_PERIOD on MQTT_TOPIC "Stats" and reset.
+#define LAT_PERIOD 60   // s
+
+#if LAT_STATS
+LAT_HIST lat_frame;     // '/' to CRC : telegram on the line
+LAT_HIST lat_decode;    // values and both telegram texts ready
+LAT_HIST lat_relay;     // whole telegram written to a relay client socket
+LAT_HIST lat_mqtt;      // telegram values published
+#endif
+
+
+// Serial RX : the UART ISR fills a ring buffer, read in chunks by the serial task
+#define RX_RING_SIZE 2048   // bytes, a full telegram fits
+#define RX_BUDGET 3000      // us of serial RX per run
+#define UART_BYTE_US 87     // 10 bits at 115200 bauds
+
+struct RX_STATS {
+  uint32_t overruns = 0;     // ring buffer full, bytes lost
+  uint32_t errors = 0;       // framing / parity errors
+  uint32_t period_min = 0;   // us between telegram starts
+  uint32_t period_max = 0;
+};
+
+RX_STATS rx_stats;
+
+
+// Minute and quarter-hour aggregates, aligned to meter time
+AGG_STREAM agg_min;
+AGG_STREAM agg_qtr;
+uint32_t agg_seq = 0;       // last telegram added
+uint32_t mqtt_min_seq = 0;  // last intervals sent to MQTT
+uint32_t mqtt_qtr_seq = 0;
+
+// M-Bus readings last sent to MQTT, by capture time
+uint32_t mqtt_mbus_date[MBUS_CHANNELS];
+uint32_t mqtt_mbus_time[MBUS_CHANNELS];
+
+
+// History log : minute and quarter-hour records in LittleFS
+#define HIST_CLI_MAX 96      // lines per "show history"
+#define HIST_MQTT_MAX 1440   // records per MQTT query
+#define HIST_MQTT_BURST 4    // records published per MQTT run
+
+HIST_REC hist_min_batch[HIST_BATCH];
+HIST_REC hist_qtr_batch[2];
+HIST_LOG hist_min("/hm", HIST_MIN_SEGS, hist_min_batch, HIST_BATCH);
+HIST_LOG hist_qtr("/hq", HIST_QTR_SEGS, hist_qtr_batch, 2);
+
+// Query received on MQTT_TOPIC "cmd/history", answered on MQTT_TOPIC "History"
+struct HIST_QUERY {
+  HIST_LOG *log = NULL;  // NULL : no query running
+  uint32_t pos = 0;
+  uint32_t from = 0;
+  uint32_t to = 0;
+  uint32_t count = 0;
 };
 
-DG dg;
-DG dg_old;
+HIST_QUERY hist_query;
 
 
 // Other vars
 Ticker Timer1;
-unsigned long currentmillis = millis();
-unsigned long lastmillis = currentmillis;
+unsigned long lastmillis = millis();
 uint32_t uptime = 0;
-uint8_t loopidx = 0;
 int safecnt = 20;  // Time before start to allow OTA
 char uptime_txt[48];
 char dttime_txt[48];
 
 
 
-void cli_print(String msg, bool ln = false, bool sercli=true, bool netcli=true)
+// Copy the next part of the telegram dump, if any
+void cli_dump_fill() {
+  while ((cli_out.dumps != 0) && (cli_out.len < CLI_OUT_SIZE)) {
+    if (cli_out.dump_seq != tg.seq) {
+      cli_out.cut++;
+      cli_out.dumps = 0;
+      break;
+    }
+    bool mod = !(cli_out.dumps & CLI_DUMP_ORIG);
+    if (cli_out.dump_pos < tg_length(mod)) {
+      const char *p;
+      int n = tg_chunk(mod, cli_out.dump_pos, &p);
+      if (n > CLI_OUT_SIZE - cli_out.len) n = CLI_OUT_SIZE - cli_out.len;
+      memcpy(cli_out.buf + cli_out.len, p, n);
+      cli_out.len += n;
+      cli_out.dump_pos += n;
+    } else {
+      cli_out.dumps &= mod ? ~CLI_DUMP_MOD : ~CLI_DUMP_ORIG;
+      cli_out.dump_pos = 0;
+    }
+  }
+}
+
+// Write what the telnet socket takes without blocking
+void cli_flush() {
+  if (!netcli_connected) {
+    cli_out.len = 0;
+    cli_out.dumps = 0;
+    return;
+  }
+  cli_dump_fill();
+  if (cli_out.len == 0) return;
+  int n = cli_client.availableForWrite();
+  if (n > cli_out.len) n = cli_out.len;
+  if (n <= 0) return;
+  n = cli_client.write((const uint8_t *)cli_out.buf, n);
+  if (n <= 0) return;
+  cli_out.writes++;
+  cli_out.len -= n;
+  memmove(cli_out.buf, cli_out.buf + n, cli_out.len);
+}
+
+void cli_write(const char *p, int n) {
+  if (!netcli_connected) return;
+  if (cli_out.len + n > CLI_OUT_SIZE) cli_flush();
+  int room = CLI_OUT_SIZE - cli_out.len;
+  if (n > room) {
+    cli_out.dropped += n - room;
+    n = room;
+  }
+  memcpy(cli_out.buf + cli_out.len, p, n);
+  cli_out.len += n;
+}
+
+// Dump the last telegram on telnet, original or re-signed
+void cli_dump(bool mod) {
+  if (!netcli_connected) return;
+  if ((cli_out.dumps != 0) && (cli_out.dump_seq != tg.seq)) {
+    cli_out.cut++;
+    cli_out.dumps = 0;
+  }
+  if (cli_out.dumps == 0) cli_out.dump_pos = 0;
+  cli_out.dump_seq = tg.seq;
+  cli_out.dumps |= mod ? CLI_DUMP_MOD : CLI_DUMP_ORIG;
+}
+
+void cli_print(const char *msg, bool ln = false, bool sercli=true, bool netcli=true)
 {
   if (sercli) if (ln) Serial.println(msg); else Serial.print(msg);
-  if (netcli){
-    if (netcli_connected) {
-      cli_client.write(msg.c_str());
-      if (ln) cli_client.write("\r\n");
+  if (netcli) {
+    cli_write(msg, strlen(msg));
+    if (ln) cli_write("\r\n", 2);
+  }
+}
+
+void dbg_msg(const char *msg, const char *detail = "") {
+  FMT f;
+  fmt_init(&f, dbgdsp, sizeof(dbgdsp));
+  fmt_str(&f, msg);
+  fmt_str(&f, detail);
+}
+
+void fmt_ip(FMT *f, IPAddress ip) {
+  for (int i = 0; i < 4; i++) {
+    if (i > 0) fmt_char(f, '.');
+    fmt_uint(f, ip[i]);
+  }
+}
+
+
+// Length of the last telegram, original or re-signed
+int tg_length(bool mod) {
+  return mod ? tg.body_len + sizeof(tg.mod_tail) : tg.len;
+}
+
+// Contiguous part of the telegram text starting at pos, returns its length
+int tg_chunk(bool mod, int pos, const char **p) {
+  if (!mod) {
+    *p = tg.buf + pos;
+    return tg.len - pos;
+  }
+  if (pos < tg.body_len) return rw_chunk(&tg.rw, tg.buf, tg.body_len, pos, p);
+  *p = tg.mod_tail + (pos - tg.body_len);
+  return tg_length(mod) - pos;
+}
+
+// Write the last telegram, original or re-signed
+void tg_write(Print &out, bool mod) {
+  int len = tg_length(mod);
+  int pos = 0;
+  while (pos < len) {
+    const char *p;
+    int n = tg_chunk(mod, pos, &p);
+    out.write(p, n);
+    pos += n;
+  }
+}
+
+void relay_accept(RELAY *r) {
+  WiFiClient client = r->server.available();
+  if (!client) return;
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    RELAY_CLIENT *rc = &r->cl[i];
+    if (!rc->connected) {
+      *rc = RELAY_CLIENT();
+      rc->client = client;
+      rc->connected = true;
+      rc->seq = tg.seq;  // start with the next telegram
+      dbg_msg(r->name, " client connected");
+      return;
     }
   }
+  client.stop();
+  r->rejected++;
+  dbg_msg(r->name, " client rejected, no free slot");
 }
 
+// Send what fits in each client socket without blocking
+void relay_send(RELAY *r, bool enabled) {
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    RELAY_CLIENT *rc = &r->cl[i];
+    if (!rc->connected) continue;
+    if (!rc->client.connected()) {
+      rc->client.stop();
+      rc->connected = false;
+      dbg_msg(r->name, " client disconnected");
+      continue;
+    }
 
-std::string trim(const std::string& str,
-                 const std::string& whitespace = " \t")
-{
-    const auto strBegin = str.find_first_not_of(whitespace);
-    if (strBegin == std::string::npos)
-        return ""; // no content
+    if (rc->seq != tg.seq) {
+      // new telegram : what is left of the previous one is lost
+      uint32_t missed = tg.seq - rc->seq - 1;
+      if (rc->pos < rc->len) missed++;
+      rc->skipped += missed;
+      rc->skip = (missed > 0) ? rc->skip + missed : 0;
+      if (rc->skip > RELAY_MAX_SKIP) {
+        rc->client.stop();
+        rc->connected = false;
+        r->dropped++;
+        dbg_msg(r->name, " client dropped, too slow");
+        continue;
+      }
+      rc->seq = tg.seq;
+      rc->pos = 0;
+      rc->len = enabled ? tg_length(r->mod) : 0;
+    }
+
+    if (rc->pos < rc->len) {
+      int room = rc->client.availableForWrite();
+      if (room > RELAY_CHUNK) room = RELAY_CHUNK;
+      while ((room > 0) && (rc->pos < rc->len)) {
+        const char *p;
+        int n = tg_chunk(r->mod, rc->pos, &p);
+        if (n > room) n = room;
+        n = rc->client.write((const uint8_t *)p, n);
+        if (n <= 0) break;
+        rc->pos += n;
+        rc->bytes += n;
+        room -= n;
+      }
+      if (rc->pos == rc->len) {
+        rc->sent++;
+        LAT_ADD(lat_relay, micros() - tg.t_end);
+      }
+    }
+  }
+}
+
+void relay_print(RELAY *r) {
+  char st[120];
+  sprintf(st, "%s : %u rejected, %u dropped", r->name, r->rejected, r->dropped);
+  cli_print(st, true, false, true);
+  for (int i = 0; i < RELAY_MAX_CLIENTS; i++) {
+    RELAY_CLIENT *rc = &r->cl[i];
+    if (!rc->connected) continue;
+    char ip[16];
+    FMT f;
+    fmt_init(&f, ip, sizeof(ip));
+    fmt_ip(&f, rc->client.remoteIP());
+    sprintf(st, "  #%i %-15s sent %u, skipped %u, %u bytes", i, ip, rc->sent, rc->skipped, rc->bytes);
+    cli_print(st, true, false, true);
+  }
+}
+
+void http_print() {
+  static const char *const states[] = { "", "request", "header", "now", "stream" };
+  char st[120];
+  sprintf(st, "HTTP : %u requests, %u events, %u rejected, %u dropped", http.requests, http.seq, http.rejected, http.dropped);
+  cli_print(st, true, false, true);
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) {
+    HTTP_CLIENT *c = &http.cl[i];
+    if (c->state == HTTP_FREE) continue;
+    char ip[16];
+    FMT f;
+    fmt_init(&f, ip, sizeof(ip));
+    fmt_ip(&f, c->client.remoteIP());
+    sprintf(st, "  #%i %-15s %-7s event %u", i, ip, states[c->state], c->seq);
+    cli_print(st, true, false, true);
+  }
+}
 
-    const auto strEnd = str.find_last_not_of(whitespace);
-    const auto strRange = strEnd - strBegin + 1;
+// Minute records while they cover the start of the range, quarter records beyond
+HIST_LOG *hist_select(uint32_t from) {
+  HIST_REC r;
+  if (hist_read(&hist_min, hist_min.first, &r) && (from >= r.stamp)) return &hist_min;
+  return &hist_qtr;
+}
 
-    return str.substr(strBegin, strRange);
+void hist_print(HIST_LOG *h, const char *name) {
+  char st[120];
+  HIST_REC r;
+  if (!hist_read(h, h->first, &r)) r.stamp = 0;
+  sprintf(st, "%s log : %u records since %010u, %u segments, %u writes, %u errors",
+              name, hist_end(h) - h->first, r.stamp, h->segs, h->writes, h->errors);
+  cli_print(st, true, false, true);
+}
+
+// Records from/to (YYMMDDhhmm, meter time), to = 0 : up to now
+void hist_show(uint32_t from, uint32_t to) {
+  if (from == 0) {
+    hist_print(&hist_min, "Minute");
+    hist_print(&hist_qtr, "Quarter");
+    cli_print("show history <from> [<to>] : YYMMDDhhmm meter time", true, false, true);
+    return;
+  }
+  if (to == 0) to = 0xFFFFFFFF;
+  HIST_LOG *h = hist_select(from);
+  cli_print("Stamp         n   E_cons    E_inj     P_avg  P_min  P_max  P_L1   P_L2   P_L3   U_L1  U_L2  U_L3  I_max", true, false, true);
+  char st[160];
+  int lines = 0;
+  for (uint32_t n = hist_seek(h, from); n < hist_end(h); n++) {
+    HIST_REC r;
+    if (!hist_read(h, n, &r)) continue;
+    int in = hist_range(r.stamp, from, to);
+    if (in > 0) break;
+    if (in < 0) continue;
+    if (lines++ == HIST_CLI_MAX) {
+      cli_print("... more records, narrow the range", true, false, true);
+      break;
+    }
+    hist_text(&r, st);
+    cli_print(st, true, false, true);
+  }
+}
+
+// bool loaded from flash : a byte other than 0 or 1 is not a bool, back to the default
+void check_bool(bool *b, bool def) {
+  uint8_t v;
+  memcpy(&v, b, 1);
+  if (v > 1) *b = def;
 }
 
 void check_cfg() {
-  if ((cfg.I_Max_meter < 0) || (cfg.I_Max_meter > 32)) cfg.I_Max_meter = 32;
-  if ((cfg.I_Shift < 0) || (cfg.I_Shift > 32)) cfg.I_Shift = 32;
+  const CFG def;
+  if ((cfg.I_Max_meter == 0) || (cfg.I_Max_meter > 32)) cfg.I_Max_meter = 32;
+  if (cfg.I_Shift > 32) cfg.I_Shift = 32;
+  if (cfg.P_Scale > 1000) cfg.P_Scale = 100;
+  if (cfg.mqtt_state > MQTT_STATE_CBOR) cfg.mqtt_state = MQTT_STATE_OFF;
+  check_bool(&cfg.send_p1, def.send_p1);
+  check_bool(&cfg.send_pm1, def.send_pm1);
+  check_bool(&cfg.send_serial, def.send_serial);
+  check_bool(&cfg.mqtt_intervals, def.mqtt_intervals);
+  check_bool(&cfg.mqtt_peak, def.mqtt_peak);
+}
+
+// Config changed : saved CFG_SAVE_DELAY after the last change (task_config)
+void cfg_changed() {
+  cfg_dirty = true;
+  cfg_changed_at = millis();
+}
+
+// Current shift of the modified telegram, from the CLI or MQTT : 0..32 A, else refused
+bool cfg_set_shift(long v) {
+  if ((v < 0) || (v > 32)) return false;
+  cfg.I_Shift = v;
+  return true;
+}
+
+void print_cfg_line(const char *name, const char *text) {
+  cli_print(name, false, false, true);
+  cli_print(text, true, false, true);
+}
+
+void print_cfg_line(const char *name, uint32_t v) {
+  char st[12];
+  FMT f;
+  fmt_init(&f, st, sizeof(st));
+  fmt_uint(&f, v);
+  print_cfg_line(name, st);
 }
 
 void print_cfg() {
-  cli_print(String("Meter max current    : ") + cfg.I_Max_meter, true, false, true);
-  cli_print(String("Station shift current  : ") + cfg.I_Shift, true, false, true);
+  print_cfg_line("Meter profile        : ", METER_NAME);
+  print_cfg_line("Meter max current    : ", cfg.I_Max_meter);
+  print_cfg_line("Station shift current  : ", cfg.I_Shift);
+  print_cfg_line("L1 power scale (%)   : ", cfg.P_Scale);
+  const char *state_fmt[] = { "off", "json", "cbor" };
+  print_cfg_line("MQTT State message   : ", state_fmt[cfg.mqtt_state]);
+  print_cfg_line("MQTT legacy topics   : ", cfg.mqtt_topics);
+  print_cfg_line("MQTT intervals       : ", cfg.mqtt_intervals ? "on" : "off");
+  print_cfg_line("MQTT peak            : ", cfg.mqtt_peak ? "on" : "off");
+  char st[160];
+  sprintf(st, "Config store         : sector %u%s, slot %i, seq %u, %u saves, %u erases, %u errors, load %u us%s",
+              cfg_store.cur, cfg_store.addr[1] ? "" : " (no spare)", cfg_store.slot, cfg_store.seq,
+              cfg_store.saves, cfg_store.erases, cfg_store.errors,
+              cfg_store.load_us, cfg_dirty ? ", not saved" : "");
+  cli_print(st, true, false, true);
 }
 
 void data_save() {
   check_cfg();
-  EEPROM.put(0, cfg);
-  EEPROM.commit();
+  cfg_dirty = false;
+  if (!cfg_store_save(&cfg_store, &cfg, sizeof(cfg), CFG_VERSION)) {
+    dbg_msg("Data save failed");
+    cfg_changed();  // retry later
+    return;
+  }
   memcpy(&cfg_old, &cfg, sizeof(cfg));
-  dbgdsp = "Data saved";
+  dbg_msg("Data saved");
+}
+
+// Fields of older records, the ones they miss keep their defaults
+void cfg_migrate(CFG *c, uint16_t version) {
+  // version 1 : first versioned record, nothing to convert yet
+}
+
+// No record : EEPROM image of the first releases at the start of the EEPROM sector, if it looks valid
+bool cfg_legacy(CFG *c) {
+  CFG_V0 v0;
+  uint32_t w[(sizeof(CFG_V0) + 3) / 4];
+  if ((cfg_store.used == 0) || !ESP.flashRead(cfg_store.addr[0], w, sizeof(w))) return false;
+  memcpy(&v0, w, sizeof(v0));
+  if ((v0.I_Max_meter == 0) || (v0.I_Max_meter > 32) || (v0.I_Shift > 32) ||
+      (v0.send_p1 > 1) || (v0.send_pm1 > 1) || (v0.send_serial > 1)) return false;
+  c->I_Max_meter = v0.I_Max_meter;
+  c->I_Shift = v0.I_Shift;
+  c->send_p1 = v0.send_p1;
+  c->send_pm1 = v0.send_pm1;
+  c->send_serial = v0.send_serial;
+  return true;
 }
 
 void data_load() {
-  EEPROM.get(0, cfg);
+  CFG c;
+  uint16_t version = 0;
+  bool migrated = false;
+  if (cfg_store_load(&cfg_store, CFG_STORE_ADDR, CFG_SPARE_ADDR, &c, sizeof(c), &version) > 0) {
+    if (version < CFG_VERSION) cfg_migrate(&c, version);
+    migrated = (version != CFG_VERSION);
+  } else migrated = cfg_legacy(&c);
+  cfg = c;
   check_cfg();
   memcpy(&cfg_old, &cfg, sizeof(cfg));
-  dbgdsp = "Data loaded";
+  cfg_dirty = false;
+  if (migrated) data_save();  // in the current version
+  else dbg_msg("Data loaded");
+  if (cfg_store.load_us > CFG_LOAD_TARGET) dbg_msg("Config load over target");
   print_cfg();
 }
 
 
+void peak_load() {
+  PEAK_STORE ps;
+  File f = LittleFS.open(PEAK_FILE, "r");
+  if (!f) return;
+  bool ok = (f.read((uint8_t *)&ps, sizeof(ps)) == sizeof(ps));
+  f.close();
+  if (!ok || (ps.crc != crc16_update(0, (const char *)&ps, offsetof(PEAK_STORE, crc)))) return;
+  peak.month = ps.month;
+  peak.month_peak = ps.month_peak;
+  peak.month_peak_at = ps.month_peak_at;
+}
+
+void peak_save() {
+  PEAK_STORE ps;
+  ps.month = peak.month;
+  ps.month_peak = peak.month_peak;
+  ps.month_peak_at = peak.month_peak_at;
+  ps.crc = crc16_update(0, (const char *)&ps, offsetof(PEAK_STORE, crc));
+  File f = LittleFS.open(PEAK_FILE, "w");
+  if (!f) return;
+  f.write((const uint8_t *)&ps, sizeof(ps));
+  f.close();
+  peak.saved = true;
+}
+
 void uptime_to_text(char const *header, char const *trailer) {
   int d = uptime/86400;
   int h = (uptime - (d*86400)) / 3600;
   int m = (uptime - (d*86400) - (h*3600)) / 60;
   int s = uptime % 60;
-  sprintf(uptime_txt, "%s%4id %02ih:%02im:%02is%s", header, d, h, m, s, trailer);
+  FMT f;
+  fmt_init(&f, uptime_txt, sizeof(uptime_txt));
+  fmt_str(&f, header);
+  fmt_uint(&f, d, 4);
+  fmt_str(&f, "d ");
+  fmt_uint(&f, h, 2, '0');
+  fmt_str(&f, "h:");
+  fmt_uint(&f, m, 2, '0');
+  fmt_str(&f, "m:");
+  fmt_uint(&f, s, 2, '0');
+  fmt_str(&f, "s");
+  fmt_str(&f, trailer);
 }
 
-void exec_cmd(bool ser = false, bool net = false) {
-  std::string cmd = "";
-  std::string param1 = "";
-  std::string param2 = "";
-  std::string param3 = "";
-  int p1 = -1;
-  int p2 = -1;
-  int p3 = -1;
-  uint8_t idx = 0;
-  line = trim(line);
-  while ((idx < line.length()) & (line[idx] != ' ')) {
-    cmd += line[idx];
-    idx++;
-  }
-  while ((idx < line.length()) & (line[idx] == ' ')) idx++;
-  while ((idx < line.length()) & (line[idx] != ' ')) {
-    param1 += line[idx];
-    idx++;
-  }
-  while ((idx < line.length()) & (line[idx] == ' ')) idx++;
-  while ((idx < line.length()) & (line[idx] != ' ')) {
-    param2 += line[idx];
-    idx++;
+// Split s in place at spaces, returns the number of words
+int cli_split(char *s, char **argv, int max) {
+  int argc = 0;
+  while (argc < max) {
+    while ((*s == ' ') || (*s == '\t')) *s++ = 0;
+    if (*s == 0) break;
+    argv[argc++] = s;
+    while ((*s != 0) && (*s != ' ') && (*s != '\t')) s++;
   }
-  while ((idx < line.length()) & (line[idx] == ' ')) idx++;
-  while ((idx < line.length()) & (line[idx] != ' ')) {
-    param3 += line[idx];
-    idx++;
-  }
-  try { p1 = std::stoi(param1, nullptr, 0); } catch(...) {}
-  try { p2 = std::stoi(param2, nullptr, 0); } catch(...) {}
-  try { p3 = std::stoi(param3, nullptr, 0); } catch(...) {}
- 
-  cli_print(cmd.c_str());
-
-  if ((cmd == "show") || (cmd == "sh")) {
-    //bool found = false;
-    if (param1 == "uptime") {
-      uptime_to_text("\n\rUptime         : ", "\n\r");
-      cli_print(uptime_txt, true, ser, net);
-    }
-    if (param1 == "p1") {
-      cli_dspOrigP1 = !cli_dspOrigP1;
-    }
-    if (param1 == "m1") {
-      cli_dspModP1 = !cli_dspModP1;
-    }
-    if (param1 == "power") {
-      cli_dspPower = !cli_dspPower;
-    }
-    if (param1 == "energy") {
-      cli_dspEnergy = !cli_dspEnergy;
-    }
-    if (param1 == "peak") {
-      cli_dspPeak = !cli_dspPeak;
-    }
-    if (param1 == "config") {
-      print_cfg();
+  *s = 0;
+  return argc;
+}
+
+// Integer word i (decimal, 0x hex), def when missing or not a number
+int32_t cli_int(int argc, char **argv, int i, int32_t def = -1) {
+  if (i >= argc) return def;
+  char *end;
+  int32_t v = strtol(argv[i], &end, 0);
+  return (end == argv[i]) ? def : v;
+}
+
+// Command : run with its words (argv[0] is the command), or with no run, set *flag to on
+// (show commands toggle it instead). The tables are in flash with their texts (PROGMEM),
+// an entry is read with memcpy_P.
+struct CLI_CMD {
+  char name[17];
+  void (*run)(int argc, char **argv);
+  bool *flag;
+  bool on;
+  char help[56];      // "" : not listed (alias)
+};
+
+void cli_show(int argc, char **argv);
+void cli_help(int argc, char **argv);
+
+void cli_uptime(int argc, char **argv) {
+  uptime_to_text("Uptime         : ", "");
+  cli_print(uptime_txt, true, false, true);
+}
+
+void cli_config(int argc, char **argv) { print_cfg(); }
+void cli_tasks(int argc, char **argv) { sched_print(); }
+void cli_mqtt(int argc, char **argv) { mqtt_print(); }
+void cli_mbus(int argc, char **argv) { mbus_print(); }
+void cli_net(int argc, char **argv) { net_print(); }
+
+void cli_clients(int argc, char **argv) {
+  char st[100];
+  relay_print(&p1_relay);
+  relay_print(&pm1_relay);
+  http_print();
+  sprintf(st, "Telnet : %u writes, %u bytes dropped, %u dumps cut", cli_out.writes, cli_out.dropped, cli_out.cut);
+  cli_print(st, true, false, true);
+}
+
+void cli_history(int argc, char **argv) {
+  hist_show(cli_int(argc, argv, 1, 0), cli_int(argc, argv, 2, 0));
+}
+
+void cli_save(int argc, char **argv) { data_save(); }
+void cli_load(int argc, char **argv) { data_load(); }
+
+void cli_setshift(int argc, char **argv) {
+  cfg_set_shift(cli_int(argc, argv, 1));
+}
+
+void cli_setmax(int argc, char **argv) {
+  int32_t v = cli_int(argc, argv, 1);
+  if ((v > 0) && (v <= 32)) cfg.I_Max_meter = v;
+}
+
+void cli_setscale(int argc, char **argv) {
+  int32_t v = cli_int(argc, argv, 1);
+  if ((v >= 0) && (v <= 1000)) cfg.P_Scale = v;
+}
+
+void cli_settopics(int argc, char **argv) {
+  int32_t v = cli_int(argc, argv, 1);
+  if ((v >= 0) && (v <= MQTT_T_ALL)) cfg.mqtt_topics = v;
+}
+
+void cli_mqttstateon(int argc, char **argv) { cfg.mqtt_state = MQTT_STATE_JSON; }
+void cli_mqttstatecbor(int argc, char **argv) { cfg.mqtt_state = MQTT_STATE_CBOR; }
+void cli_mqttstateoff(int argc, char **argv) { cfg.mqtt_state = MQTT_STATE_OFF; }
+
+const CLI_CMD cli_show_cmds[] PROGMEM = {
+  // name        run           flag             on     help
+  { "uptime",    cli_uptime,   NULL,            false, "time since boot" },
+  { "p1",        NULL,         &cli_dspOrigP1,  true,  "next telegram" },
+  { "m1",        NULL,         &cli_dspModP1,   true,  "next modified telegram" },
+  { "power",     NULL,         &cli_dspPower,   true,  "power, voltage and current, next telegram" },
+  { "energy",    NULL,         &cli_dspEnergy,  true,  "energy counters, next telegram" },
+  { "peak",      NULL,         &cli_dspPeak,    true,  "capacity tariff quarter and month peak, next telegram" },
+  { "stats",     NULL,         &cli_dspStats,   true,  "decoding, UART and latency statistics, next telegram" },
+  { "config",    cli_config,   NULL,            false, "configuration" },
+  { "tasks",     cli_tasks,    NULL,            false, "scheduler tasks" },
+  { "mqtt",      cli_mqtt,     NULL,            false, "MQTT publish rates" },
+  { "mbus",      cli_mbus,     NULL,            false, "M-Bus devices" },
+  { "net",       cli_net,      NULL,            false, "WiFi and MQTT connections" },
+  { "clients",   cli_clients,  NULL,            false, "relay, HTTP and telnet clients" },
+  { "history",   cli_history,  NULL,            false, "<from> [<to>] : history records, YYMMDDhhmm" },
+};
+
+const CLI_CMD cli_cmds[] PROGMEM = {
+  // name               run                flag                  on     help
+  { "help",             cli_help,          NULL,                 false, "this list" },
+  { "show",             cli_show,          NULL,                 false, "<what> : see below, next telegram ones again to cancel" },
+  { "sh",               cli_show,          NULL,                 false, "" },
+  { "save",             cli_save,          NULL,                 false, "save the configuration" },
+  { "load",             cli_load,          NULL,                 false, "reload the saved configuration" },
+  { "setshift",         cli_setshift,      NULL,                 false, "<A> : current shift, modified telegram" },
+  { "setmax",           cli_setmax,        NULL,                 false, "<A> : current max, modified telegram" },
+  { "setscale",         cli_setscale,      NULL,                 false, "<%> : L1 power scale, modified telegram" },
+  { "serialon",         NULL,              &cfg.send_serial,     true,  "modified telegram on serial" },
+  { "serialoff",        NULL,              &cfg.send_serial,     false, "" },
+  { "p1on",             NULL,              &cfg.send_p1,         true,  "telegram relay, port 101" },
+  { "p1off",            NULL,              &cfg.send_p1,         false, "" },
+  { "pm1on",            NULL,              &cfg.send_pm1,        true,  "modified telegram relay, port 102" },
+  { "pm1off",           NULL,              &cfg.send_pm1,        false, "" },
+  { "mqttstateon",      cli_mqttstateon,   NULL,                 false, "State message, JSON" },
+  { "mqttstatecbor",    cli_mqttstatecbor, NULL,                 false, "State message, CBOR" },
+  { "mqttstateoff",     cli_mqttstateoff,  NULL,                 false, "no State message" },
+  { "mqttintervalson",  NULL,              &cfg.mqtt_intervals,  true,  "minute and quarter messages" },
+  { "mqttintervalsoff", NULL,              &cfg.mqtt_intervals,  false, "" },
+  { "mqttpeakon",       NULL,              &cfg.mqtt_peak,       true,  "capacity tariff messages" },
+  { "mqttpeakoff",      NULL,              &cfg.mqtt_peak,       false, "" },
+  { "settopics",        cli_settopics,     NULL,                 false, "<mask> : legacy MQTT topics" },
+};
+
+#define CLI_COUNT(t) (sizeof(t) / sizeof(t[0]))
+
+// Entry named name copied into c, false : none
+bool cli_find(const CLI_CMD *cmds, int n, const char *name, CLI_CMD *c) {
+  for (int i = 0; i < n; i++) {
+    if (strcmp_P(name, cmds[i].name) == 0) {
+      memcpy_P(c, &cmds[i], sizeof(CLI_CMD));
+      return true;
     }
   }
-  if (cmd == "save") data_save();
-  if (cmd == "load") data_load();
-  
-  if (cmd == "setshift") {
-    if ((p1 >= 0) && (p1 <= 32)) cfg.I_Shift = p1;
+  return false;
+}
+
+void cli_run(const CLI_CMD *c, int argc, char **argv) {
+  if (c->run != NULL) c->run(argc, argv);
+  else *c->flag = c->on;
+}
+
+// show of a next telegram display toggles it : the same show again cancels it before the telegram
+void cli_show(int argc, char **argv) {
+  CLI_CMD c;
+  if ((argc < 2) || !cli_find(cli_show_cmds, CLI_COUNT(cli_show_cmds), argv[1], &c)) return;
+  if (c.run == NULL) *c.flag = !*c.flag;
+  else cli_run(&c, argc - 1, argv + 1);
+}
+
+void cli_help_list(const CLI_CMD *cmds, int n, const char *prefix) {
+  char st[100];
+  CLI_CMD c;
+  CLI_CMD next;
+  for (int i = 0; i < n; i++) {
+    memcpy_P(&c, &cmds[i], sizeof(c));
+    if (c.help[0] == 0) continue;
+    FMT f;
+    fmt_init(&f, st, sizeof(st));
+    fmt_str(&f, prefix);
+    fmt_str(&f, c.name);
+    // on / off pairs : "serialon/off"
+    if ((c.run == NULL) && (i + 1 < n)) {
+      memcpy_P(&next, &cmds[i + 1], sizeof(next));
+      if (next.flag == c.flag) fmt_str(&f, "/off");
+    }
+    while (f.len < 22) fmt_char(&f, ' ');
+    fmt_str(&f, c.help);
+    cli_print(st, true, false, true);
   }
+}
+
+void cli_help(int argc, char **argv) {
+  cli_help_list(cli_cmds, CLI_COUNT(cli_cmds), "");
+  cli_help_list(cli_show_cmds, CLI_COUNT(cli_show_cmds), "show ");
+}
 
-  if (cmd == "serialon") cfg.send_serial = true;
-  if (cmd == "serialoff") cfg.send_serial = false;
-  if (cmd == "p1on") cfg.send_p1 = true;
-  if (cmd == "p1off") cfg.send_p1 = false;
-  if (cmd == "pm1on") cfg.send_pm1 = true;
-  if (cmd == "pm1off") cfg.send_pm1 = false;
+void exec_cmd() {
+  char *argv[CLI_ARGS];
+  int argc = cli_split(line, argv, CLI_ARGS);
+  if (argc == 0) return;
+  cli_print(argv[0], true);
+  CLI_CMD c;
+  if (cli_find(cli_cmds, CLI_COUNT(cli_cmds), argv[0], &c)) cli_run(&c, argc, argv);
+  if (memcmp(&cfg, &cfg_old, sizeof(cfg)) != 0) cfg_changed();
 }
 
 void process_cli(bool ser=false, bool net=false) {
 
-  if (dbgdsp.length() > 0) {
-      for (unsigned int idx = 0; idx < 2+line.length(); idx++) cli_print("\b \b", false, ser, net);
+  if (dbgdsp[0] != 0) {
+      for (int idx = 0; idx < 2+line_len; idx++) cli_print("\b \b", false, ser, net);
       uptime_to_text("[", " ] ");
       cli_print(uptime_txt, false, ser, net);
-      cli_print(dbgdsp.c_str(), true, ser, net);
-      dbgdsp = "";
+      cli_print(dbgdsp, true, ser, net);
+      dbgdsp[0] = 0;
       cli_print("> ", false, ser, net);
-      cli_print(line.c_str(), false, ser, net);
+      cli_print(line, false, ser, net);
   }
 
    if (ser && Serial.available() || (net && netcli_connected && cli_client.available())) {
@@ -318,83 +1065,440 @@ void process_cli(bool ser=false, bool net=false) {
         cli_print("", true, ser, net);
         exec_cmd();
         cli_print("> ", ser, net);
-        line = "";
+        line_len = 0;
+        line[0] = 0;
         break;
     case '\n': break;
     case '\b':
     case 0x7f:
     case 0x28: // Ctrl-H
-        if (line.length() > 0) {
-            line.pop_back();
+        if (line_len > 0) {
+            line[--line_len] = 0;
             cli_print("\b \b", ser, net);
         }
         break;
     case 0x00:
         break;
     default:
-        if (line.length() < 80) {
-          line += ch;
-          cli_print(String(ch), false, ser, net&fromserial);  // print only to serial, net is already echoed unless coming from serial
+        if (line_len < CLI_LINE) {
+          line[line_len++] = ch;
+          line[line_len] = 0;
+          char echo[2] = { ch, 0 };
+          cli_print(echo, false, ser, net&fromserial);  // print only to serial, net is already echoed unless coming from serial
         }
         break;
     }
   }
 }
 
+// Publish a new set of values (writer side)
+void dg_store(const DG *v) {
+  dg_snap.v[(dg_snap.seq + 1) & 1] = *v;
+  dg_snap.seq++;
+}
+
+// Copy the latest values, returns their sequence number (0 : nothing decoded yet)
+uint32_t dg_snapshot(DG *v) {
+  uint32_t seq;
+  do {
+    seq = dg_snap.seq;
+    *v = dg_snap.v[seq & 1];
+  } while (dg_snap.seq - seq > 1);
+  return seq;
+}
+
+bool mqtt_publish(const char *topic, const char *payload, bool retain) {
+  mqtt_stats.publishes++;
+  mqtt_stats.bytes += strlen(topic) + strlen(payload);
+  return mqtt_client.publish(topic, payload, retain);
+}
+
+bool mqtt_publish(const char *topic, const uint8_t *payload, unsigned int len, bool retain) {
+  mqtt_stats.publishes++;
+  mqtt_stats.bytes += strlen(topic) + len;
+  return mqtt_client.publish(topic, payload, len, retain);
+}
+
+void mqtt_state_json(const DG *v, FMT *f) {
+  fmt_open(f, '{');
+  fmt_json_uint(f, "E_consumed", v->E_consumed);
+  fmt_json_uint(f, "E_injected", v->E_injected);
+  fmt_json_uint(f, "P_consumed", v->P_consumed);
+  fmt_json_uint(f, "P_injected", v->P_injected);
+  fmt_json_ufixed(f, "U_L1", v->U_L1, 1);
+  fmt_json_ufixed(f, "U_L2", v->U_L2, 1);
+  fmt_json_ufixed(f, "U_L3", v->U_L3, 1);
+  fmt_json_ufixed(f, "I_L1", v->I_L1, 2);
+  fmt_json_ufixed(f, "I_L2", v->I_L2, 2);
+  fmt_json_ufixed(f, "I_L3", v->I_L3, 2);
+  fmt_json_int(f, "P_L1", (int32_t)v->P_act_L1);
+  fmt_json_int(f, "P_L2", (int32_t)v->P_act_L2);
+  fmt_json_int(f, "P_L3", (int32_t)v->P_act_L3);
+  fmt_json_uint(f, "P_QuarterHourPeak", v->LastPeak);
+  fmt_close(f, '}');
+}
+
+// All decoded values, for the HTTP API
+void http_dg_json(const DG *v, FMT *f) {
+  fmt_open(f, '{');
+  fmt_key(f, "t");
+  fmt_uint(f, v->CurrentDate, 6, '0');
+  fmt_uint(f, v->CurrentTime, 6, '0');
+  fmt_json_uint(f, "E_consumed_1", v->E_consumed_1);
+  fmt_json_uint(f, "E_consumed_2", v->E_consumed_2);
+  fmt_json_uint(f, "E_consumed", v->E_consumed);
+  fmt_json_uint(f, "E_injected_1", v->E_injected_1);
+  fmt_json_uint(f, "E_injected_2", v->E_injected_2);
+  fmt_json_uint(f, "E_injected", v->E_injected);
+  fmt_json_uint(f, "P_consumed", v->P_consumed);
+  fmt_json_uint(f, "P_injected", v->P_injected);
+  fmt_json_ufixed(f, "U_L1", v->U_L1, 1);
+  fmt_json_ufixed(f, "U_L2", v->U_L2, 1);
+  fmt_json_ufixed(f, "U_L3", v->U_L3, 1);
+  fmt_json_ufixed(f, "I_L1", v->I_L1, 2);
+  fmt_json_ufixed(f, "I_L2", v->I_L2, 2);
+  fmt_json_ufixed(f, "I_L3", v->I_L3, 2);
+  fmt_json_int(f, "P_L1", (int32_t)v->P_act_L1);
+  fmt_json_int(f, "P_L2", (int32_t)v->P_act_L2);
+  fmt_json_int(f, "P_L3", (int32_t)v->P_act_L3);
+  fmt_json_uint(f, "P_CurrentPeak", v->CurrentPeak);
+  fmt_json_uint(f, "P_QuarterHourPeak", v->LastPeak);
+  fmt_json_uint(f, "P_MonthPeak", v->MonthPeak);
+  fmt_json_int(f, "P_PeakHeadroom", v->PeakHeadroom);
+  fmt_json_uint(f, "PeakAlert", v->PeakAlert);
+  fmt_key(f, "MBus");
+  fmt_open(f, '[');
+  for (int i = 0; i < MBUS_CHANNELS; i++) {
+    const MBUS_VAL *m = &v->mbus[i];
+    if (m->type == MBUS_NONE) continue;
+    fmt_next(f);
+    fmt_open(f, '{');
+    fmt_json_uint(f, "channel", i + 1);
+    fmt_json_uint(f, "type", m->type);
+    fmt_json_ufixed(f, "value", m->value, 3);
+    fmt_json_str(f, "unit", m->unit);
+    fmt_key(f, "t");
+    fmt_uint(f, m->date, 6, '0');
+    fmt_uint(f, m->time, 6, '0');
+    fmt_close(f, '}');
+  }
+  fmt_close(f, ']');
+  fmt_close(f, '}');
+}
+
+// Fixed-point values as integers, returns 0 if buf is too small
+size_t mqtt_state_cbor(const DG *v, uint8_t *buf, size_t size) {
+  CBOR c;
+  cbor_init(&c, buf, size);
+  cbor_map(&c, K_COUNT);
+  cbor_uint(&c, K_SCHEMA);      cbor_uint(&c, MQTT_CBOR_SCHEMA);
+  cbor_uint(&c, K_DATE);        cbor_uint(&c, v->CurrentDate);
+  cbor_uint(&c, K_TIME);        cbor_uint(&c, v->CurrentTime);
+  cbor_uint(&c, K_E_CONSUMED);  cbor_uint(&c, v->E_consumed);
+  cbor_uint(&c, K_E_INJECTED);  cbor_uint(&c, v->E_injected);
+  cbor_uint(&c, K_P_CONSUMED);  cbor_uint(&c, v->P_consumed);
+  cbor_uint(&c, K_P_INJECTED);  cbor_uint(&c, v->P_injected);
+  cbor_uint(&c, K_U_L1);        cbor_uint(&c, v->U_L1);
+  cbor_uint(&c, K_U_L2);        cbor_uint(&c, v->U_L2);
+  cbor_uint(&c, K_U_L3);        cbor_uint(&c, v->U_L3);
+  cbor_uint(&c, K_I_L1);        cbor_uint(&c, v->I_L1);
+  cbor_uint(&c, K_I_L2);        cbor_uint(&c, v->I_L2);
+  cbor_uint(&c, K_I_L3);        cbor_uint(&c, v->I_L3);
+  cbor_uint(&c, K_P_L1);        cbor_int(&c, (int32_t)v->P_act_L1);
+  cbor_uint(&c, K_P_L2);        cbor_int(&c, (int32_t)v->P_act_L2);
+  cbor_uint(&c, K_P_L3);        cbor_int(&c, (int32_t)v->P_act_L3);
+  cbor_uint(&c, K_PEAK);        cbor_uint(&c, v->LastPeak);
+  return c.overflow ? 0 : c.len;
+}
+
+void mqtt_interval_json(const AGG *a, FMT *f) {
+  fmt_open(f, '{');
+  fmt_json_uint(f, "t", a->stamp);
+  fmt_json_uint(f, "n", a->n);
+  fmt_json_uint(f, "E_consumed", a->E_consumed);
+  fmt_json_uint(f, "E_injected", a->E_injected);
+  for (int i = 0; i < AGG_COUNT; i++) {
+    int32_t v[3] = { a->min[i], agg_avg(a, i), a->max[i] };
+    fmt_key(f, agg_names[i]);
+    fmt_open(f, '[');
+    for (int j = 0; j < 3; j++) {
+      fmt_next(f);
+      fmt_fixed(f, v[j], agg_decimals[i]);
+    }
+    fmt_close(f, ']');
+  }
+  fmt_close(f, '}');
+}
+
+// Last closed interval of s not published yet (*seq behind) to the outbox, *seq only moves
+// once it is queued. Returns false : still not queued, outbox full.
+bool intervals_queue(AGG_STREAM *s, uint32_t *seq, uint8_t kind) {
+  if (*seq == s->seq) return true;
+  if (!outbox_push(&outbox, kind, &s->last)) return false;
+  *seq = s->seq;
+  return true;
+}
+
+// One message per closed interval, queued for replay when the publish fails
+void mqtt_publish_interval(AGG_STREAM *s, uint32_t *seq, uint8_t kind, const char *topic, char *value, size_t size) {
+  if (*seq == s->seq) return;
+  if (!cfg.mqtt_intervals) {
+    *seq = s->seq;
+    return;
+  }
+  FMT f;
+  fmt_init(&f, value, size);
+  mqtt_interval_json(&s->last, &f);
+  if (mqtt_publish(topic, value, false)) *seq = s->seq;
+  else intervals_queue(s, seq, kind);
+}
+
+void mqtt_publish_intervals(char *value, size_t size) {
+  mqtt_publish_interval(&agg_min, &mqtt_min_seq, OUTBOX_MINUTE, MQTT_TOPIC "Minute", value, size);
+  mqtt_publish_interval(&agg_qtr, &mqtt_qtr_seq, OUTBOX_QUARTER, MQTT_TOPIC "Quarter", value, size);
+}
+
+// Replay the intervals of the outbox, as history records (History schema, not the one of
+// Minute / Quarter) on Backlog/Minute and Backlog/Quarter, acknowledged by their echo
+// (mqtt_callback)
+void outbox_publish(char *value, size_t size) {
+  OUTBOX_REC *r = outbox_next(&outbox);
+  if (r == NULL) return;
+  FMT f;
+  fmt_init(&f, value, size);
+  hist_json(&r->r, &f);
+  if (mqtt_publish((r->kind == OUTBOX_QUARTER) ? MQTT_TOPIC "Backlog/Quarter" : MQTT_TOPIC "Backlog/Minute", value, false)) {
+    outbox_sent(&outbox);
+  }
+}
+
+void mqtt_publish_outbox() {
+  char value[160];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  fmt_open(&f, '{');
+  fmt_json_uint(&f, "depth", outbox_depth(&outbox));
+  fmt_json_uint(&f, "queued", outbox.queued);
+  fmt_json_uint(&f, "dropped", outbox.dropped);
+  fmt_json_uint(&f, "acked", outbox.acked);
+  fmt_json_uint(&f, "unacked", outbox.unacked);
+  fmt_json_uint(&f, "replay_rate", mqtt_stats.replays_s);
+  fmt_json_uint(&f, "errors", outbox.errors);
+  fmt_close(&f, '}');
+  mqtt_publish(MQTT_TOPIC "Outbox", value, true);
+}
+
+// One retained message per M-Bus channel, when the device captured a new reading
+void mqtt_publish_mbus(const DG *v, char *value, size_t size) {
+  char topic[] = MQTT_TOPIC "MBus/0";
+  for (int i = 0; i < MBUS_CHANNELS; i++) {
+    const MBUS_VAL *m = &v->mbus[i];
+    if ((m->date == 0) || ((m->date == mqtt_mbus_date[i]) && (m->time == mqtt_mbus_time[i]))) continue;
+    topic[sizeof(topic) - 2] = '1' + i;
+    FMT f;
+    fmt_init(&f, value, size);
+    fmt_open(&f, '{');
+    fmt_json_uint(&f, "type", m->type);
+    fmt_json_str(&f, "device", mbus_type_name(m->type));
+    fmt_json_ufixed(&f, "value", m->value, 3);
+    fmt_json_str(&f, "unit", m->unit);
+    fmt_key(&f, "t");
+    fmt_uint(&f, m->date, 6, '0');
+    fmt_uint(&f, m->time, 6, '0');
+    fmt_close(&f, '}');
+    if (!mqtt_publish(topic, value, true)) continue;
+    mqtt_mbus_date[i] = m->date;
+    mqtt_mbus_time[i] = m->time;
+  }
+}
+
+// Publish the next records of a running history query
+void hist_publish() {
+  char value[400];
+  FMT f;
+  int burst = HIST_MQTT_BURST;
+  while ((hist_query.log != NULL) && (burst-- > 0)) {
+    HIST_QUERY *q = &hist_query;
+    HIST_REC r;
+    bool more = (q->pos < hist_end(q->log)) && (q->count < HIST_MQTT_MAX);
+    if (more && !hist_read(q->log, q->pos++, &r)) continue;
+    int in = more ? hist_range(r.stamp, q->from, q->to) : 1;
+    if (in < 0) continue;
+    if (in > 0) {
+      fmt_init(&f, value, sizeof(value));
+      fmt_open(&f, '{');
+      fmt_json_uint(&f, "end", q->count);
+      fmt_close(&f, '}');
+      mqtt_publish(MQTT_TOPIC "History", value, false);
+      q->log = NULL;
+      break;
+    }
+    fmt_init(&f, value, sizeof(value));
+    hist_json(&r, &f);
+    mqtt_publish(MQTT_TOPIC "History", value, false);
+    q->count++;
+  }
+}
+
+// Single value topic
+void mqtt_publish_uint(const char *topic, uint32_t v) {
+  char value[12];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  fmt_uint(&f, v);
+  mqtt_publish(topic, value, true);
+}
+
 void process_mqtt() {
   char topic[80];
-  char value[255];
+  char value[600];
+  FMT f;
   if (mqtt_client.connected()) {
     if (cmd_clear != 255) {
-        sprintf(topic, "%s%i/set", MQTT_TOPIC, cmd_clear);
-        mqtt_client.publish(topic, "", true);
+        fmt_init(&f, topic, sizeof(topic));
+        fmt_str(&f, MQTT_TOPIC);
+        fmt_uint(&f, cmd_clear);
+        fmt_str(&f, "/set");
+        mqtt_publish(topic, "", true);
         cmd_clear = 255;
         return;
     }
-    if (dg.decoded && !dg.sent) {
-        if ((dg.E_consumed != dg_old.E_consumed) || (dg.E_injected != dg_old.E_injected)){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "Energy");
-          sprintf(value, "{\"E_consumed\": %i,\"E_injected\": %i}", dg.E_consumed, dg.E_injected);
-          mqtt_client.publish(topic, value, true);
+    mqtt_publish_intervals(value, sizeof(value));
+    outbox_publish(value, sizeof(value));
+    if (dg_snap.seq != mqtt_seq) {
+        DG v;
+        mqtt_seq = dg_snapshot(&v);
+        uint8_t t = cfg.mqtt_topics;
+
+        if (cfg.mqtt_peak) {
+          fmt_init(&f, value, sizeof(value));
+          fmt_open(&f, '{');
+          fmt_json_ufixed(&f, "forecast", v.CurrentPeak, 3);
+          fmt_json_fixed(&f, "headroom", v.PeakHeadroom, 3);
+          fmt_json_ufixed(&f, "month_peak", v.MonthPeak, 3);
+          fmt_json_uint(&f, "alert", v.PeakAlert);
+          fmt_close(&f, '}');
+          mqtt_publish(MQTT_TOPIC "Peak", value, false);
+          if (v.PeakAlert != mqtt_alert) {
+            const char *alert_txt[] = { "ok", "warning", "new_peak" };
+            mqtt_publish(MQTT_TOPIC "PeakAlert", alert_txt[v.PeakAlert], true);
+            mqtt_alert = v.PeakAlert;
+          }
+        }
+
+        mqtt_publish_mbus(&v, value, sizeof(value));
+
+        if (cfg.mqtt_state == MQTT_STATE_JSON) {
+          fmt_init(&f, value, sizeof(value));
+          mqtt_state_json(&v, &f);
+          mqtt_publish(MQTT_TOPIC "State", value, true);
+        }
+        if (cfg.mqtt_state == MQTT_STATE_CBOR) {
+          uint8_t bin[96];
+          size_t len = mqtt_state_cbor(&v, bin, sizeof(bin));
+          if (len > 0) mqtt_publish(MQTT_TOPIC "StateBin", bin, len, true);
+        }
+
+        if ((t & MQTT_T_ENERGY) && ((v.E_consumed != mqtt_old.E_consumed) || (v.E_injected != mqtt_old.E_injected))){
+          fmt_init(&f, value, sizeof(value));
+          fmt_open(&f, '{');
+          fmt_json_uint(&f, "E_consumed", v.E_consumed);
+          fmt_json_uint(&f, "E_injected", v.E_injected);
+          fmt_close(&f, '}');
+          mqtt_publish(MQTT_TOPIC "Energy", value, true);
+        }
+        if (t & MQTT_T_POWER) {
+          fmt_init(&f, value, sizeof(value));
+          fmt_open(&f, '{');
+          fmt_json_uint(&f, "P_consumed", v.P_consumed);
+          fmt_json_uint(&f, "P_injected", v.P_injected);
+          fmt_close(&f, '}');
+          mqtt_publish(MQTT_TOPIC "Power", value, true);
+        }
+        if (t & MQTT_T_LINES) {
+          fmt_init(&f, value, sizeof(value));
+          fmt_open(&f, '{');
+          fmt_json_ufixed(&f, "U_L1", v.U_L1, 1);
+          fmt_json_ufixed(&f, "U_L2", v.U_L2, 1);
+          fmt_json_ufixed(&f, "U_L3", v.U_L3, 1);
+          fmt_close(&f, '}');
+          mqtt_publish(MQTT_TOPIC "Lines", value, true);
         }
-        sprintf(topic, "%s%s", MQTT_TOPIC, "Power");
-        sprintf(value, "{\"P_consumed\": %i,\"P_injected\": %i}", dg.P_consumed, dg.P_injected);
-        mqtt_client.publish(topic, value, true);
-        sprintf(topic, "%s%s", MQTT_TOPIC, "Lines");
-        sprintf(value, "{\"U_L1\": %i.%i,\"U_L2\": %i.%i,\"U_L3\": %i.%i}", dg.U_L1/10, dg.U_L1%10, dg.U_L2/10, dg.U_L2%10, dg.U_L3/10, dg.U_L3%10);
-        mqtt_client.publish(topic, value, true);
         
-        if (dg.P_consumed != dg_old.P_consumed){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "P_consumed");
-          sprintf(value, "%i", dg.P_consumed);
-          mqtt_client.publish(topic, value, true);
+        if ((t & MQTT_T_P_CONSUMED) && (v.P_consumed != mqtt_old.P_consumed)){
+          mqtt_publish_uint(MQTT_TOPIC "P_consumed", v.P_consumed);
         }
-        if (dg.P_injected != dg_old.P_injected){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "P_injected");
-          sprintf(value, "%i", dg.P_injected);
-          mqtt_client.publish(topic, value, true);
+        if ((t & MQTT_T_P_INJECTED) && (v.P_injected != mqtt_old.P_injected)){
+          mqtt_publish_uint(MQTT_TOPIC "P_injected", v.P_injected);
         }
-        if (dg.E_consumed != dg_old.E_consumed){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "E_consumed");
-          sprintf(value, "%i", dg.E_consumed);
-          mqtt_client.publish(topic, value, true);
+        if ((t & MQTT_T_E_CONSUMED) && (v.E_consumed != mqtt_old.E_consumed)){
+          mqtt_publish_uint(MQTT_TOPIC "E_consumed", v.E_consumed);
         }
-        if (dg.E_injected != dg_old.E_injected){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "E_injected");
-          sprintf(value, "%i", dg.E_injected);
-          mqtt_client.publish(topic, value, true);
+        if ((t & MQTT_T_E_INJECTED) && (v.E_injected != mqtt_old.E_injected)){
+          mqtt_publish_uint(MQTT_TOPIC "E_injected", v.E_injected);
         }
-        if (dg.LastPeak != dg_old.LastPeak){
-          sprintf(topic, "%s%s", MQTT_TOPIC, "P_QuarterHourPeak");
-          sprintf(value, "%i", dg.LastPeak);
-          mqtt_client.publish(topic, value, true);
+        if ((t & MQTT_T_PEAK) && (v.LastPeak != mqtt_old.LastPeak)){
+          mqtt_publish_uint(MQTT_TOPIC "P_QuarterHourPeak", v.LastPeak);
         }
-        dg.sent = true;
-        memcpy(&dg_old, &dg, sizeof(dg));
+        mqtt_old = v;
+        // snapshot and telegram text are updated together, same count
+        if (mqtt_seq == tg.seq) LAT_ADD(lat_mqtt, micros() - tg.t_end);
     }
+    hist_publish();
+  }
+}
+
+void mqtt_rates() {
+  mqtt_stats.publishes_s = mqtt_stats.publishes - mqtt_stats.last_publishes;
+  mqtt_stats.bytes_s = mqtt_stats.bytes - mqtt_stats.last_bytes;
+  mqtt_stats.last_publishes = mqtt_stats.publishes;
+  mqtt_stats.last_bytes = mqtt_stats.bytes;
+  mqtt_stats.replays_s = outbox.sent - mqtt_stats.last_replays;
+  mqtt_stats.last_replays = outbox.sent;
+}
+
+void mqtt_print() {
+  char st[100];
+  sprintf(st, "MQTT publishes: %u (%u/s), bytes: %u (%u/s)",
+              mqtt_stats.publishes, mqtt_stats.publishes_s, mqtt_stats.bytes, mqtt_stats.bytes_s);
+  cli_print(st, true, false, true);
+  sprintf(st, "Outbox: %u queued (%u in flash), %u dropped, %u sent (%u/s), %u acked, %u unacked, %u spills, %u errors",
+              outbox_depth(&outbox), outbox.file_n - outbox.file_rd, outbox.dropped, outbox.sent, mqtt_stats.replays_s,
+              outbox.acked, outbox.unacked, outbox.spills, outbox.errors);
+  cli_print(st, true, false, true);
+}
+
+void mbus_print() {
+  char st[100];
+  DG v;
+  dg_snapshot(&v);
+  for (int i = 0; i < MBUS_CHANNELS; i++) {
+    const MBUS_VAL *m = &v.mbus[i];
+    if (m->type == MBUS_NONE) continue;
+    sprintf(st, "M-Bus %i : %-10s %u.%03u %s at %06u %06u", i + 1, mbus_type_name(m->type),
+                m->value / 1000, m->value % 1000, m->unit, m->date, m->time);
+    cli_print(st, true, false, true);
   }
 }
 
+void conn_print(const CONN *c) {
+  char st[120];
+  uint32_t now = millis();
+  sprintf(st, "%-5s: %s for %u s, %u connects, %u losses", c->name, c->up ? "up" : "down", (now - c->since) / 1000,
+              c->connects, c->losses);
+  cli_print(st, true, false, true);
+  if (c->attempts == 0) return;
+  sprintf(st, "       %u attempts, blocked %u ms (max %u ms)", c->attempts, c->blocked_us / 1000, c->blocked_max_us / 1000);
+  if (!c->up) sprintf(st + strlen(st), ", next in %i s", (int32_t)(c->next - now) / 1000);
+  cli_print(st, true, false, true);
+}
+
+void net_print() {
+  conn_print(&wifi_conn);
+  conn_print(&mqtt_conn);
+  cli_print(servers_started ? "Servers : listening" : "Servers : not started", true, false, true);
+}
+
 char *strremove(char *str, const char *sub) {
     char *p, *q, *r;
     if (*sub && (q = r = strstr(str, sub)) != NULL) {
@@ -410,6 +1514,15 @@ char *strremove(char *str, const char *sub) {
 }
 
 void mqtt_callback(char* topic, byte* payload, unsigned int length) {
+  // echo of a replayed interval : {"t": <stamp>, ...
+  const char backlog[] = MQTT_TOPIC "Backlog/";
+  if (strncmp(topic, backlog, sizeof(backlog) - 1) == 0) {
+    if ((length > 6) && (memcmp(payload, "{\"t\": ", 6) == 0)) {
+      uint8_t kind = (strcmp(topic + sizeof(backlog) - 1, "Quarter") == 0) ? OUTBOX_QUARTER : OUTBOX_MINUTE;
+      outbox_ack(&outbox, kind, strtoul((char *)payload + 6, NULL, 10));
+    }
+    return;
+  }
   char value[10] = "";
   uint8_t idx = 0;
   while ((idx < length) && (idx < sizeof(value) - 2)) {
@@ -417,456 +1530,553 @@ void mqtt_callback(char* topic, byte* payload, unsigned int length) {
     idx++;
   }
   value[idx] = '\0';
-  dbgdsp = "Message arrived [" + std::string(topic) + "] " + std::string(value);
+  FMT dbg;
+  fmt_init(&dbg, dbgdsp, sizeof(dbgdsp));
+  fmt_str(&dbg, "Message arrived [");
+  fmt_str(&dbg, topic);
+  fmt_str(&dbg, "] ");
+  fmt_str(&dbg, value);
 
   strremove(topic, MQTT_TOPIC);
-  //int id = 0;
-  //try { id = std::stoi(topic, nullptr, 0); } catch(...) {}
+  //int id = strtol(topic, NULL, 0);
 
   payload[length] = 0;
 
-/*  if (String(topic) == "cmd/mode") {
-    if (String((char *) payload) == "transparent") {
-      dbgdsp += " - Transparent mode ON";
+/*  if (strcmp(topic, "cmd/mode") == 0) {
+    if (strcmp((char *)payload, "transparent") == 0) {
+      fmt_str(&dbg, " - Transparent mode ON");
     }
-    if (String((char *)payload) == "") {
+    if (strcmp((char *)payload, "") == 0) {
     }
   }
 */
-  if (String(topic) == "cmd/maxamp") {
-    int amp = 0;
-    try { amp = std::stoi((char *)payload, nullptr, 0); } catch(...) {}
-    dbgdsp += " - Set MAX amp to " + std::to_string(amp) + " A";
-    cfg.I_Shift = amp;
-  }
-}
-
-void crc_compute(DG *dg) {
-  unsigned int crc = 0;
-  if (dg->idx > 10) {
-  for (unsigned int i = 0; i < dg->idx-4; i++) {
-    crc ^= (unsigned int)(dg->buf[i]);
-    int bit = 0;
-    while (bit < 8) {
-      if ((crc & 1) != 0) {
-        crc = (crc >> 1) ^ 0xA001;
-      }
-      else crc >>= 1;
-      bit++;
-    }
-  } 
-  }else { /*cli_client.write('E');*/}
-  sprintf(dg->crc_computed, "%04X", crc);
-}
-
-void crc_add(char *buf) {
-  unsigned int crc = 0;
-  unsigned int idx = 0;
-  int16_t l = strlen(buf); 
-  for (unsigned int i = 0; i < l; i++) {
-    crc ^= (unsigned int)(buf[i]);
-    int bit = 0;
-    while (bit < 8) {
-      if ((crc & 1) != 0) {
-        crc = (crc >> 1) ^ 0xA001;
-      }
-      else crc >>= 1;
-      bit++;
+  if (strcmp(topic, "cmd/maxamp") == 0) {
+    char *end;
+    long amp = strtol((char *)payload, &end, 0);
+    if ((end == (char *)payload) || (*end != 0) || !cfg_set_shift(amp)) {
+      fmt_str(&dbg, " - Refused, 0 to 32 A");
+    } else {
+      fmt_str(&dbg, " - Set MAX amp to ");
+      fmt_int(&dbg, amp);
+      fmt_str(&dbg, " A");
+      cfg_changed();
     }
-    idx = i;
   }
-  sprintf(&buf[idx+1], "%04X\n\r", crc);
-  buf[idx+7] = '\0';
-}
 
-void p1_copytoorig(DG *dg) {
-  if (dg->idx > 10) {
-    for (unsigned int i = 0; i < dg->idx; i++) {
-      dg->OrigP1[i] = dg->buf[i];
-      dg->OrigP1[i+1] = '\0';
-    }
+  // payload : "<from> [<to>]", YYMMDDhhmm meter time
+  if (strcmp(topic, "cmd/history") == 0) {
+    char *end;
+    uint32_t from = strtoul((char *)payload, &end, 10);
+    uint32_t to = strtoul(end, NULL, 10);
+    hist_query.log = hist_select(from);
+    hist_query.pos = hist_seek(hist_query.log, from);
+    hist_query.from = from;
+    hist_query.to = (to == 0) ? 0xFFFFFFFF : to;
+    hist_query.count = 0;
   }
 }
 
-void p1_copytomod(DG *dg) {
-  if (dg->idx > 10) {
-    for (unsigned int i = 0; i < dg->idx-6; i++) {
-      dg->ModP1[i] = dg->buf[i];
-      dg->ModP1[i+1] = '\0';
-    }
+// Publish the values decoded while the telegram was received
+void dg_apply(DG *dg, const OBIS_VAL &ov) {
+  dg->P_consumed = ov.val[OBIS_P_CONS];
+  dg->P_injected = ov.val[OBIS_P_INJ];
+  dg->P = dg->P_consumed - dg->P_injected;
+  dg->E_consumed_1 = ov.val[OBIS_E_CONS_1];
+  dg->E_consumed_2 = ov.val[OBIS_E_CONS_2];
+  dg->E_consumed = dg->E_consumed_1 + dg->E_consumed_2;
+  dg->E_injected_1 = ov.val[OBIS_E_INJ_1];
+  dg->E_injected_2 = ov.val[OBIS_E_INJ_2];
+  dg->E_injected = dg->E_injected_1 + dg->E_injected_2;
+  dg->CurrentDate = ov.date;
+  dg->CurrentTime = ov.time;
+  dg->CurrentPeak = ov.val[OBIS_PEAK];
+  dg->U_L1 = ov.val[OBIS_U_L1];
+  dg->U_L2 = ov.val[OBIS_U_L2];
+  dg->U_L3 = ov.val[OBIS_U_L3];
+  dg->I_L1 = ov.val[OBIS_I_L1];
+  dg->I_L2 = ov.val[OBIS_I_L2];
+  dg->I_L3 = ov.val[OBIS_I_L3];
+  dg->P_act_L1 = ov.val[OBIS_P_CONS_L1] - ov.val[OBIS_P_INJ_L1];
+  dg->P_act_L2 = ov.val[OBIS_P_CONS_L2] - ov.val[OBIS_P_INJ_L2];
+  dg->P_act_L3 = ov.val[OBIS_P_CONS_L3] - ov.val[OBIS_P_INJ_L3];
+  memcpy(dg->mbus, ov.mbus, sizeof(dg->mbus));
+}
+
+// Telegram complete : keep its values and text if the CRC is valid
+bool dg_receive(DG *dg, P1_FRAME *f) {
+  if (!f->crc_valid) return false;
+  dg_apply(dg, f->ov);
+
+  if (dg->CurrentDate != 0) {
+    peak_update(&peak, dg->CurrentDate, dg->CurrentTime, dg->CurrentPeak, dg->P_consumed);
+    dg->QuarterTime = peak.elapsed;
+    dg->CurrentPeak = peak.forecast;
+    dg->LastPeak = peak.last;
+    dg->MonthPeak = peak.month_peak;
+    dg->PeakHeadroom = peak.headroom;
+    dg->PeakAlert = peak.alert;
   }
+
+  dg->P_ap_L1 = dg->U_L1 * dg->I_L1;
+  dg->P_ap_L2 = dg->U_L2 * dg->I_L2;
+  dg->P_ap_L3 = dg->U_L3 * dg->I_L3;
+  dg->P_cos_L1 = (dg->P_act_L1 != 0 ? (100 * dg->P_ap_L1 / dg->P_act_L1) : 1);
+  dg->P_cos_L2 = (dg->P_act_L2 != 0 ? (100 * dg->P_ap_L2 / dg->P_act_L2) : 1);
+  dg->P_cos_L3 = (dg->P_act_L3 != 0 ? (100 * dg->P_ap_L3 / dg->P_act_L3) : 1);
+
+  // swap buffers, the telegram text is never copied
+  tg.buf = p1_swap(f, tg.buf);
+  tg.len = f->idx;
+  tg.body_len = f->idx - 6;
+  tg.t_end = f->t_end;
+
+  uint32_t val[OBIS_COUNT];
+  crc16_format(rw_apply(&tg.rw, rw_rules, rw_rules_count, f, tg.buf, tg.body_len, val), tg.mod_tail);
+  dg->I_Mod_L1 = val[OBIS_I_L1];
+  dg->I_Mod_L2 = val[OBIS_I_L2];
+  dg->I_Mod_L3 = val[OBIS_I_L3];
+  tg.mod_tail[4] = '\r';
+  tg.mod_tail[5] = '\n';
+  tg.seq++;
+
+  dg_store(dg);
+  return true;
 }
 
-uint32_t dg_obis_getdate() {
-  char* code = "0-0:1.0.0(";
-  char data[7];
-  int idx = strstr(dg.buf, code) - dg.buf;
-      if (idx > 0){
-        memcpy(data, dg.buf + idx + strlen(code), 6);
-        data[6]=0;
-        uint32_t val = 0;
-          try { val = std::stoi(data, nullptr, 10); } catch(...) {}
-          return val;
-      } else return 0;
-}
-
-uint32_t dg_obis_gettime() {
-  char* code = "0-0:1.0.0(";
-  char data[7];
-  int idx = strstr(dg.buf, code) - dg.buf;
-      if (idx > 0){
-        memcpy(data, dg.buf + idx + strlen(code) + 6, 6);
-        data[6]=0;
-        uint32_t val = 0;
-          try { val = std::stoi(data, nullptr, 10); } catch(...) {}
-          return val;
-      } else return 0;
-}
-
-uint32_t dg_obis_decode(char *code, char *unit) {
-  //char st[100];
-  int idx = strstr(dg.buf, code) - dg.buf;
-      if (idx > 0){
-        idx += strlen(code);
-        int idx2 = strstr(dg.buf + idx, unit) - dg.buf - idx;
-        if ((idx2 > 0) && (idx2 < 100)) {
-          char sub[100];
-          strncpy(sub, dg.buf+idx, idx2); sub[idx2]='\0';
-          int idxComma = strstr(sub, ".") - sub; if (idxComma>0) memmove(&sub[idxComma], &sub[idxComma + 1], strlen(sub) - idxComma);
-          uint32_t val = 0;
-          try { val = std::stoi(sub, nullptr, 10); } catch(...) {}
-          //sprintf(st, "\n%i %i %i %s\n", idx, idx2, val, sub); cli_client.write(st);
-          return val;
-        } else return 0;
-      } else return 0;
-}
-
-bool dg_obis_update(char *code, char *unit, uint32_t value, uint8_t int_len, uint8_t dec_len) {
-  uint32_t dec = 1;
-  for (unsigned int i = 0; i < dec_len; i++) dec *= 10;
-  int idx = strstr(dg.ModP1, code) - dg.ModP1;
-      if ((idx > 0) && (int_len < 10) && (dec_len < 4)) {
-        idx += strlen(code);
-        int idx2 = strstr(dg.ModP1 + idx, unit) - dg.ModP1 - idx;
-        if (idx2 > 0) {
-          char fmt[5];
-          char val[10];
-          sprintf(fmt, "%%%02ii", int_len);
-          sprintf(val, fmt, value / dec);
-          memcpy(dg.ModP1+idx, val, int_len);
-          sprintf(fmt, "%%%02ii", dec_len);
-          sprintf(val, fmt, value % dec);
-          memcpy(dg.ModP1+idx+int_len+1, val, dec_len);
-          return true;
-        } else return false;
-      } else return false;
+#if LAT_STATS
+void lat_print(const char *name, const LAT_HIST *h) {
+  char st[100];
+  sprintf(st, "\r\n%-14s %-10u %-10u %-10u %u", name, h->count, lat_pct(h, 50), lat_pct(h, 99), h->max);
+  cli_print(st, false, false, true);
 }
 
-void setup() {
-  // Init serial port
-  Serial.begin(115200);  
+void lat_json(FMT *f, const char *name, LAT_HIST *h) {
+  fmt_key(f, name);
+  fmt_open(f, '[');
+  uint32_t v[4] = { h->count, lat_pct(h, 50), lat_pct(h, 99), h->max };
+  for (int i = 0; i < 4; i++) {
+    fmt_next(f);
+    fmt_uint(f, v[i]);
+  }
+  fmt_close(f, ']');
+  *h = LAT_HIST();
+}
 
-  EEPROM.begin(4096);
-  data_load();
-  
-  // Set Digital I/O and Interrupt handlers
+// {"stage": [count, p50, p99, max], ...} over the last period, then start a new one
+void lat_publish() {
+  char value[200];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  fmt_open(&f, '{');
+  lat_json(&f, "frame", &lat_frame);
+  lat_json(&f, "decode", &lat_decode);
+  lat_json(&f, "relay", &lat_relay);
+  lat_json(&f, "mqtt", &lat_mqtt);
+  fmt_close(&f, '}');
+  mqtt_publish(MQTT_TOPIC "Stats", value, false);
+}
+#endif
+
+// Process received datagram : relay and local outputs
+void dg_output() {
+  char st[200];
   
-  // LED
-  pinMode(rx_led, OUTPUT);
-  digitalWrite(rx_led, HIGH);
-  //pinMode(tx_led, OUTPUT);
-  //digitalWrite(tx_led, HIGH);
+  if (cli_dspEnergy) {
+    sprintf(st, "\n\rE_Cons:%9i (%i + %i)\n\rE_Inj :%9i (%i + %i)",
+                dg.E_consumed, dg.E_consumed_1, dg.E_consumed_2, dg.E_injected, dg.E_injected_1, dg.E_injected_2
+                ); cli_print(st, false, false, true);
+    cli_dspEnergy = false;
+  }
 
-  // Start WiFi
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PSK);
+  if (cli_dspPower) {
+    sprintf(st, "\n\rP_Cons:%7i\n\rP_Inj :%7i\n\rU     : %3i %3i %3i\n\rI      : %3i %3i %3i",
+                dg.P_consumed, dg.P_injected,
+                dg.U_L1, dg.U_L2, dg.U_L3, dg.I_L1, dg.I_L2, dg.I_L3
+                ); cli_print(st, false, false, true);
+    cli_dspPower = false;
+  }
 
-  // Init OTA
-  OTAsetup();
-  OTAbegin();
+  if (cli_dspPeak) {
+    sprintf(st, "\r\nDate:%06i\r\nTime:%06i\r\nQuarterTime:%03i\r\nCurrent Peak Pwr :%7i\r\nLast Peak Pwr: %7i",
+                dg.CurrentDate, dg.CurrentTime, dg.QuarterTime,
+                dg.CurrentPeak, dg.LastPeak
+                ); cli_print(st, false, false, true);
+    sprintf(st, "\r\nMonth Peak Pwr: %7i (%010u)\r\nHeadroom: %7i\r\nAlert: %i\r\nIncomplete quarters: %u",
+                dg.MonthPeak, peak.month_peak_at, dg.PeakHeadroom, dg.PeakAlert, peak.incomplete
+                ); cli_print(st, false, false, true);
+    cli_dspPeak = false;
+  }
 
-}
+  if (cli_dspStats) {
+    sprintf(st, "\r\nDecode cycles: %u (%u bytes)\r\nHeap free: %u, max block: %u\r\nTelegram buffers: %u, values: %u",
+                dg.decode_cycles, tg.len, ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(),
+                (unsigned)sizeof(p1_buf), (unsigned)(sizeof(dg) + sizeof(dg_snap) + sizeof(mqtt_old))
+                ); cli_print(st, false, false, true);
+    sprintf(st, "\r\nTelegrams: %u, CRC errors: %u, overflows: %u, restarts: %u\r\nUART overruns: %u, errors: %u\r\nPeriod (s): last %u.%03u, min %u.%03u, max %u.%03u",
+                p1.frames, p1.crc_errors, p1.overflows, p1.restarts, rx_stats.overruns, rx_stats.errors,
+                p1.period / 1000000, (p1.period / 1000) % 1000,
+                rx_stats.period_min / 1000000, (rx_stats.period_min / 1000) % 1000,
+                rx_stats.period_max / 1000000, (rx_stats.period_max / 1000) % 1000
+                ); cli_print(st, false, false, true);
+#if LAT_STATS
+    cli_print("\r\nLatency (us)   count      p50        p99        max", false, false, true);
+    lat_print("frame", &lat_frame);
+    lat_print("decode", &lat_decode);
+    lat_print("relay", &lat_relay);
+    lat_print("mqtt", &lat_mqtt);
+#endif
+    cli_dspStats = false;
+  }
+
+  if (cli_dspOrigP1) {
+    cli_dump(false);
+    cli_dspOrigP1 = false;
+  }
 
+  if (cli_dspModP1) {
+    cli_dump(true);
+    cli_dspModP1 = false;
+  }
 
+  relay_send(&p1_relay, cfg.send_p1);
+  relay_send(&pm1_relay, cfg.send_pm1);
 
-void loop() {
-  int max_read = 10;
-  char ch;
+  if (cfg.send_serial) {
+    tg_write(Serial, true);
+  }
+}
 
-  // every seconds processing
-  currentmillis = millis();
-  if ((lastmillis + 1000 < currentmillis) || (currentmillis + 1000000 < lastmillis)) {
+// Tasks
 
-    // time management
-    uptime ++;
-    lastmillis += 1000;
+bool task_serial_ready() {
+  return (safecnt == 0) && Serial.available();
+}
 
-    if (safecnt > 0) safecnt --;
-
-    // network management
-    if (!wifi_connected) {
-      if (WiFi.status() == WL_CONNECTED) {
-        wifi_connected = true;
-        dbgdsp = "WiFi connected - IP ";
-        dbgdsp.append(WiFi.localIP().toString().c_str());
-        // start MQTT client
-        mqtt_client.setServer(MQTT_IP, 1883);
-        mqtt_client.setCallback(mqtt_callback);
-        // start telnet server
-        cli_server.begin();
-        // start P1 server
-        p1_server.begin();
-        // start P1 Mod server
-        pm1_server.begin();
-      }
-    }
-    else {
-      if (MQTT_ON != 0) {
-        if (!mqtt_connected){
-          if (mqtt_client.connect("ESP8266-P1", MQTT_USER, MQTT_PASS, MQTT_LWT, 1, true, "offline")) {
-            mqtt_connected = true;
-            dbgdsp = "MQTT connected";
-            mqtt_client.publish(MQTT_LWT, "online", true);
-            mqtt_client.subscribe(MQTT_TOPIC_SUB);
-          } else {
-            dbgdsp = "MQTT client connection failed";
-          }
-        } else if (! mqtt_client.connected()) {
-          mqtt_connected = false;
-          dbgdsp = "MQTT client disconnected";
+// Process Serial RX (Incoming P1 port), as long as bytes are waiting
+void task_serial() {
+  char chunk[64];
+  uint32_t t0 = micros();
+  if (Serial.hasOverrun()) {
+    rx_stats.overruns++;
+    dbg_msg("P1 UART RX overrun");
+  }
+  if (Serial.hasRxError()) rx_stats.errors++;
+  int avail;
+  while (((avail = Serial.available()) > 0) && (micros() - t0 < RX_BUDGET)) {
+    if (avail > (int)sizeof(chunk)) avail = sizeof(chunk);
+    int n = Serial.read(chunk, avail);
+    uint32_t t_last = micros() - Serial.available() * UART_BYTE_US;
+    int i = 0;
+    while (i < n) {
+      bool done;
+      uint32_t c0 = ESP.getCycleCount();
+      i += p1_rx_buf(&p1, chunk + i, n - i, t_last, UART_BYTE_US, &done);
+      p1_cycles += ESP.getCycleCount() - c0;
+      if (done) {
+        dg.decode_cycles = p1_cycles;
+        p1_cycles = 0;
+        if (p1.frames > 1) {
+          if ((rx_stats.period_min == 0) || (p1.period < rx_stats.period_min)) rx_stats.period_min = p1.period;
+          if (p1.period > rx_stats.period_max) rx_stats.period_max = p1.period;
+        }
+        LAT_ADD(lat_frame, p1.t_end - p1.t_start);
+        if (dg_receive(&dg, &p1)) {
+          LAT_ADD(lat_decode, micros() - p1.t_end);
+          dg_output();
         }
-      }
-
-      if (WiFi.status() != WL_CONNECTED) {
-        wifi_connected = false;
-        dbgdsp = "WiFi disconnected";
       }
     }
+  }
+}
+
+bool task_relay_ready() {
+  return true;
+}
+
+void task_relay() {
+  relay_send(&p1_relay, cfg.send_p1);
+  relay_send(&pm1_relay, cfg.send_pm1);
+}
+
+bool task_http_ready() {
+  return http_active(&http);
+}
 
-    // data management
-    bool updated = (memcmp(&cfg, &cfg_old, sizeof(cfg)) != 0);
-    if (updated) {
-      if (eeprom_to_save <= 0) data_save(); else eeprom_to_save--;
-    } else eeprom_to_save = 60;
+// HTTP API : the event is rendered once per telegram, for all clients
+void task_http() {
+  http_accept(&http);
+  if (http_active(&http) && (dg_snap.seq != http_dg_seq)) {
+    DG v;
+    FMT f;
+    http_dg_seq = dg_snapshot(&v);
+    http_event_begin(&http, &f);
+    http_dg_json(&v, &f);
+    http_event_end(&http, &f);
   }
+  http_poll(&http);
+}
+
+bool task_mqtt_ready() {
+  return mqtt_conn.up && ((dg_snap.seq != mqtt_seq) || (agg_min.seq != mqtt_min_seq) ||
+                            (agg_qtr.seq != mqtt_qtr_seq) || (hist_query.log != NULL));
+}
 
-  // every loop processing
+// Process MQTT
+void task_mqtt() {
   mqtt_client.loop();
+  process_mqtt();
+}
+
+bool task_intervals_ready() {
+  return dg_snap.seq != agg_seq;
+}
+
+// Add the last telegram to the minute and quarter-hour intervals, closed ones go to the
+// history log, written every quarter
+void task_intervals() {
+  DG v;
+  agg_seq = dg_snapshot(&v);
+  if (v.CurrentDate == 0) return;
+  AGG_SAMPLE s;
+  s.val[AGG_P] = (int32_t)v.P;
+  s.val[AGG_P_CONS] = v.P_consumed;
+  s.val[AGG_P_INJ] = v.P_injected;
+  s.val[AGG_U_L1] = v.U_L1;
+  s.val[AGG_U_L2] = v.U_L2;
+  s.val[AGG_U_L3] = v.U_L3;
+  s.val[AGG_I_L1] = v.I_L1;
+  s.val[AGG_I_L2] = v.I_L2;
+  s.val[AGG_I_L3] = v.I_L3;
+  s.val[AGG_P_L1] = (int32_t)v.P_act_L1;
+  s.val[AGG_P_L2] = (int32_t)v.P_act_L2;
+  s.val[AGG_P_L3] = (int32_t)v.P_act_L3;
+  s.E_consumed = v.E_consumed;
+  s.E_injected = v.E_injected;
+  uint32_t minute = agg_minute(v.CurrentDate, v.CurrentTime);
+  uint32_t qtr = agg_quarter(minute);
+  // a closed interval still not published is about to be replaced : queue it, else lost
+  if (cfg.mqtt_intervals) {
+    if (agg_closes(&agg_qtr, qtr) && !intervals_queue(&agg_qtr, &mqtt_qtr_seq, OUTBOX_QUARTER)) outbox.dropped++;
+    if (agg_closes(&agg_min, minute) && !intervals_queue(&agg_min, &mqtt_min_seq, OUTBOX_MINUTE)) outbox.dropped++;
+  }
+  bool quarter = agg_push(&agg_qtr, qtr, &s);
+  if (quarter) hist_add(&hist_qtr, &agg_qtr.last);
+  bool closed = agg_push(&agg_min, minute, &s);
+  if (closed) hist_add(&hist_min, &agg_min.last);
+  // broker down : queue the closed intervals for replay, also one closed before it went down
+  if (cfg.mqtt_intervals && !mqtt_conn.up) {
+    intervals_queue(&agg_min, &mqtt_min_seq, OUTBOX_MINUTE);
+    intervals_queue(&agg_qtr, &mqtt_qtr_seq, OUTBOX_QUARTER);
+  }
+  if (quarter || (hist_min.pending == hist_min.batch_size)) {
+    hist_write(&hist_min);
+    hist_write(&hist_qtr);
+  }
+}
+
+bool task_cli_ready() {
+  return (dbgdsp[0] != 0) || (netcli_connected && cli_client.available());
+}
+
+void task_cli() {
   process_cli(false, true);
+}
 
+bool task_cli_flush_ready() {
+  return (cli_out.len > 0) || (cli_out.dumps != 0);
+}
 
-  // once per loop processing
-  switch (loopidx++)
-  {
-  case 0:  // Process OTA
-    OTAhandle();
-    break;
-
-  case 1:  // Process telnet clients
-
-    // Management client
-    if (!netcli_connected) { cli_client = cli_server.available(); }
-    if (cli_client) {
-      if (cli_client.connected())
-        if (netcli_disconnect == true) {
-          netcli_connected = false;
-          netcli_disconnect = false;
-          dbgdsp = "Network client disconnected";
-          cli_client.stop();
-        } else
-        if (netcli_connected == false) {
-          netcli_connected = true;
-          netcli_disconnect = false;
-          dbgdsp = "Network client connected";
-          cli_client.write(0xFF);
-          cli_client.write(0xFC);
-          cli_client.write(0x22);
-        }
-      if (!cli_client.connected()) {
+void task_cli_flush() {
+  cli_flush();
+}
+
+// Process telnet clients
+void task_clients() {
+  // Management client
+  if (!netcli_connected) { cli_client = cli_server.available(); }
+  if (cli_client) {
+    if (cli_client.connected())
+      if (netcli_disconnect == true) {
         netcli_connected = false;
-        dbgdsp = "Network client lost";
+        netcli_disconnect = false;
+        dbg_msg("Network client disconnected");
+        cli_client.stop();
+      } else
+      if (netcli_connected == false) {
+        netcli_connected = true;
+        netcli_disconnect = false;
+        cli_out.len = 0;
+        cli_out.dumps = 0;
+        dbg_msg("Network client connected");
+        const char iac[] = { (char)0xFF, (char)0xFC, 0x22 };
+        cli_write(iac, sizeof(iac));
       }
-    } else if (netcli_connected) {
+    if (!cli_client.connected()) {
       netcli_connected = false;
-      dbgdsp = "Network client lost";
+      dbg_msg("Network client lost");
     }
+  } else if (netcli_connected) {
+    netcli_connected = false;
+    dbg_msg("Network client lost");
+  }
 
-    // P1 Client cnx
-    if (!p1_connected) p1_client = p1_server.available();
-    if (p1_client) {
-      if (!p1_connected && p1_client.connected()) {
-          p1_connected = true;
-          dbgdsp = "P1 client connected";
-      }
-      if (p1_connected && !p1_client.connected()) {
-        p1_connected = false;
-        dbgdsp = "P1 client disconnected";
-      }
-    } else if (p1_connected) {
-      p1_connected = false;
-      dbgdsp = "P1 client lost";
-    }
+  // P1 and P1 Mod clients cnx
+  relay_accept(&p1_relay);
+  relay_accept(&pm1_relay);
+}
 
-    // P1 Mod client cnx
-    if (!pm1_connected) pm1_client = pm1_server.available();
-    if (pm1_client) {
-      if (!pm1_connected && pm1_client.connected()) {
-          pm1_connected = true;
-          dbgdsp = "P1 Mod client connected";
-      }
-      if (pm1_connected && !pm1_client.connected()) {
-        pm1_connected = false;
-        dbgdsp = "P1 Mod client disconnected";
-      }
-    } else if (pm1_connected) {
-      pm1_connected = false;
-      dbgdsp = "P1 Mod client lost";
-    }
+// Process OTA
+void task_ota() {
+  OTAhandle();
+}
 
-    break;
-
-  case 2: // Process Serial RX (Incoming P1 port)
-    if (safecnt == 0) {
-      while ((max_read-- > 0) && Serial.available()) {
-          ch = Serial.read();
-          //cli_client.write(ch);  // debug
-          if (ch == '/') {
-            dg.idx=0;
-            dg.buf[dg.idx++]=ch;
-          } else
-          if ((dg.idx > 0) && (dg.idx < 2048)) {
-            dg.buf[dg.idx++]=ch;
-          }
-          if (dg.idx_crc > 0) {
-            dg.crc_received[4-dg.idx_crc]=ch;
-            dg.crc_received[4] = 0;
-            dg.idx_crc--;
-            if (dg.idx_crc == 0) {
-              dg.buf[dg.idx]=0;
-              dg.received = true;
-              dg.decoded = false;
-              dg.sent = false;
-              crc_compute(&dg);
-              dg.crc_valid = (strcmp(dg.crc_computed, dg.crc_received) == 0);
-              //dbgdsp = dg.crc_computed; dbgdsp += " "; dbgdsp += dg.crc_received; dbgdsp += " "; dbgdsp += dg.crc_valid;
-            }
-          }
-          if (ch == '!') {
-            dg.idx_crc = 4;
-          }
-      }
-    }
-    break;
-
-  case 3:  // process received datagram
-    if (dg.received && dg.crc_valid) {
-      dg.P_consumed = dg_obis_decode("1-0:1.7.0(", "*kW)");
-      dg.P_injected = dg_obis_decode("1-0:2.7.0(", "*kW)");
-      dg.P = dg.P_consumed - dg.P_injected;
-      dg.E_consumed_1 = dg_obis_decode("1-0:1.8.1(", "*kWh)");
-      dg.E_consumed_2 = dg_obis_decode("1-0:1.8.2(", "*kWh)");
-      dg.E_consumed =  dg.E_consumed_1 + dg.E_consumed_2;
-      dg.E_injected_1 = dg_obis_decode("1-0:2.8.1(", "*kWh)");
-      dg.E_injected_2 = dg_obis_decode("1-0:2.8.2(", "*kWh)");
-      dg.E_injected = dg.E_injected_1 + dg.E_injected_2;
-
-      dg.CurrentDate = dg_obis_getdate();
-      dg.CurrentTime = dg_obis_gettime();
-      dg.QuarterTime = dg.CurrentTime % 100 + 60 * (((dg.CurrentTime / 100) % 100) % 15);
-      dg.CurrentPeak = dg_obis_decode("1-0:1.4.0(", "*kW)");
-      if (dg.QuarterTime > 0) dg.CurrentPeak = dg.CurrentPeak * 900 / dg.QuarterTime;
-      if (dg.QuarterTime < dg_old.QuarterTime) dg.LastPeak = dg_old.CurrentPeak;
-
-      dg.U_L1 = dg_obis_decode("1-0:32.7.0(", "*V)");
-      dg.U_L2 = dg_obis_decode("1-0:52.7.0(", "*V)");
-      dg.U_L3 = dg_obis_decode("1-0:72.7.0(", "*V)");
-      dg.I_L1 = dg_obis_decode("1-0:31.7.0(", "*A)");
-      dg.I_L2 = dg_obis_decode("1-0:51.7.0(", "*A)");
-      dg.I_L3 = dg_obis_decode("1-0:71.7.0(", "*A)");
-      dg.P_act_L1 = dg_obis_decode("1-0:21.7.0(", "*kW)") - dg_obis_decode("1-0:22.7.0(", "*kW)");
-      dg.P_act_L2 = dg_obis_decode("1-0:41.7.0(", "*kW)") - dg_obis_decode("1-0:42.7.0(", "*kW)");
-      dg.P_act_L3 = dg_obis_decode("1-0:61.7.0(", "*kW)") - dg_obis_decode("1-0:62.7.0(", "*kW)");
-      dg.P_ap_L1 = dg.U_L1 * dg.I_L1;
-      dg.P_ap_L2 = dg.U_L2 * dg.I_L2;
-      dg.P_ap_L3 = dg.U_L3 * dg.I_L3;
-      dg.P_cos_L1 = (dg.P_act_L1 != 0 ? (100 * dg.P_ap_L1 / dg.P_act_L1) : 1);
-      dg.P_cos_L2 = (dg.P_act_L2 != 0 ? (100 * dg.P_ap_L2 / dg.P_act_L2) : 1);
-      dg.P_cos_L3 = (dg.P_act_L3 != 0 ? (100 * dg.P_ap_L3 / dg.P_act_L3) : 1);
-      
-    //  dg.I_Mod_L1 = dg.I_L1 + cfg.I_Shift*100;  if (dg.I_Mod_L1 > cfg.I_Max_meter*100) dg.I_Mod_L1 = cfg.I_Max_meter*100;
-    //  dg.I_Mod_L2 = dg.I_L2 + cfg.I_Shift*100;  if (dg.I_Mod_L2 > cfg.I_Max_meter*100) dg.I_Mod_L2 = cfg.I_Max_meter*100;
-    //  dg.I_Mod_L3 = dg.I_L3 + cfg.I_Shift*100;  if (dg.I_Mod_L3 > cfg.I_Max_meter*100) dg.I_Mod_L3 = cfg.I_Max_meter*100;
-      
-      //dg.P_Mod_act_L1 = dg.U_L1 * dg.I_L1 / 1000;
-      //dg.P_Mod_act_L2 = dg.U_L2 * dg.I_L2 / 1000;
-      //dg.P_Mod_act_L3 = dg.U_L3 * dg.I_L3 / 1000;
-
-      p1_copytoorig(&dg);
-      p1_copytomod(&dg);
-    //  dg_obis_update("1-0:31.7.0(", "*A)", dg.I_Mod_L1, 3, 2);
-    //  dg_obis_update("1-0:51.7.0(", "*A)", dg.I_Mod_L2, 3, 2);
-    //  dg_obis_update("1-0:71.7.0(", "*A)", dg.I_Mod_L3, 3, 2);
-      crc_add(dg.ModP1);
-
-      char st[200];
-      
-      if (cli_dspEnergy) {
-        sprintf(st, "\n\rE_Cons:%9i (%i + %i)\n\rE_Inj :%9i (%i + %i)",
-                    dg.E_consumed, dg.E_consumed_1, dg.E_consumed_2, dg.E_injected, dg.E_injected_1, dg.E_injected_2
-                    ); cli_client.write(st);
-        cli_dspEnergy = false;
-      }
+// Every second processing
+void task_second() {
+  // time management
+  while (millis() - lastmillis >= 1000) {
+    uptime ++;
+    lastmillis += 1000;
+  }
 
-      if (cli_dspPower) {
-        sprintf(st, "\n\rP_Cons:%7i\n\rP_Inj :%7i\n\rU     : %3i %3i %3i\n\rI      : %3i %3i %3i",
-                    dg.P_consumed, dg.P_injected,
-                    dg.U_L1, dg.U_L2, dg.U_L3, dg.I_L1, dg.I_L2, dg.I_L3
-                    ); cli_client.write(st);
-        cli_dspPower = false;
-      }
+  if (safecnt > 0) safecnt --;
 
-      if (cli_dspPeak) {
-        sprintf(st, "\r\nDate:%06i\r\nTime:%06i\r\nQuarterTime:%03i\r\nCurrent Peak Pwr :%7i\r\nLast Peak Pwr: %7i",
-                    dg.CurrentDate, dg.CurrentTime, dg.QuarterTime,
-                    dg.CurrentPeak, dg.LastPeak
-                    ); cli_client.write(st);
-        cli_dspPeak = false;
-      }
+  mqtt_rates();
+#if LAT_STATS
+  if (mqtt_conn.up && (uptime % LAT_PERIOD == 0)) lat_publish();
+#endif
+  if (mqtt_conn.up && (uptime % 60 == 0)) mqtt_publish_outbox();
 
-      if (cli_dspOrigP1) {
-        cli_client.write(dg.OrigP1);
-        cli_dspOrigP1 = false;
-      }
+  if (!peak.saved) peak_save();
+}
 
-      if (cli_dspModP1) {
-        cli_client.write(dg.ModP1);
-        cli_dspModP1 = false;
-      }
+// One MQTT connection attempt : DNS and TCP connect are bounded by MQTT_CONNECT_BUDGET,
+// PubSubClient then only does the handshake on the open socket
+void mqtt_connect() {
+  uint32_t t0 = micros();
+  IPAddress ip;
+  bool ok = ip.fromString(MQTT_IP) || (WiFi.hostByName(MQTT_IP, ip, MQTT_CONNECT_BUDGET) == 1);
+  if (ok) {
+    espClient.setTimeout(MQTT_CONNECT_BUDGET);
+    ok = espClient.connect(ip, 1883) &&
+         mqtt_client.connect("ESP8266-P1", MQTT_USER, MQTT_PASS, MQTT_LWT, 1, true, "offline");
+  }
+  if (!ok) espClient.stop();
+  conn_attempt(&mqtt_conn, ok, micros() - t0);
+  if (!ok) {
+    dbg_msg("MQTT client connection failed");
+    return;
+  }
+  dbg_msg("MQTT connected");
+  mqtt_publish(MQTT_LWT, "online", true);
+  mqtt_client.subscribe(MQTT_TOPIC_SUB);
+  mqtt_client.subscribe(MQTT_TOPIC "Backlog/#");
+}
 
-      if (p1_connected) {
-        if (p1_client.connected() && cfg.send_p1) p1_client.write(dg.OrigP1);
-      }
+// Network lifecycles : WiFi (the SDK reconnects it), servers, MQTT (backoff)
+void task_net() {
+  bool wifi = (WiFi.status() == WL_CONNECTED);
+  if (wifi && !wifi_conn.up) {
+    conn_up(&wifi_conn);
+    FMT f;
+    fmt_init(&f, dbgdsp, sizeof(dbgdsp));
+    fmt_str(&f, "WiFi connected - IP ");
+    fmt_ip(&f, WiFi.localIP());
+    if (!servers_started) {
+      cli_server.begin();
+      p1_relay.server.begin();
+      pm1_relay.server.begin();
+      http.server.begin();
+      servers_started = true;
+    }
+  }
+  if (!wifi && wifi_conn.up) {
+    conn_down(&wifi_conn);
+    dbg_msg("WiFi disconnected");
+  }
 
-      if (pm1_connected) {
-        if (pm1_client.connected() && cfg.send_pm1) pm1_client.write(dg.ModP1);
-      }
+  if (MQTT_ON == 0) return;
+  if (mqtt_conn.up && !mqtt_client.connected()) {
+    conn_down(&mqtt_conn);
+    dbg_msg("MQTT client disconnected");
+  }
+  if (wifi_conn.up && conn_due(&mqtt_conn)) mqtt_connect();
+}
 
-      if (cfg.send_serial) {
-        Serial.write(dg.ModP1);
-      }
+bool task_config_ready() {
+  return cfg_dirty && (millis() - cfg_changed_at >= CFG_SAVE_DELAY);
+}
 
-      dg.received = false;
-      dg.decoded = true;
-    }
-    break;
+// Save the configuration once changes have settled
+void task_config() {
+  data_save();
+}
 
-  case 4:  // Process MQTT
-    process_mqtt();
-    break;
- 
-  default: // Loop state machine
-    loopidx = 0;
-    break;
+TASK tasks[] = {
+  // name       run           ready              period  prio  budget (us)
+  { "serial",   task_serial,  task_serial_ready, 0,      0,    RX_BUDGET + 5000 },
+  { "relay",    task_relay,   task_relay_ready,  0,      1,    2000 },
+  { "mqtt",     task_mqtt,    task_mqtt_ready,   20,     2,    5000 },
+  { "cli",      task_cli,     task_cli_ready,    0,      3,    5000 },
+  { "cliflush", task_cli_flush, task_cli_flush_ready, 0,   3,    2000 },
+  { "http",     task_http,    task_http_ready,   100,    3,    3000 },
+  { "intervals", task_intervals, task_intervals_ready, 0,  4,    50000 },
+  { "clients",  task_clients, NULL,              100,    5,    2000 },
+  { "ota",      task_ota,     NULL,              100,    6,    2000 },
+  { "second",   task_second,  NULL,              1000,   7,    10000 },
+  { "net",      task_net,     NULL,              100,    7,    20000 },
+  { "config",   task_config,  task_config_ready, 0,      8,    50000 },   // sector erase ~40 ms
+};
+const int tasks_count = sizeof(tasks) / sizeof(tasks[0]);
+
+void sched_print() {
+  char st[80];
+  cli_print("Task       runs       overruns   max us", true, false, true);
+  for (int i = 0; i < tasks_count; i++) {
+    sprintf(st, "%-10s %-10u %-10u %u", tasks[i].name, tasks[i].runs, tasks[i].overruns, tasks[i].max_us);
+    cli_print(st, true, false, true);
   }
+}
+
+void setup() {
+  // Init serial port
+  Serial.setRxBufferSize(RX_RING_SIZE);
+  Serial.begin(115200);  
+
+  p1_begin(&p1, p1_buf[0], P1_BUF_SIZE);
+  tg.buf = p1_buf[1];
+
+  data_load();
+
+  LittleFS.begin();
+  hist_begin(&hist_min);
+  hist_begin(&hist_qtr);
+  peak_load();
+  outbox_begin(&outbox);
+  
+  // Set Digital I/O and Interrupt handlers
+  
+  // LED
+  pinMode(rx_led, OUTPUT);
+  digitalWrite(rx_led, HIGH);
+  //pinMode(tx_led, OUTPUT);
+  //digitalWrite(tx_led, HIGH);
+
+  // Start WiFi
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(WIFI_SSID, WIFI_PSK);
+  mqtt_client.setBufferSize(MQTT_BUFFER);
+  mqtt_client.setCallback(mqtt_callback);
+  mqtt_client.setSocketTimeout(MQTT_HANDSHAKE_TIMEOUT);
+
+  // Init OTA
+  OTAsetup();
+  OTAbegin();
 
-}
\ No newline at end of file
+  sched_begin(tasks, tasks_count);
+}
+
+
+
+void loop() {
+  sched_run(tasks, tasks_count);
+}
@@ -0,0 +1,215 @@
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+// Host build (pio test -e native) : the part of the Arduino / ESP8266 core the firmware
+// uses, driven by the tests. Time only moves when a test advances it, the P1 port reads
+// what a test fed, flash is a NOR flash emulation (erase to 0xFF, writes clear bits).
+// Once running nothing here allocates, the allocation counts of host.h only see the
+// firmware.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <array>
+#include <map>
+#include <string>
+#include <spi_flash.h>
+
+typedef uint8_t byte;
+
+// Flash data (PROGMEM) is plain memory
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#define memcpy_P memcpy
+#define strcmp_P strcmp
+
+#define D1 5
+#define D2 4
+#define D3 0
+#define OUTPUT 1
+#define HIGH 1
+#define LOW 0
+
+// Time
+uint64_t host_time_us = 0;
+
+uint32_t micros() { return (uint32_t)host_time_us; }
+uint32_t millis() { return (uint32_t)(host_time_us / 1000); }
+void host_advance(uint32_t ms) { host_time_us += (uint64_t)ms * 1000; }
+
+void pinMode(uint8_t pin, uint8_t mode) {}
+void digitalWrite(uint8_t pin, uint8_t val) {}
+void yield() {}
+
+// Deterministic, the tests replay the same runs
+uint32_t host_random = 1;
+
+long random(long max) {
+  host_random = host_random * 1103515245 + 12345;
+  return (max > 0) ? (host_random >> 8) % max : 0;
+}
+
+long random(long min, long max) {
+  return min + random(max - min);
+}
+
+// Only used at boot (file names, OTA messages)
+class String {
+public:
+  std::string s;
+  String() {}
+  String(const char *c) : s(c) {}
+  const char *c_str() const { return s.c_str(); }
+  unsigned int length() const { return s.size(); }
+  String &operator=(const char *c) { s = c; return *this; }
+  friend String operator+(const char *a, const String &b) { String r(a); r.s += b.s; return r; }
+};
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(const uint8_t *buf, size_t len) = 0;
+  size_t write(const char *buf, size_t len) { return write((const uint8_t *)buf, len); }
+  size_t print(const char *s) { return write(s, strlen(s)); }
+  size_t println(const char *s) { return print(s) + print("\r\n"); }
+  size_t println(const String &s) { return println(s.c_str()); }
+  size_t printf(const char *format, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    return write(buf, (n < (int)sizeof(buf)) ? n : sizeof(buf) - 1);
+  }
+};
+
+class Stream : public Print {
+};
+
+// P1 port : RX reads what host_serial_feed() queued, TX is kept in out
+#define HOST_SERIAL_IN 8192
+#define HOST_SERIAL_OUT 4096
+
+class HardwareSerial : public Stream {
+public:
+  char in[HOST_SERIAL_IN];
+  int in_len = 0;
+  int in_pos = 0;
+  char out[HOST_SERIAL_OUT];
+  int out_len = 0;
+  uint32_t out_bytes = 0;
+  bool overrun = false;
+  void begin(unsigned long baud) {}
+  size_t setRxBufferSize(size_t size) { return size; }
+  int available() { return in_len - in_pos; }
+  int read() { return (in_pos < in_len) ? (uint8_t)in[in_pos++] : -1; }
+  size_t read(char *buf, size_t len) {
+    if (len > (size_t)available()) len = available();
+    memcpy(buf, in + in_pos, len);
+    in_pos += len;
+    return len;
+  }
+  bool hasOverrun() {
+    bool o = overrun;
+    overrun = false;
+    return o;
+  }
+  bool hasRxError() { return false; }
+  size_t write(const uint8_t *buf, size_t len) override {
+    size_t n = (len < (size_t)(HOST_SERIAL_OUT - out_len)) ? len : HOST_SERIAL_OUT - out_len;
+    memcpy(out + out_len, buf, n);
+    out_len += n;
+    out_bytes += len;
+    return len;
+  }
+  using Print::write;
+};
+
+HardwareSerial Serial;
+
+// Queue bytes on the P1 port, what does not fit the RX buffer is an overrun
+void host_serial_feed(const char *buf, int len) {
+  if (Serial.in_pos > 0) {
+    memmove(Serial.in, Serial.in + Serial.in_pos, Serial.in_len - Serial.in_pos);
+    Serial.in_len -= Serial.in_pos;
+    Serial.in_pos = 0;
+  }
+  if (len > HOST_SERIAL_IN - Serial.in_len) {
+    len = HOST_SERIAL_IN - Serial.in_len;
+    Serial.overrun = true;
+  }
+  memcpy(Serial.in + Serial.in_len, buf, len);
+  Serial.in_len += len;
+}
+
+class IPAddress {
+public:
+  uint8_t a[4] = { 0, 0, 0, 0 };
+  uint8_t operator[](int i) const { return a[i]; }
+  bool fromString(const char *s) {
+    for (int i = 0; i < 4; i++) {
+      char *end;
+      long v = strtol(s, &end, 10);
+      if ((end == s) || (v < 0) || (v > 255) || (*end != ((i < 3) ? '.' : 0))) return false;
+      a[i] = v;
+      s = end + 1;
+    }
+    return true;
+  }
+};
+
+// Flash : sectors appear erased on first use
+std::map<uint32_t, std::array<uint8_t, SPI_FLASH_SEC_SIZE>> host_flash;
+uint32_t host_flash_writes = 0;
+uint32_t host_flash_erases = 0;
+int host_flash_fail = -1;   // flash writes left before one fails, -1 : never
+int host_erase_fail = -1;   // sector erases left before one fails, -1 : never
+
+uint8_t *host_flash_at(uint32_t addr) {
+  uint32_t sector = addr / SPI_FLASH_SEC_SIZE;
+  if (host_flash.find(sector) == host_flash.end()) host_flash[sector].fill(0xFF);
+  return host_flash[sector].data() + addr % SPI_FLASH_SEC_SIZE;
+}
+
+class EspClass {
+public:
+  uint32_t getCycleCount() { return micros() * 80; }
+  uint32_t getFreeHeap() { return 40000; }
+  uint32_t getMaxFreeBlockSize() { return 30000; }
+  bool flashEraseSector(uint32_t sector) {
+    if ((host_erase_fail >= 0) && (host_erase_fail-- == 0)) return false;
+    memset(host_flash_at(sector * SPI_FLASH_SEC_SIZE), 0xFF, SPI_FLASH_SEC_SIZE);
+    host_flash_erases++;
+    return true;
+  }
+  bool flashWrite(uint32_t addr, const uint32_t *data, size_t size) {
+    if ((addr % 4 != 0) || (size % 4 != 0)) return false;
+    if ((host_flash_fail >= 0) && (host_flash_fail-- == 0)) return false;
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < size; i++) *host_flash_at(addr + i) &= p[i];
+    host_flash_writes++;
+    return true;
+  }
+  bool flashRead(uint32_t addr, uint32_t *data, size_t size) {
+    if ((addr % 4 != 0) || (size % 4 != 0)) return false;
+    uint8_t *p = (uint8_t *)data;
+    for (size_t i = 0; i < size; i++) p[i] = *host_flash_at(addr + i);
+    return true;
+  }
+};
+
+EspClass ESP;
+
+// Start of the EEPROM sector in the linker script, sector aligned
+extern "C" {
+alignas(SPI_FLASH_SEC_SIZE) uint32_t _EEPROM_start;
+}
+
+// Layout of the 4 MB boards : the sector below the EEPROM one is outside the file system
+#define CFG_SPARE_ADDR (CFG_STORE_ADDR - SPI_FLASH_SEC_SIZE)
+
+#endif  /* _HOST_ARDUINO_H */
@@ -0,0 +1,30 @@
+#ifndef _HOST_ARDUINOOTA_H
+#define _HOST_ARDUINOOTA_H
+
+#include <Arduino.h>
+
+#define U_FLASH 0
+
+enum ota_error_t {
+  OTA_AUTH_ERROR,
+  OTA_BEGIN_ERROR,
+  OTA_CONNECT_ERROR,
+  OTA_RECEIVE_ERROR,
+  OTA_END_ERROR
+};
+
+// No update on the host, the handlers are only registered
+class ArduinoOTAClass {
+public:
+  void onStart(void (*fn)()) {}
+  void onEnd(void (*fn)()) {}
+  void onProgress(void (*fn)(unsigned int, unsigned int)) {}
+  void onError(void (*fn)(ota_error_t)) {}
+  int getCommand() { return U_FLASH; }
+  void begin() {}
+  void handle() {}
+};
+
+ArduinoOTAClass ArduinoOTA;
+
+#endif  /* _HOST_ARDUINOOTA_H */
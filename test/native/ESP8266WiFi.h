@@ -0,0 +1,160 @@
+#ifndef _HOST_ESP8266WIFI_H
+#define _HOST_ESP8266WIFI_H
+
+#include <Arduino.h>
+
+// Sockets : a fixed pool of connections, a test opens one to a server port with
+// host_connect(), writes what the client sends in in[] and reads what the device wrote
+// in out[]. room is what the TCP window takes, writes beyond it are refused as on the
+// device.
+
+#define WL_CONNECTED 3
+#define WL_DISCONNECTED 6
+#define WIFI_STA 1
+
+#define HOST_SOCKS 16
+#define HOST_SOCK_IN 1024
+#define HOST_SOCK_OUT 16384
+
+struct HOST_SOCK {
+  bool used = false;
+  bool open = false;        // cleared by either side
+  bool accepted = false;
+  uint16_t port = 0;
+  char in[HOST_SOCK_IN];
+  int in_len = 0;
+  int in_pos = 0;
+  char out[HOST_SOCK_OUT];
+  int out_len = 0;
+  int room = 2920;          // bytes the device may write before the peer reads
+  uint32_t writes = 0;
+};
+
+HOST_SOCK host_socks[HOST_SOCKS];
+
+// New connection to port, NULL : pool full
+HOST_SOCK *host_connect(uint16_t port) {
+  for (int i = 0; i < HOST_SOCKS; i++) {
+    HOST_SOCK *s = &host_socks[i];
+    if (s->used) continue;
+    *s = HOST_SOCK();
+    s->used = true;
+    s->open = true;
+    s->port = port;
+    return s;
+  }
+  return NULL;
+}
+
+void host_send(HOST_SOCK *s, const char *text) {
+  int n = strlen(text);
+  if (n > HOST_SOCK_IN - s->in_len) n = HOST_SOCK_IN - s->in_len;
+  memcpy(s->in + s->in_len, text, n);
+  s->in_len += n;
+}
+
+// Peer reads what the device wrote : the window opens again
+void host_drain(HOST_SOCK *s) {
+  s->room += s->out_len;
+  s->out_len = 0;
+}
+
+void host_release(HOST_SOCK *s) {
+  s->open = false;
+  s->used = false;
+}
+
+class WiFiClient : public Stream {
+public:
+  HOST_SOCK *s = NULL;
+  WiFiClient() {}
+  WiFiClient(HOST_SOCK *s) : s(s) {}
+  operator bool() { return s != NULL; }
+  uint8_t connected() { return (s != NULL) && s->open; }
+  int connect(IPAddress ip, uint16_t port);
+  int available() { return connected() ? s->in_len - s->in_pos : 0; }
+  int read() { return (available() > 0) ? (uint8_t)s->in[s->in_pos++] : -1; }
+  int read(uint8_t *buf, size_t len) {
+    if (len > (size_t)available()) len = available();
+    memcpy(buf, s->in + s->in_pos, len);
+    s->in_pos += len;
+    return len;
+  }
+  int availableForWrite() {
+    if (!connected()) return 0;
+    int free = HOST_SOCK_OUT - s->out_len;
+    return (s->room < free) ? s->room : free;
+  }
+  size_t write(const uint8_t *buf, size_t len) override {
+    if ((int)len > availableForWrite()) len = availableForWrite();
+    if (len == 0) return 0;
+    memcpy(s->out + s->out_len, buf, len);
+    s->out_len += len;
+    s->room -= len;
+    s->writes++;
+    return len;
+  }
+  using Print::write;
+  void stop() {
+    if (s != NULL) s->open = false;
+  }
+  void setNoDelay(bool on) {}
+  void setTimeout(unsigned long ms) {}
+  IPAddress remoteIP() {
+    IPAddress ip;
+    ip.fromString("192.168.1.10");
+    return ip;
+  }
+};
+
+class WiFiServer {
+public:
+  uint16_t port;
+  bool listening = false;
+  WiFiServer(uint16_t port) : port(port) {}
+  void begin() { listening = true; }
+  // next connection to the port not accepted yet
+  WiFiClient available() {
+    for (int i = 0; listening && (i < HOST_SOCKS); i++) {
+      HOST_SOCK *s = &host_socks[i];
+      if (s->used && s->open && !s->accepted && (s->port == port)) {
+        s->accepted = true;
+        return WiFiClient(s);
+      }
+    }
+    return WiFiClient();
+  }
+};
+
+// Broker side of the MQTT connection
+HOST_SOCK *host_broker = NULL;
+bool host_broker_up = true;     // accepts TCP connections
+
+int WiFiClient::connect(IPAddress ip, uint16_t port) {
+  if (!host_broker_up) return 0;
+  if (host_broker != NULL) host_release(host_broker);
+  host_broker = host_connect(port);
+  host_broker->accepted = true;
+  s = host_broker;
+  return 1;
+}
+
+class WiFiClass {
+public:
+  int state = WL_CONNECTED;
+  int status() { return state; }
+  void mode(int m) {}
+  void begin(const char *ssid, const char *psk) {}
+  IPAddress localIP() {
+    IPAddress ip;
+    ip.fromString("192.168.1.2");
+    return ip;
+  }
+  int hostByName(const char *name, IPAddress &ip, uint32_t timeout) {
+    return ip.fromString("192.168.1.1") ? 1 : 0;
+  }
+};
+
+WiFiClass WiFi;
+
+#endif  /* _HOST_ESP8266WIFI_H */
@@ -0,0 +1,4 @@
+#ifndef _HOST_ESP8266MDNS_H
+#define _HOST_ESP8266MDNS_H
+
+#endif  /* _HOST_ESP8266MDNS_H */
@@ -0,0 +1,104 @@
+#ifndef _HOST_LITTLEFS_H
+#define _HOST_LITTLEFS_H
+
+#include <Arduino.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// File system in RAM, files by full path. Opening a file allocates (as on the device),
+// the tests only count allocations of the telegram path which opens none.
+
+enum SeekMode {
+  SeekSet = 0,
+  SeekCur = 1,
+  SeekEnd = 2
+};
+
+std::map<std::string, std::string> host_files;
+bool host_fs_full = false;    // writes fail
+int host_fs_room = -1;        // bytes writes store before the file system is full, -1 : no limit
+bool host_fs_trunc_fail = false;
+
+class File {
+public:
+  std::string *data = NULL;
+  size_t pos = 0;
+  bool append = false;
+  operator bool() const { return data != NULL; }
+  size_t size() const { return data->size(); }
+  size_t position() const { return pos; }
+  bool seek(uint32_t p, SeekMode mode = SeekSet) {
+    size_t base = (mode == SeekSet) ? 0 : (mode == SeekCur) ? pos : data->size();
+    if (base + p > data->size()) return false;
+    pos = base + p;
+    return true;
+  }
+  size_t read(uint8_t *buf, size_t len) {
+    if (len > data->size() - pos) len = data->size() - pos;
+    memcpy(buf, data->data() + pos, len);
+    pos += len;
+    return len;
+  }
+  size_t write(const uint8_t *buf, size_t len) {
+    if (host_fs_full) return 0;
+    if ((host_fs_room >= 0) && (len > (size_t)host_fs_room)) len = host_fs_room;
+    if (host_fs_room >= 0) host_fs_room -= len;
+    if (append) pos = data->size();
+    if (pos + len > data->size()) data->resize(pos + len);
+    memcpy(&(*data)[pos], buf, len);
+    pos += len;
+    return len;
+  }
+  bool truncate(uint32_t size) {
+    if (host_fs_trunc_fail) return false;
+    data->resize(size);
+    if (pos > size) pos = size;
+    return true;
+  }
+  void close() { data = NULL; }
+};
+
+// Files of one directory, listed when opened
+class Dir {
+public:
+  std::vector<std::string> names;
+  std::vector<size_t> sizes;
+  int i = -1;
+  bool next() { return ++i < (int)names.size(); }
+  String fileName() { return String(names[i].c_str()); }
+  size_t fileSize() { return sizes[i]; }
+};
+
+class FS {
+public:
+  bool begin() { return true; }
+  bool mkdir(const char *path) { return true; }
+  bool exists(const char *path) { return host_files.count(path) > 0; }
+  bool remove(const char *path) { return host_files.erase(path) > 0; }
+  // "r", "r+" : existing file, "w" : truncated, "a" : writes at the end
+  File open(const char *path, const char *mode) {
+    File f;
+    bool create = (mode[0] == 'w') || (mode[0] == 'a');
+    if (!create && !exists(path)) return f;
+    if (create && host_fs_full && !exists(path)) return f;
+    f.data = &host_files[path];
+    if (mode[0] == 'w') f.data->clear();
+    f.append = (mode[0] == 'a');
+    return f;
+  }
+  Dir openDir(const char *path) {
+    Dir d;
+    std::string prefix = std::string(path) + "/";
+    for (auto &e : host_files) {
+      if ((e.first.compare(0, prefix.size(), prefix) != 0) || (e.first.find('/', prefix.size()) != std::string::npos)) continue;
+      d.names.push_back(e.first.substr(prefix.size()));
+      d.sizes.push_back(e.second.size());
+    }
+    return d;
+  }
+};
+
+FS LittleFS;
+
+#endif  /* _HOST_LITTLEFS_H */
@@ -0,0 +1,116 @@
+#ifndef _HOST_PUBSUBCLIENT_H
+#define _HOST_PUBSUBCLIENT_H
+
+#include <Arduino.h>
+#include <ESP8266WiFi.h>
+
+// MQTT client over the broker socket of ESP8266WiFi.h : publishes are logged, the ones on
+// a subscribed topic come back through the callback on the next loop() as a broker
+// echoes them. A publish larger than the buffer fails as with the library.
+
+#define MQTT_MAX_HEADER_SIZE 5
+#define HOST_MQTT_LOG 64
+#define HOST_MQTT_ECHO 16
+#define HOST_MQTT_SUBS 8
+
+struct HOST_MSG {
+  char topic[64];
+  uint8_t payload[1024];
+  unsigned int len;
+  bool retain;
+};
+
+HOST_MSG host_mqtt_log[HOST_MQTT_LOG];  // last publishes, host_mqtt_n % HOST_MQTT_LOG is the next
+uint32_t host_mqtt_n = 0;
+HOST_MSG host_mqtt_echo[HOST_MQTT_ECHO];
+int host_mqtt_echo_n = 0;
+bool host_broker_accept = true;   // answers CONNACK
+bool host_broker_echo = true;     // delivers to the subscriptions
+
+// Last message published on topic, NULL : none in the log
+const HOST_MSG *host_mqtt_last(const char *topic) {
+  for (uint32_t i = 0; (i < host_mqtt_n) && (i < HOST_MQTT_LOG); i++) {
+    const HOST_MSG *m = &host_mqtt_log[(host_mqtt_n - 1 - i) % HOST_MQTT_LOG];
+    if (strcmp(m->topic, topic) == 0) return m;
+  }
+  return NULL;
+}
+
+// Publishes on topic among the last HOST_MQTT_LOG
+int host_mqtt_count(const char *topic) {
+  int n = 0;
+  for (uint32_t i = 0; (i < host_mqtt_n) && (i < HOST_MQTT_LOG); i++) {
+    if (strcmp(host_mqtt_log[i].topic, topic) == 0) n++;
+  }
+  return n;
+}
+
+class PubSubClient {
+public:
+  WiFiClient *client;
+  void (*callback)(char *, uint8_t *, unsigned int) = NULL;
+  uint16_t buffer_size = 256;
+  bool up = false;
+  char subs[HOST_MQTT_SUBS][64];
+  int subs_n = 0;
+  uint8_t buf[1025];    // payload handed to the callback, one byte spare as in the library
+
+  PubSubClient(WiFiClient &c) : client(&c) {}
+  bool setBufferSize(uint16_t size) {
+    buffer_size = size;
+    return true;
+  }
+  void setCallback(void (*cb)(char *, uint8_t *, unsigned int)) { callback = cb; }
+  void setSocketTimeout(uint16_t s) {}
+  bool connect(const char *id, const char *user, const char *pass, const char *will_topic,
+               uint8_t will_qos, bool will_retain, const char *will_message) {
+    subs_n = 0;
+    host_mqtt_echo_n = 0;
+    up = client->connected() && host_broker_accept;
+    return up;
+  }
+  bool connected() {
+    if (up && !client->connected()) up = false;
+    return up;
+  }
+  bool subscribe(const char *topic) {
+    if (!connected() || (subs_n == HOST_MQTT_SUBS)) return false;
+    snprintf(subs[subs_n++], sizeof(subs[0]), "%s", topic);
+    return true;
+  }
+  bool subscribed(const char *topic) {
+    for (int i = 0; i < subs_n; i++) {
+      int n = strlen(subs[i]);
+      if ((subs[i][n-1] == '#') && (strncmp(topic, subs[i], n - 1) == 0)) return true;
+      if (strcmp(topic, subs[i]) == 0) return true;
+    }
+    return false;
+  }
+  bool publish(const char *topic, const uint8_t *payload, unsigned int len, bool retain) {
+    if (!connected() || (buffer_size < MQTT_MAX_HEADER_SIZE + 2 + strlen(topic) + len)) return false;
+    HOST_MSG *m = &host_mqtt_log[host_mqtt_n++ % HOST_MQTT_LOG];
+    snprintf(m->topic, sizeof(m->topic), "%s", topic);
+    m->len = (len < sizeof(m->payload)) ? len : sizeof(m->payload);
+    memcpy(m->payload, payload, m->len);
+    m->retain = retain;
+    if (host_broker_echo && subscribed(topic) && (host_mqtt_echo_n < HOST_MQTT_ECHO)) {
+      host_mqtt_echo[host_mqtt_echo_n++] = *m;
+    }
+    return true;
+  }
+  bool publish(const char *topic, const char *payload, bool retain) {
+    return publish(topic, (const uint8_t *)payload, strlen(payload), retain);
+  }
+  bool loop() {
+    if (!connected()) return false;
+    for (int i = 0; i < host_mqtt_echo_n; i++) {
+      HOST_MSG *m = &host_mqtt_echo[i];
+      memcpy(buf, m->payload, m->len);
+      if (callback != NULL) callback(m->topic, buf, m->len);
+    }
+    host_mqtt_echo_n = 0;
+    return true;
+  }
+};
+
+#endif  /* _HOST_PUBSUBCLIENT_H */
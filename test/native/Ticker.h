@@ -0,0 +1,7 @@
+#ifndef _HOST_TICKER_H
+#define _HOST_TICKER_H
+
+class Ticker {
+};
+
+#endif  /* _HOST_TICKER_H */
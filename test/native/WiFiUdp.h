@@ -0,0 +1,4 @@
+#ifndef _HOST_WIFIUDP_H
+#define _HOST_WIFIUDP_H
+
+#endif  /* _HOST_WIFIUDP_H */
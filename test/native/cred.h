@@ -0,0 +1,15 @@
+#ifndef _CRED_H
+#define _CRED_H
+
+// Host build : no network, the broker is the one of ESP8266WiFi.h
+
+// Wifi credential
+#define WIFI_SSID "host"
+#define WIFI_PSK "host"
+
+// MQTT Credential
+#define MQTT_IP "192.168.1.1"
+#define MQTT_USER "host"
+#define MQTT_PASS "host"
+
+#endif  /* _CRED_H */
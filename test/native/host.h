@@ -0,0 +1,155 @@
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <new>
+
+// Host test helpers : heap allocation counts, stage timing, telegram files. Included
+// first by a test, it replaces the allocator of the whole program.
+
+// Allocations since start. With glibc malloc itself is counted (C and C++), elsewhere only
+// operator new.
+uint32_t host_allocs = 0;
+uint64_t host_alloc_bytes = 0;
+
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void __libc_free(void *p);
+
+void *malloc(size_t size) noexcept {
+  host_allocs++;
+  host_alloc_bytes += size;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) noexcept {
+  host_allocs++;
+  host_alloc_bytes += n * size;
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  host_allocs++;
+  host_alloc_bytes += size;
+  return __libc_realloc(p, size);
+}
+
+void free(void *p) noexcept {
+  __libc_free(p);
+}
+}
+#else
+void *operator new(size_t size) {
+  host_allocs++;
+  host_alloc_bytes += size;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) throw std::bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t size) noexcept { free(p); }
+void operator delete[](void *p, size_t size) noexcept { free(p); }
+#endif
+
+uint64_t host_ns() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+// Time and heap allocations of a pipeline stage, over its runs
+struct HOST_STAGE {
+  const char *name;
+  uint32_t runs = 0;
+  uint64_t ns = 0;
+  uint32_t allocs = 0;
+  uint64_t bytes = 0;
+  uint64_t t0 = 0;
+  uint32_t allocs0 = 0;
+  uint64_t bytes0 = 0;
+  HOST_STAGE(const char *name) : name(name) {}
+};
+
+void host_stage_begin(HOST_STAGE *s) {
+  s->allocs0 = host_allocs;
+  s->bytes0 = host_alloc_bytes;
+  s->t0 = host_ns();
+}
+
+void host_stage_end(HOST_STAGE *s) {
+  s->ns += host_ns() - s->t0;
+  s->allocs += host_allocs - s->allocs0;
+  s->bytes += host_alloc_bytes - s->bytes0;
+  s->runs++;
+}
+
+void host_stage_print(const HOST_STAGE *s) {
+  double runs = s->runs ? s->runs : 1;
+  printf("%-16s %10.0f ns %8.2f allocs %10.1f bytes\n", s->name, s->ns / runs, s->allocs / runs, s->bytes / runs);
+}
+
+// Project file (Sample_P1_datagram.txt...) : pio test runs in the project directory,
+// else the path is taken from the one of this file. Returns its length, 0 : not found.
+int host_load(const char *name, char *buf, int size) {
+  FILE *f = fopen(name, "rb");
+  const char *end = strstr(__FILE__, "test/native/host.h");
+  if ((f == NULL) && (end != NULL)) {
+    char path[512];
+    snprintf(path, sizeof(path), "%.*s%s", (int)(end - __FILE__), __FILE__, name);
+    f = fopen(path, "rb");
+  }
+  if (f == NULL) return 0;
+  int n = fread(buf, 1, size - 1, f);
+  fclose(f);
+  buf[n] = 0;
+  return n;
+}
+
+// CRC-16/ARC one bit at a time, the loop of the first releases (crc_compute), reference of
+// crc16.h. It xored chars, unsigned on the ESP8266 : the same as bytes.
+uint16_t host_crc16(const char *buf, size_t len) {
+  unsigned int crc = 0;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= (uint8_t)buf[i];
+    for (int bit = 0; bit < 8; bit++) {
+      if ((crc & 1) != 0) crc = (crc >> 1) ^ 0xA001;
+      else crc >>= 1;
+    }
+  }
+  return crc;
+}
+
+// Sign a telegram with the reference CRC : 4 hex digits and CRLF after its '!', returns
+// its new length, 0 : no '!'
+int host_sign(char *buf, int size) {
+  char *bang = (char *)memchr(buf, '!', strlen(buf));
+  if ((bang == NULL) || (bang + 7 > buf + size)) return 0;
+  snprintf(bang + 1, 7, "%04X\r\n", host_crc16(buf, bang + 1 - buf));
+  return bang + 7 - buf;
+}
+
+// Sample_P1_datagram.txt signed (its CRC is masked), returns its length, 0 : not found
+int host_sample(char *buf, int size) {
+  if (host_load("Sample_P1_datagram.txt", buf, size) == 0) return 0;
+  return host_sign(buf, size);
+}
+
+// Overwrite the first occurrence of text old by text (same length), false : not found
+bool host_set(char *buf, const char *old, const char *text) {
+  char *p = strstr(buf, old);
+  if ((p == NULL) || (strlen(text) != strlen(old))) return false;
+  memcpy(p, text, strlen(text));
+  return true;
+}
+
+#endif  /* _HOST_H */
@@ -0,0 +1,6 @@
+#ifndef _HOST_SPI_FLASH_H
+#define _HOST_SPI_FLASH_H
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+#endif  /* _HOST_SPI_FLASH_H */
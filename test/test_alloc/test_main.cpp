@@ -0,0 +1,98 @@
+// Heap allocations of the running device : the scheduler loop as on the ESP8266, one
+// telegram a second, MQTT up with State and interval payloads, a P1 and a P1 Mod relay
+// client, an /api/stream client and an /api/now request per telegram. Once warmed up,
+// whole telegram cycles including minute closes must not allocate.
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define WARMUP 70       // s, up to the first minute close and the first stats publish
+#define CYCLES 120      // s, two minute closes, no quarter (history write)
+#define LOOP_MS 5       // ms between loop() runs
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+HOST_SOCK *relay_p1 = NULL;
+HOST_SOCK *relay_pm1 = NULL;
+HOST_SOCK *stream = NULL;
+
+void setUp() {}
+void tearDown() {}
+
+// Telegram of second s after 14:50:00, injected power and L1 current vary
+int make(char *buf, int s) {
+  char text[24];
+  memcpy(buf, sample, sample_len + 1);
+  snprintf(text, sizeof(text), "(23080614%02u%02uS)", 50 + s / 60, s % 60);
+  host_set(buf, "(230806145209S)", text);
+  snprintf(text, sizeof(text), "2.7.0(01.%03u*kW)", s % 1000);
+  host_set(buf, "2.7.0(01.201*kW)", text);
+  snprintf(text, sizeof(text), "31.7.0(%03u.%02u*A)", 1 + s % 3, s % 100);
+  host_set(buf, "31.7.0(001.84*A)", text);
+  return host_sign(buf, P1_BUF_SIZE);
+}
+
+// One second of the device : a telegram arrives, loop() runs, the clients read
+void second(int s) {
+  static char t[P1_BUF_SIZE];
+  int len = make(t, s);
+  host_serial_feed(t, len);
+  HOST_SOCK *now = host_connect(80);
+  host_send(now, "GET /api/now HTTP/1.1\r\nHost: p1\r\n\r\n");
+  for (int ms = 0; ms < 1000; ms += LOOP_MS) {
+    host_advance(LOOP_MS);
+    loop();
+    host_drain(relay_p1);
+    host_drain(relay_pm1);
+    host_drain(stream);
+    host_drain(now);
+  }
+  host_release(now);
+  Serial.out_len = 0;
+}
+
+void test_steady_state() {
+  uint32_t frames = p1.frames;
+  uint32_t minutes = agg_min.seq;
+  uint32_t states = host_mqtt_n;
+  uint32_t allocs = host_allocs;
+  uint64_t bytes = host_alloc_bytes;
+  uint64_t t0 = host_ns();
+  for (int s = WARMUP; s < WARMUP + CYCLES; s++) second(s);
+  uint64_t ns = host_ns() - t0;
+  allocs = host_allocs - allocs;   // before printf, its stdout buffer is allocated once
+  bytes = host_alloc_bytes - bytes;
+  printf("\n%u telegrams : %u allocations, %llu bytes, %.0f us per second of device time\n", CYCLES,
+         allocs, (unsigned long long)bytes, ns / 1e3 / CYCLES);
+  // the cycle did run
+  TEST_ASSERT_EQUAL_UINT32(frames + CYCLES, p1.frames);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.crc_errors);
+  TEST_ASSERT_EQUAL_UINT32(minutes + 2, agg_min.seq);
+  TEST_ASSERT_GREATER_OR_EQUAL_UINT32(states + CYCLES, host_mqtt_n);
+  TEST_ASSERT_NOT_NULL(host_mqtt_last(MQTT_TOPIC "Minute"));
+  TEST_ASSERT_EQUAL_UINT32(145000 + (WARMUP + CYCLES - 1) / 60 * 100 + (WARMUP + CYCLES - 1) % 60, dg.CurrentTime);
+  TEST_ASSERT_EQUAL_UINT32(1 + WARMUP + CYCLES, http.requests);   // the stream and every /api/now
+  TEST_ASSERT_EQUAL_UINT32(0, http.dropped);
+  TEST_ASSERT_EQUAL_UINT32(0, allocs);
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  setup();
+  cfg.mqtt_state = MQTT_STATE_JSON;
+  cfg.mqtt_intervals = true;
+  cfg.I_Shift = 2;
+  while (safecnt > 0) {   // WiFi, servers and MQTT up, OTA window at boot over
+    host_advance(LOOP_MS);
+    loop();
+  }
+  relay_p1 = host_connect(p1_relay.server.port);
+  relay_pm1 = host_connect(pm1_relay.server.port);
+  stream = host_connect(80);
+  host_send(stream, "GET /api/stream HTTP/1.1\r\nHost: p1\r\n\r\n");
+  for (int s = 0; s < WARMUP; s++) second(s);
+  UNITY_BEGIN();
+  RUN_TEST(test_steady_state);
+  return UNITY_END();
+}
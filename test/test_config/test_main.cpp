@@ -0,0 +1,274 @@
+// Configuration store (cfgstore.h) and its load in main.cpp over the NOR flash emulation :
+// slot wrap and the switch between the two sectors, power lost during a switch, torn and
+// bad CRC records, the EEPROM image of the first releases (CFG_V0) and out of range fields
+// of older records clamped at load.
+
+#include <host.h>
+#include <unity.h>
+#include <stddef.h>
+#include "../../src/main.cpp"
+
+void setUp() {
+  ESP.flashEraseSector(CFG_STORE_ADDR / SPI_FLASH_SEC_SIZE);
+  ESP.flashEraseSector(CFG_SPARE_ADDR / SPI_FLASH_SEC_SIZE);
+  host_erase_fail = -1;
+  cfg_store = CFG_STORE();
+  cfg = CFG();
+}
+
+void tearDown() {}
+
+// Slot of the store as bytes in the flash, sector 0 (EEPROM) or 1 (spare)
+uint8_t *slot_at(int slot, int sector = 0) {
+  return host_flash_at((sector ? CFG_SPARE_ADDR : CFG_STORE_ADDR) + slot * CFG_SLOT);
+}
+
+bool sector_blank(int sector) {
+  return cfg_store_blank(sector ? CFG_SPARE_ADDR : CFG_STORE_ADDR);
+}
+
+// Save i : fields that tell the saves apart
+void save(int i) {
+  cfg.I_Shift = i % 33;
+  cfg.P_Scale = i % 1000;
+  cfg.send_pm1 = (i % 2 == 0);
+  data_save();
+}
+
+// Record of an older firmware : data as given, any version
+void save_raw(const void *data, size_t len, uint16_t version) {
+  CFG_STORE s;
+  uint16_t v;
+  CFG c;
+  cfg_store_load(&s, CFG_STORE_ADDR, CFG_SPARE_ADDR, &c, sizeof(c), &v);
+  TEST_ASSERT_TRUE(cfg_store_save(&s, data, len, version));
+}
+
+void check_saved(int i) {
+  TEST_ASSERT_EQUAL_UINT32(i % 33, cfg.I_Shift);
+  TEST_ASSERT_EQUAL_UINT32(i % 1000, cfg.P_Scale);
+  TEST_ASSERT_EQUAL(i % 2 == 0, cfg.send_pm1);
+}
+
+void test_empty() {
+  data_load();
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.used);
+  TEST_ASSERT_EQUAL_INT(-1, cfg_store.slot);
+  TEST_ASSERT_EQUAL_UINT32(32, cfg.I_Max_meter);
+  TEST_ASSERT_EQUAL_UINT32(0, cfg.I_Shift);
+  TEST_ASSERT_EQUAL_UINT32(0, cfg_store.saves);
+}
+
+// Saves go round one sector then the other, the full one is erased after the first record
+// of the next
+void test_wrap() {
+  data_load();
+  uint32_t erases = host_flash_erases;
+  for (int i = 1; i <= 2 * CFG_SLOTS + 5; i++) {
+    save(i);
+    int sector = ((i - 1) / CFG_SLOTS) % 2;
+    TEST_ASSERT_EQUAL_INT(sector, cfg_store.cur);
+    TEST_ASSERT_EQUAL_INT((i - 1) % CFG_SLOTS, cfg_store.slot);
+    TEST_ASSERT_EQUAL_UINT32(i, cfg_store.seq);
+    TEST_ASSERT_TRUE(sector_blank(1 - sector));
+    if (i % CFG_SLOTS == 0) {   // sector full : the last slot loads
+      data_load();
+      TEST_ASSERT_EQUAL_INT(sector, cfg_store.cur);
+      TEST_ASSERT_EQUAL_INT(CFG_SLOTS, cfg_store.used);
+      TEST_ASSERT_EQUAL_INT(CFG_SLOTS - 1, cfg_store.slot);
+      check_saved(i);
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(erases + 2, host_flash_erases);
+  TEST_ASSERT_EQUAL_UINT32(0, cfg_store.errors);
+  cfg = CFG();
+  data_load();
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.cur);
+  TEST_ASSERT_EQUAL_INT(5, cfg_store.used);
+  TEST_ASSERT_EQUAL_INT(4, cfg_store.slot);
+  TEST_ASSERT_EQUAL_UINT32(2 * CFG_SLOTS + 5, cfg_store.seq);
+  check_saved(2 * CFG_SLOTS + 5);
+  TEST_ASSERT_FALSE(cfg_dirty);
+}
+
+// Power lost while the first record of the spare was written : the full sector still loads,
+// the spare is erased before it is used
+void test_switch_torn() {
+  data_load();
+  for (int i = 1; i <= CFG_SLOTS; i++) save(i);
+  CFG_REC r;
+  memcpy(&r, slot_at(CFG_SLOTS - 1), sizeof(r));
+  r.h.seq = CFG_SLOTS + 1;
+  ESP.flashWrite(CFG_SPARE_ADDR, (const uint32_t *)&r, sizeof(CFG_HEAD));   // header only
+  cfg = CFG();
+  data_load();
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.cur);
+  TEST_ASSERT_EQUAL_INT(CFG_SLOTS - 1, cfg_store.slot);
+  check_saved(CFG_SLOTS);
+
+  uint32_t erases = host_flash_erases;
+  save(CFG_SLOTS + 1);
+  TEST_ASSERT_EQUAL_UINT32(erases + 2, host_flash_erases);   // the spare, then the full one
+  TEST_ASSERT_TRUE(sector_blank(0));
+  cfg = CFG();
+  data_load();
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.cur);
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.slot);
+  TEST_ASSERT_EQUAL_UINT32(CFG_SLOTS + 1, cfg_store.seq);
+  check_saved(CFG_SLOTS + 1);
+}
+
+// Power lost (or the erase failed) after the first record of the spare, the full sector
+// still there : the highest seq loads, the full sector is erased before its next use
+void test_switch_not_erased() {
+  data_load();
+  for (int i = 1; i <= CFG_SLOTS; i++) save(i);
+  host_erase_fail = 0;
+  save(CFG_SLOTS + 1);
+  TEST_ASSERT_EQUAL_UINT32(1, cfg_store.errors);
+  TEST_ASSERT_FALSE(cfg_dirty);
+  TEST_ASSERT_FALSE(sector_blank(0));
+  cfg = CFG();
+  data_load();
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.cur);
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.used);
+  TEST_ASSERT_EQUAL_UINT32(CFG_SLOTS + 1, cfg_store.seq);
+  check_saved(CFG_SLOTS + 1);
+
+  for (int i = CFG_SLOTS + 2; i <= 2 * CFG_SLOTS; i++) save(i);
+  uint32_t erases = host_flash_erases;
+  save(2 * CFG_SLOTS + 1);
+  TEST_ASSERT_EQUAL_UINT32(erases + 2, host_flash_erases);
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.cur);
+  TEST_ASSERT_EQUAL_INT(0, cfg_store.slot);
+  TEST_ASSERT_TRUE(sector_blank(1));
+  cfg = CFG();
+  data_load();
+  check_saved(2 * CFG_SLOTS + 1);
+}
+
+// Newest record with a bad CRC, then one cut short by a power loss : the previous loads,
+// the next save goes after them
+void test_bad_records() {
+  data_load();
+  for (int i = 1; i <= 10; i++) save(i);
+  slot_at(9)[sizeof(CFG_HEAD) + offsetof(CFG, P_Scale)] &= ~0x08;   // a bit lost in the newest, 10 % to 2 %
+  data_load();
+  TEST_ASSERT_EQUAL_INT(10, cfg_store.used);
+  TEST_ASSERT_EQUAL_INT(8, cfg_store.slot);
+  check_saved(9);
+
+  // header programmed, the data never written
+  CFG_REC r;
+  memcpy(&r, slot_at(8), sizeof(r));
+  r.h.seq = 11;
+  ESP.flashWrite(CFG_STORE_ADDR + 10 * CFG_SLOT, (const uint32_t *)&r, sizeof(CFG_HEAD));
+  data_load();
+  TEST_ASSERT_EQUAL_INT(11, cfg_store.used);
+  TEST_ASSERT_EQUAL_INT(8, cfg_store.slot);
+  check_saved(9);
+
+  save(12);
+  TEST_ASSERT_EQUAL_INT(11, cfg_store.slot);
+  data_load();
+  TEST_ASSERT_EQUAL_INT(11, cfg_store.slot);
+  check_saved(12);
+
+  // nothing valid left : defaults
+  for (int i = 0; i < 12; i++) slot_at(i)[sizeof(CFG_HEAD)] ^= 0x01;
+  data_load();
+  TEST_ASSERT_EQUAL_INT(-1, cfg_store.slot);
+  TEST_ASSERT_EQUAL_UINT32(CFG().P_Scale, cfg.P_Scale);
+}
+
+// EEPROM image of the first releases at the start of the sector, saved again as a record
+void test_legacy_migration() {
+  CFG_V0 v0 = { 20, 5, 1, 0, 1 };
+  uint32_t w[(sizeof(CFG_V0) + 3) / 4];
+  memset(w, 0xFF, sizeof(w));
+  memcpy(w, &v0, sizeof(v0));
+  ESP.flashWrite(CFG_STORE_ADDR, w, sizeof(w));
+  data_load();
+  TEST_ASSERT_EQUAL_UINT32(20, cfg.I_Max_meter);
+  TEST_ASSERT_EQUAL_UINT32(5, cfg.I_Shift);
+  TEST_ASSERT_TRUE(cfg.send_p1);
+  TEST_ASSERT_FALSE(cfg.send_pm1);
+  TEST_ASSERT_TRUE(cfg.send_serial);
+  TEST_ASSERT_EQUAL_UINT32(CFG().P_Scale, cfg.P_Scale);
+  TEST_ASSERT_EQUAL_UINT32(1, cfg_store.saves);
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.slot);   // after the image
+
+  cfg = CFG();
+  data_load();
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.slot);
+  TEST_ASSERT_EQUAL_UINT32(20, cfg.I_Max_meter);
+  TEST_ASSERT_FALSE(cfg.send_pm1);
+}
+
+// An image that does not look like one (shift over 32 A, byte flags) is not migrated
+void test_legacy_invalid() {
+  const CFG_V0 bad[] = { { 20, 40, 1, 0, 1 }, { 0, 5, 1, 0, 1 }, { 20, 5, 2, 0, 1 }, { 20, 5, 1, 0, 0xFF } };
+  for (const CFG_V0 &v0 : bad) {
+    setUp();
+    uint32_t w[(sizeof(CFG_V0) + 3) / 4];
+    memset(w, 0xFF, sizeof(w));
+    memcpy(w, &v0, sizeof(v0));
+    ESP.flashWrite(CFG_STORE_ADDR, w, sizeof(w));
+    data_load();
+    TEST_ASSERT_EQUAL_UINT32(32, cfg.I_Max_meter);
+    TEST_ASSERT_EQUAL_UINT32(0, cfg.I_Shift);
+    TEST_ASSERT_TRUE(cfg.send_pm1);
+    TEST_ASSERT_EQUAL_UINT32(0, cfg_store.saves);
+  }
+}
+
+// Record of an older version, fields out of range, bool bytes other than 0 and 1 : clamped
+// to their defaults and saved again in the current version
+void test_clamp_after_migration() {
+  uint8_t data[sizeof(CFG)];
+  CFG def;
+  memcpy(data, &def, sizeof(def));
+  uint32_t shift = 99;
+  memcpy(data + offsetof(CFG, I_Shift), &shift, 4);
+  data[offsetof(CFG, send_p1)] = 0x5A;
+  data[offsetof(CFG, send_pm1)] = 0;
+  data[offsetof(CFG, send_serial)] = 0xFF;
+  data[offsetof(CFG, mqtt_state)] = 7;
+  data[offsetof(CFG, mqtt_intervals)] = 2;
+  save_raw(data, offsetof(CFG, mqtt_peak), 0);   // mqtt_peak came later
+  data_load();
+  uint8_t b[5];
+  memcpy(&b[0], &cfg.send_p1, 1);
+  memcpy(&b[1], &cfg.send_pm1, 1);
+  memcpy(&b[2], &cfg.send_serial, 1);
+  memcpy(&b[3], &cfg.mqtt_intervals, 1);
+  memcpy(&b[4], &cfg.mqtt_peak, 1);
+  TEST_ASSERT_EQUAL_UINT8(1, b[0]);
+  TEST_ASSERT_EQUAL_UINT8(0, b[1]);
+  TEST_ASSERT_EQUAL_UINT8(1, b[2]);
+  TEST_ASSERT_EQUAL_UINT8(1, b[3]);
+  TEST_ASSERT_EQUAL_UINT8(1, b[4]);
+  TEST_ASSERT_EQUAL_UINT32(32, cfg.I_Shift);
+  TEST_ASSERT_EQUAL_UINT8(MQTT_STATE_OFF, cfg.mqtt_state);
+
+  // saved again : the current version, as loaded
+  TEST_ASSERT_EQUAL_INT(1, cfg_store.slot);
+  CFG_REC r;
+  memcpy(&r, slot_at(1), sizeof(r));
+  TEST_ASSERT_EQUAL_UINT16(CFG_VERSION, r.h.version);
+  TEST_ASSERT_EQUAL_UINT16(sizeof(CFG), r.h.len);
+  TEST_ASSERT_EQUAL_MEMORY(&cfg, r.data, sizeof(CFG));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_empty);
+  RUN_TEST(test_wrap);
+  RUN_TEST(test_switch_torn);
+  RUN_TEST(test_switch_not_erased);
+  RUN_TEST(test_bad_records);
+  RUN_TEST(test_legacy_migration);
+  RUN_TEST(test_legacy_invalid);
+  RUN_TEST(test_clamp_after_migration);
+  return UNITY_END();
+}
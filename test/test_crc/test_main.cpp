@@ -0,0 +1,89 @@
+// CRC-16 of crc16.h (table, one byte per step) against the bitwise loop of the first
+// releases, on the sample telegram and on random buffers, both timed.
+
+#include <host.h>
+#include <unity.h>
+#include <crc16.h>
+
+#define RANDOM_BUFS 2000
+#define RUNS 5000
+
+char sample[4096];
+int sample_len = 0;
+
+void setUp() {}
+void tearDown() {}
+
+uint32_t rnd = 12345;
+
+uint32_t rnd_next() {
+  rnd = rnd * 1103515245 + 12345;
+  return rnd >> 8;
+}
+
+void test_check_value() {
+  // CRC-16/ARC check value
+  TEST_ASSERT_EQUAL_HEX16(0xBB3D, crc16_update(0, "123456789", 9));
+  TEST_ASSERT_EQUAL_HEX16(0xBB3D, host_crc16("123456789", 9));
+  TEST_ASSERT_EQUAL_HEX16(0, crc16_update(0, "", 0));
+}
+
+void test_sample() {
+  TEST_ASSERT_GREATER_THAN(0, sample_len);
+  const char *bang = strchr(sample, '!');
+  TEST_ASSERT_NOT_NULL(bang);
+  int body = bang + 1 - sample;
+  uint16_t crc = crc16_update(0, sample, body);
+  TEST_ASSERT_EQUAL_HEX16(host_crc16(sample, body), crc);
+  TEST_ASSERT_EQUAL_INT32(crc, crc16_parse(bang + 1));
+  char hex[5] = "";
+  crc16_format(crc, hex);
+  TEST_ASSERT_EQUAL_MEMORY(bang + 1, hex, 4);
+  // byte at a time, as p1_rx does
+  uint16_t c = 0;
+  for (int i = 0; i < body; i++) c = crc16_update(c, (uint8_t)sample[i]);
+  TEST_ASSERT_EQUAL_HEX16(crc, c);
+}
+
+// Any byte value, any length, resumed over chunks
+void test_random_buffers() {
+  static char buf[2048];
+  for (int n = 0; n < RANDOM_BUFS; n++) {
+    int len = rnd_next() % sizeof(buf);
+    for (int i = 0; i < len; i++) buf[i] = rnd_next();
+    uint16_t ref = host_crc16(buf, len);
+    TEST_ASSERT_EQUAL_HEX16(ref, crc16_update(0, buf, len));
+    int cut = (len > 0) ? rnd_next() % len : 0;
+    TEST_ASSERT_EQUAL_HEX16(ref, crc16_update(crc16_update(0, buf, cut), buf + cut, len - cut));
+  }
+}
+
+void test_bench() {
+  int body = strchr(sample, '!') + 1 - sample;
+  volatile uint16_t sink = 0;
+  HOST_STAGE bitwise("bitwise");
+  HOST_STAGE table("crc16_update");
+  for (int i = 0; i < RUNS; i++) {
+    host_stage_begin(&bitwise);
+    sink = sink + host_crc16(sample, body);
+    host_stage_end(&bitwise);
+    host_stage_begin(&table);
+    sink = sink + crc16_update(0, sample, body);
+    host_stage_end(&table);
+  }
+  printf("\nCRC of the sample telegram (%i bytes)\n", body);
+  host_stage_print(&bitwise);
+  host_stage_print(&table);
+  printf("table / bitwise : %.2f\n", (double)table.ns / bitwise.ns);
+  TEST_ASSERT_EQUAL_UINT32(0, table.allocs);
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  UNITY_BEGIN();
+  RUN_TEST(test_check_value);
+  RUN_TEST(test_sample);
+  RUN_TEST(test_random_buffers);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}
@@ -0,0 +1,96 @@
+// History log range queries (history.h) across the end of summer time : on the last Sunday
+// of October the meter goes back from 03:00 to 02:00, the 02:xx minutes are logged twice.
+// hist_seek must find the first time of a stamp and a range must return both times.
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define DAY 2310290000      // Sunday 29 October 2023
+
+HIST_REC batch[HIST_BATCH];
+HIST_LOG h("/th", HIST_MIN_SEGS, batch, HIST_BATCH);
+
+void setUp() {}
+void tearDown() {}
+
+// Minute records as the meter sends them : 00:00 to 02:59 summer time, 02:00 to 03:59 winter time
+void log_day() {
+  hist_begin(&h);
+  for (int i = 0; i < 300; i++) {
+    int m = (i < 180) ? i : i - 60;
+    AGG a;
+    memset(a.min, 0, sizeof(a.min));
+    memset(a.max, 0, sizeof(a.max));
+    memset(a.sum, 0, sizeof(a.sum));
+    a.stamp = DAY + m / 60 * 100 + m % 60;
+    a.n = 60;
+    a.E_consumed = i;   // record order
+    hist_add(&h, &a);
+    if (h.pending == h.batch_size) hist_write(&h);
+  }
+  hist_write(&h);
+}
+
+// Range query as hist_show runs it : record numbers (E_consumed) of from..to
+int query(uint32_t from, uint32_t to, uint32_t *found) {
+  int n = 0;
+  for (uint32_t i = hist_seek(&h, from); i < hist_end(&h); i++) {
+    HIST_REC r;
+    TEST_ASSERT_TRUE(hist_read(&h, i, &r));
+    int in = hist_range(r.stamp, from, to);
+    if (in > 0) break;
+    if (in < 0) continue;
+    found[n++] = r.E_consumed;
+  }
+  return n;
+}
+
+void test_seek() {
+  TEST_ASSERT_EQUAL_UINT32(300, hist_end(&h));
+  TEST_ASSERT_EQUAL_UINT32(0, hist_seek(&h, DAY));
+  TEST_ASSERT_EQUAL_UINT32(119, hist_seek(&h, DAY + 159));
+  TEST_ASSERT_EQUAL_UINT32(120, hist_seek(&h, DAY + 200));
+  for (int m = 0; m < 60; m++) {   // first time of every minute of the repeated hour
+    TEST_ASSERT_EQUAL_UINT32(120 + m, hist_seek(&h, DAY + 200 + m));
+  }
+  TEST_ASSERT_EQUAL_UINT32(240, hist_seek(&h, DAY + 300));
+  TEST_ASSERT_EQUAL_UINT32(299, hist_seek(&h, DAY + 359));
+  TEST_ASSERT_EQUAL_UINT32(300, hist_seek(&h, DAY + 400));
+}
+
+void test_range() {
+  uint32_t found[300];
+  // before the repeated hour
+  TEST_ASSERT_EQUAL_INT(31, query(DAY + 100, DAY + 130, found));
+  TEST_ASSERT_EQUAL_UINT32(60, found[0]);
+  TEST_ASSERT_EQUAL_UINT32(90, found[30]);
+
+  // inside it : both times
+  int n = query(DAY + 230, DAY + 240, found);
+  TEST_ASSERT_EQUAL_INT(22, n);
+  for (int i = 0; i < 11; i++) {
+    TEST_ASSERT_EQUAL_UINT32(150 + i, found[i]);
+    TEST_ASSERT_EQUAL_UINT32(210 + i, found[11 + i]);
+  }
+
+  // across its end
+  n = query(DAY + 250, DAY + 310, found);
+  TEST_ASSERT_EQUAL_INT(31, n);
+  TEST_ASSERT_EQUAL_UINT32(170, found[0]);
+  TEST_ASSERT_EQUAL_UINT32(179, found[9]);
+  TEST_ASSERT_EQUAL_UINT32(230, found[10]);
+  TEST_ASSERT_EQUAL_UINT32(250, found[30]);
+
+  // the whole night
+  TEST_ASSERT_EQUAL_INT(300, query(DAY, DAY + 359, found));
+  for (int i = 0; i < 300; i++) TEST_ASSERT_EQUAL_UINT32(i, found[i]);
+}
+
+int main(int argc, char **argv) {
+  log_day();
+  UNITY_BEGIN();
+  RUN_TEST(test_seek);
+  RUN_TEST(test_range);
+  return UNITY_END();
+}
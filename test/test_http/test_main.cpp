@@ -0,0 +1,163 @@
+// HTTP API (http.h) through the scheduler loop, clients on host sockets : /api/now before
+// and after the first telegram, /api/stream events, unknown paths, requests that never
+// end, a full client pool and a stream client too slow to follow.
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define LOOP_MS 5
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+
+void setUp() {}
+void tearDown() {}
+
+void run(int ms) {
+  for (int t = 0; t < ms; t += LOOP_MS) {
+    host_advance(LOOP_MS);
+    loop();
+  }
+}
+
+HOST_SOCK *request(const char *text) {
+  HOST_SOCK *s = host_connect(80);
+  TEST_ASSERT_NOT_NULL(s);
+  host_send(s, text);
+  return s;
+}
+
+// What the device wrote, as a string
+const char *reply(HOST_SOCK *s) {
+  static char text[HOST_SOCK_OUT + 1];
+  memcpy(text, s->out, s->out_len);
+  text[s->out_len] = 0;
+  return text;
+}
+
+bool starts(const char *text, const char *head) {
+  return strncmp(text, head, strlen(head)) == 0;
+}
+
+// Telegram i : the sample, time + i s
+void telegram(int i) {
+  static char t[P1_BUF_SIZE];
+  char text[24];
+  memcpy(t, sample, sample_len + 1);
+  snprintf(text, sizeof(text), "(2308061452%02uS)", 9 + i);
+  host_set(t, "(230806145209S)", text);
+  host_serial_feed(t, host_sign(t, P1_BUF_SIZE));
+}
+
+// JSON of the last telegram as the API sends it
+const char *now_json() {
+  static char value[HTTP_EVENT_SIZE];
+  DG v;
+  FMT f;
+  dg_snapshot(&v);
+  fmt_init(&f, value, sizeof(value));
+  http_dg_json(&v, &f);
+  return value;
+}
+
+// No telegram yet : /api/now is answered 503 at once, the stream waits for the first one
+void test_before_first_telegram() {
+  TEST_ASSERT_EQUAL_UINT32(0, p1.frames);
+  HOST_SOCK *now = request("GET /api/now HTTP/1.1\r\nHost: p1\r\n\r\n");
+  HOST_SOCK *stream = request("GET /api/stream HTTP/1.1\r\nHost: p1\r\n\r\n");
+  run(500);
+  TEST_ASSERT_EQUAL_STRING(http_503, reply(now));
+  TEST_ASSERT_FALSE(now->open);
+  TEST_ASSERT_EQUAL_STRING(http_stream_head, reply(stream));
+  TEST_ASSERT_TRUE(stream->open);
+  host_release(now);
+
+  telegram(0);
+  run(500);
+  TEST_ASSERT_EQUAL_UINT32(1, p1.frames);
+  char event[HTTP_EVENT_SIZE + 64];
+  snprintf(event, sizeof(event), "%sid: 1\ndata: %s\n\n", http_stream_head, now_json());
+  TEST_ASSERT_EQUAL_STRING(event, reply(stream));
+  host_release(stream);
+  run(200);
+  TEST_ASSERT_FALSE(http_active(&http));
+}
+
+void test_now() {
+  HOST_SOCK *now = request("GET /api/now?x=1 HTTP/1.1\r\nHost: p1\r\n\r\n");
+  run(200);
+  char json[HTTP_EVENT_SIZE + 256];
+  snprintf(json, sizeof(json), "%s%s", http_json_head, now_json());
+  TEST_ASSERT_EQUAL_STRING(json, reply(now));
+  TEST_ASSERT_NOT_NULL(strstr(reply(now), "\"P_injected\": 1201,"));
+  TEST_ASSERT_FALSE(now->open);
+  host_release(now);
+}
+
+// Events follow the telegrams, a slow client only gets the last one
+void test_stream() {
+  HOST_SOCK *stream = request("GET /api/stream HTTP/1.1\r\n\r\n");
+  run(200);
+  TEST_ASSERT_TRUE(starts(reply(stream), http_stream_head));
+  host_drain(stream);
+  for (int i = 1; i <= 3; i++) {
+    telegram(i);
+    run(1000);
+    char head[16];
+    snprintf(head, sizeof(head), "id: %u\n", http.seq);
+    TEST_ASSERT_TRUE(starts(reply(stream), head));
+    TEST_ASSERT_NOT_NULL(strstr(reply(stream), now_json()));
+    host_drain(stream);
+  }
+  // peer not reading : dropped when its event buffer is reused
+  uint32_t dropped = http.dropped;
+  stream->room = 100;
+  for (int i = 4; i <= 6; i++) {
+    telegram(i);
+    run(1000);
+  }
+  TEST_ASSERT_EQUAL_UINT32(dropped + 1, http.dropped);
+  TEST_ASSERT_FALSE(stream->open);
+  host_release(stream);
+}
+
+void test_errors() {
+  HOST_SOCK *other = request("GET / HTTP/1.1\r\n\r\n");
+  HOST_SOCK *slow = request("GET /api/now HTTP/1.1\r\n");   // header never ends
+  run(200);
+  TEST_ASSERT_EQUAL_STRING(http_404, reply(other));
+  TEST_ASSERT_FALSE(other->open);
+  TEST_ASSERT_TRUE(slow->open);
+  run(HTTP_TIMEOUT + 200);
+  TEST_ASSERT_FALSE(slow->open);
+  TEST_ASSERT_EQUAL_INT(0, slow->out_len);
+  host_release(other);
+  host_release(slow);
+
+  // one client more than the pool
+  HOST_SOCK *s[HTTP_MAX_CLIENTS + 1];
+  uint32_t rejected = http.rejected;
+  for (int i = 0; i <= HTTP_MAX_CLIENTS; i++) {
+    s[i] = request("GET /api/stream HTTP/1.1\r\n\r\n");
+    run(200);
+  }
+  TEST_ASSERT_EQUAL_UINT32(rejected + 1, http.rejected);
+  TEST_ASSERT_EQUAL_STRING(http_503, reply(s[HTTP_MAX_CLIENTS]));
+  for (int i = 0; i < HTTP_MAX_CLIENTS; i++) TEST_ASSERT_TRUE(s[i]->open);
+  for (int i = 0; i <= HTTP_MAX_CLIENTS; i++) host_release(s[i]);
+  run(200);
+  TEST_ASSERT_FALSE(http_active(&http));
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  setup();
+  while (safecnt > 0) run(LOOP_MS);   // WiFi and servers up, OTA window at boot over
+  UNITY_BEGIN();
+  RUN_TEST(test_before_first_telegram);
+  RUN_TEST(test_now);
+  RUN_TEST(test_stream);
+  RUN_TEST(test_errors);
+  return UNITY_END();
+}
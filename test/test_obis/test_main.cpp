@@ -0,0 +1,270 @@
+// OBIS decoding of the sample telegram field by field, unknown and truncated lines, M-Bus
+// lines, and the JSON / CBOR payloads built from the decoded values (Fluvius profile).
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+
+void setUp() {}
+void tearDown() {}
+
+// Values of the sample, by code
+struct EXPECT {
+  const char *code;
+  uint32_t val;
+};
+
+const EXPECT sample_vals[] = {
+  { "1-0:1.8.1", 93898 },   { "1-0:1.8.2", 165920 },  { "1-0:2.8.1", 365262 },  { "1-0:2.8.2", 125678 },
+  { "1-0:1.4.0", 0 },       { "1-0:1.7.0", 0 },       { "1-0:2.7.0", 1201 },
+  { "1-0:21.7.0", 0 },      { "1-0:41.7.0", 0 },      { "1-0:61.7.0", 0 },
+  { "1-0:22.7.0", 386 },    { "1-0:42.7.0", 314 },    { "1-0:62.7.0", 500 },
+  { "1-0:32.7.0", 2341 },   { "1-0:52.7.0", 2317 },   { "1-0:72.7.0", 2293 },
+  { "1-0:31.7.0", 184 },    { "1-0:51.7.0", 199 },    { "1-0:71.7.0", 222 },
+};
+
+OBIS_ID parse(const char *line, OBIS_VAL *ov) {
+  return obis_parse_line(line, line + strlen(line), ov);
+}
+
+void test_sample_fields() {
+  OBIS_VAL ov;
+  obis_parse(sample, sample_len, &ov);
+  TEST_ASSERT_EQUAL_UINT32(230806, ov.date);
+  TEST_ASSERT_EQUAL_UINT32(145209, ov.time);
+  for (unsigned int i = 0; i < OBIS_FIELDS; i++) {
+    const OBIS_FIELD *f = &obis_fields[i];
+    TEST_ASSERT_EQUAL_PTR(f, obis_lookup(f->code, f->len));
+    if (f->id == OBIS_DATETIME) continue;
+    const EXPECT *e = NULL;
+    for (const EXPECT &x : sample_vals) if (strcmp(x.code, f->code) == 0) e = &x;
+    TEST_ASSERT_NOT_NULL_MESSAGE(e, f->code);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(e->val, ov.val[f->id], f->code);
+  }
+  for (int i = 0; i < MBUS_CHANNELS; i++) TEST_ASSERT_EQUAL_UINT8(MBUS_NONE, ov.mbus[i].type);
+
+  // incremental decoding while receiving gives the same values
+  static char buf[P1_BUF_SIZE];
+  P1_FRAME p;
+  p1_begin(&p, buf, sizeof(buf));
+  bool done = false;
+  for (int i = 0; (i < sample_len) && !done; i++) done = p1_rx(&p, sample[i]);
+  TEST_ASSERT_TRUE(done && p.crc_valid);
+  TEST_ASSERT_EQUAL_MEMORY(&ov, &p.ov, sizeof(ov));
+}
+
+void test_unknown_lines() {
+  OBIS_VAL ov;
+  OBIS_VAL zero;
+  memset(&ov, 0, sizeof(ov));
+  memset(&zero, 0, sizeof(zero));
+  const char *lines[] = {
+    "0-0:96.1.4(50216)",          // in the telegram, not decoded
+    "0-0:96.14.0(0002)",
+    "1-0:99.97.0(0)(0-0:96.7.19)",
+    "1-0:1.8.0(000259.818*kWh)",  // other profiles only
+    "/FLU5\\253769484_A",
+    "!B0XX",
+    "",
+    "1-0:1.7.0",                  // no value
+    "0-0:96.13.0.255.255.255.1(1)",  // code too long
+    "0-5:24.1.0(003)",            // M-Bus channel out of range
+  };
+  for (const char *l : lines) {
+    TEST_ASSERT_EQUAL_INT_MESSAGE(OBIS_NONE, parse(l, &ov), l);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(&zero, &ov, sizeof(ov), l);
+  }
+}
+
+void test_truncated_lines() {
+  OBIS_VAL ov;
+  memset(&ov, 0, sizeof(ov));
+  ov.date = 1;
+  ov.time = 1;
+  // date and time cut : none rather than a wrong one
+  TEST_ASSERT_EQUAL_INT(OBIS_DATETIME, parse("0-0:1.0.0(2308061452", &ov));
+  TEST_ASSERT_EQUAL_UINT32(0, ov.date);
+  TEST_ASSERT_EQUAL_UINT32(0, ov.time);
+  ov.val[OBIS_P_INJ] = 1;
+  TEST_ASSERT_EQUAL_INT(OBIS_P_INJ, parse("1-0:2.7.0(", &ov));
+  TEST_ASSERT_EQUAL_UINT32(0, ov.val[OBIS_P_INJ]);
+
+  // telegram cut by the next one : no frame, its CRC is never checked
+  static char buf[P1_BUF_SIZE];
+  P1_FRAME p;
+  p1_begin(&p, buf, sizeof(buf));
+  const char *cut = strstr(sample, "1-0:2.7.0(01.2");
+  for (const char *c = sample; c < cut + 14; c++) TEST_ASSERT_FALSE(p1_rx(&p, *c));
+  bool done = false;
+  for (int i = 0; (i < sample_len) && !done; i++) done = p1_rx(&p, sample[i]);
+  TEST_ASSERT_TRUE(done && p.crc_valid);
+  TEST_ASSERT_EQUAL_UINT32(1, p.restarts);
+  TEST_ASSERT_EQUAL_UINT32(1201, p.ov.val[OBIS_P_INJ]);
+
+  // a line losing bytes on the way : decoded, and the telegram rejected by its CRC
+  static char lost[P1_BUF_SIZE];
+  int n = 0;
+  for (const char *c = sample; *c; c++) if (c != cut + 12) lost[n++] = *c;
+  done = false;
+  for (int i = 0; (i < n) && !done; i++) done = p1_rx(&p, lost[i]);
+  TEST_ASSERT_TRUE(done);
+  TEST_ASSERT_FALSE(p.crc_valid);
+  TEST_ASSERT_EQUAL_UINT32(1, p.crc_errors);
+}
+
+void test_mbus_lines() {
+  OBIS_VAL ov;
+  memset(&ov, 0, sizeof(ov));
+  TEST_ASSERT_EQUAL_INT(OBIS_NONE, parse("0-1:24.1.0(003)", &ov));
+  TEST_ASSERT_EQUAL_UINT8(MBUS_GAS, ov.mbus[0].type);
+  parse("0-1:24.2.3(230806145000S)(01234.567*m3)", &ov);
+  TEST_ASSERT_EQUAL_UINT32(230806, ov.mbus[0].date);
+  TEST_ASSERT_EQUAL_UINT32(145000, ov.mbus[0].time);
+  TEST_ASSERT_EQUAL_UINT32(1234567, ov.mbus[0].value);
+  TEST_ASSERT_EQUAL_STRING("m3", ov.mbus[0].unit);
+
+  // DSMR reading, 2 decimals
+  parse("0-2:24.1.0(007)", &ov);
+  parse("0-2:24.2.1(230806150000W)(12785.12*m3)", &ov);
+  TEST_ASSERT_EQUAL_UINT8(MBUS_WATER, ov.mbus[1].type);
+  TEST_ASSERT_EQUAL_UINT32(12785120, ov.mbus[1].value);
+  TEST_ASSERT_EQUAL_UINT32(150000, ov.mbus[1].time);
+
+  // decimals beyond 3 dropped, unit cut to its buffer
+  parse("0-4:24.2.1(230806150000W)(00012.3456789*GJ)", &ov);
+  TEST_ASSERT_EQUAL_UINT32(12345, ov.mbus[3].value);
+  TEST_ASSERT_EQUAL_STRING("GJ", ov.mbus[3].unit);
+  parse("0-4:24.2.1(230806150000W)(7*kWhX)", &ov);
+  TEST_ASSERT_EQUAL_UINT32(7000, ov.mbus[3].value);
+  TEST_ASSERT_EQUAL_STRING("kWh", ov.mbus[3].unit);
+
+  // cut or malformed readings leave the channel as it was
+  MBUS_VAL before = ov.mbus[0];
+  parse("0-1:24.2.3(230806150000S)", &ov);
+  parse("0-1:24.2.3(230806150000S)(0", &ov);
+  parse("0-1:24.2.3(2308061500)(00001.000*m3)", &ov);
+  parse("0-1:24.3.0(230806150000)(00)", &ov);
+  TEST_ASSERT_EQUAL_MEMORY(&before, &ov.mbus[0], sizeof(before));
+  TEST_ASSERT_EQUAL_UINT8(MBUS_NONE, ov.mbus[2].type);
+}
+
+void test_fmt() {
+  char buf[40];
+  FMT f;
+  fmt_init(&f, buf, sizeof(buf));
+  fmt_uint(&f, 0);
+  fmt_char(&f, ' ');
+  fmt_uint(&f, 42, 5, '0');
+  fmt_char(&f, ' ');
+  fmt_int(&f, INT32_MIN);
+  fmt_char(&f, ' ');
+  fmt_fixed(&f, -5, 2);
+  fmt_char(&f, ' ');
+  fmt_ufixed(&f, 2341, 1);
+  TEST_ASSERT_EQUAL_STRING("0 00042 -2147483648 -0.05 234.1", buf);
+  TEST_ASSERT_FALSE(f.overflow);
+
+  fmt_init(&f, buf, sizeof(buf));
+  fmt_open(&f, '{');
+  fmt_json_str(&f, "unit", "m\"3\\\n");
+  fmt_json_int(&f, "P", -386);
+  fmt_close(&f, '}');
+  TEST_ASSERT_EQUAL_STRING("{\"unit\": \"m3\",\"P\": -386}", buf);
+
+  // cut at the buffer size, still terminated
+  fmt_init(&f, buf, 8);
+  fmt_str(&f, "0123456789");
+  TEST_ASSERT_TRUE(f.overflow);
+  TEST_ASSERT_EQUAL_STRING("0123456", buf);
+}
+
+// Decoded sample with a gas meter, as dg_receive leaves it
+void sample_dg(DG *v) {
+  OBIS_VAL ov;
+  obis_parse(sample, sample_len, &ov);
+  parse("0-1:24.1.0(003)", &ov);
+  parse("0-1:24.2.3(230806145000S)(01234.567*m3)", &ov);
+  *v = DG();
+  dg_apply(v, ov);
+}
+
+void test_json() {
+  DG v;
+  sample_dg(&v);
+  char value[600];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  mqtt_state_json(&v, &f);
+  TEST_ASSERT_EQUAL_STRING("{\"E_consumed\": 259818,\"E_injected\": 490940,\"P_consumed\": 0,\"P_injected\": 1201,"
+                           "\"U_L1\": 234.1,\"U_L2\": 231.7,\"U_L3\": 229.3,\"I_L1\": 1.84,\"I_L2\": 1.99,\"I_L3\": 2.22,"
+                           "\"P_L1\": -386,\"P_L2\": -314,\"P_L3\": -500,\"P_QuarterHourPeak\": 0}", value);
+  fmt_init(&f, value, sizeof(value));
+  http_dg_json(&v, &f);
+  TEST_ASSERT_EQUAL_STRING("{\"t\": 230806145209,\"E_consumed_1\": 93898,\"E_consumed_2\": 165920,\"E_consumed\": 259818,"
+                           "\"E_injected_1\": 365262,\"E_injected_2\": 125678,\"E_injected\": 490940,"
+                           "\"P_consumed\": 0,\"P_injected\": 1201,\"U_L1\": 234.1,\"U_L2\": 231.7,\"U_L3\": 229.3,"
+                           "\"I_L1\": 1.84,\"I_L2\": 1.99,\"I_L3\": 2.22,\"P_L1\": -386,\"P_L2\": -314,\"P_L3\": -500,"
+                           "\"P_CurrentPeak\": 0,\"P_QuarterHourPeak\": 0,\"P_MonthPeak\": 0,\"P_PeakHeadroom\": 0,\"PeakAlert\": 0,"
+                           "\"MBus\": [{\"channel\": 1,\"type\": 3,\"value\": 1234.567,\"unit\": \"m3\",\"t\": 230806145000}]}", value);
+}
+
+// CBOR item head at *p : major type and argument
+uint8_t cbor_read(const uint8_t **p, uint32_t *val) {
+  uint8_t b = *(*p)++;
+  uint8_t ai = b & 0x1F;
+  int n = (ai == 24) ? 1 : (ai == 25) ? 2 : (ai == 26) ? 4 : 0;
+  *val = (n == 0) ? ai : 0;
+  while (n-- > 0) *val = (*val << 8) | *(*p)++;
+  return b >> 5;
+}
+
+void test_cbor() {
+  uint8_t bin[96];
+  CBOR c;
+  cbor_init(&c, bin, sizeof(bin));
+  cbor_uint(&c, 23);
+  cbor_uint(&c, 24);
+  cbor_uint(&c, 65536);
+  cbor_int(&c, -1);
+  cbor_int(&c, -25);
+  const uint8_t head[] = { 0x17, 0x18, 0x18, 0x1A, 0x00, 0x01, 0x00, 0x00, 0x20, 0x38, 0x18 };
+  TEST_ASSERT_EQUAL_INT(sizeof(head), c.len);
+  TEST_ASSERT_EQUAL_MEMORY(head, bin, sizeof(head));
+
+  DG v;
+  sample_dg(&v);
+  size_t len = mqtt_state_cbor(&v, bin, sizeof(bin));
+  TEST_ASSERT_GREATER_THAN(0, len);
+  const int32_t expect[K_COUNT] = { MQTT_CBOR_SCHEMA, 230806, 145209, 259818, 490940, 0, 1201,
+                                    2341, 2317, 2293, 184, 199, 222, -386, -314, -500, 0 };
+  const uint8_t *p = bin;
+  uint32_t n;
+  TEST_ASSERT_EQUAL_UINT8(5, cbor_read(&p, &n));
+  TEST_ASSERT_EQUAL_UINT32(K_COUNT, n);
+  for (int k = 0; k < K_COUNT; k++) {
+    TEST_ASSERT_EQUAL_UINT8(0, cbor_read(&p, &n));
+    TEST_ASSERT_EQUAL_UINT32(k, n);
+    uint8_t major = cbor_read(&p, &n);
+    int32_t val = (major == 1) ? -1 - (int32_t)n : (int32_t)n;
+    TEST_ASSERT_EQUAL_INT32(expect[k], val);
+  }
+  TEST_ASSERT_EQUAL_INT(len, p - bin);
+  // too small a buffer : nothing rather than a cut map
+  TEST_ASSERT_EQUAL_INT(0, mqtt_state_cbor(&v, bin, len - 1));
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  UNITY_BEGIN();
+  RUN_TEST(test_sample_fields);
+  RUN_TEST(test_unknown_lines);
+  RUN_TEST(test_truncated_lines);
+  RUN_TEST(test_mbus_lines);
+  RUN_TEST(test_fmt);
+  RUN_TEST(test_json);
+  RUN_TEST(test_cbor);
+  return UNITY_END();
+}
@@ -0,0 +1,221 @@
+// Closed intervals and the MQTT outbox (outbox.h) through the scheduler loop, one telegram
+// a second : every closed interval is published live or queued, including one closed just
+// before the broker went away, the published seq only moves once it is queued, a full
+// queue counts the intervals it loses, the queue replays once the broker is back, and a
+// spill to the file cut short leaves the queue as it was.
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define LOOP_MS 5
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+int sec = 0;    // meter time of the next telegram, s after 14:50:00
+
+void setUp() {}
+void tearDown() {}
+
+void run(int ms) {
+  for (int t = 0; t < ms; t += LOOP_MS) {
+    host_advance(LOOP_MS);
+    loop();
+  }
+}
+
+// Telegram of second s after 14:50:00 on the P1 port
+void feed(int s) {
+  static char t[P1_BUF_SIZE];
+  char text[24];
+  memcpy(t, sample, sample_len + 1);
+  snprintf(text, sizeof(text), "(2308%02u%02u%02u%02uS)", 6 + (14 * 3600 + 50 * 60 + s) / 86400,
+           (14 + (50 * 60 + s) / 3600) % 24, (50 + s / 60) % 60, s % 60);
+  host_set(t, "(230806145209S)", text);
+  host_serial_feed(t, host_sign(t, P1_BUF_SIZE));
+}
+
+// n seconds of telegrams
+void seconds(int n) {
+  for (int i = 0; i < n; i++) {
+    feed(sec++);
+    run(1000);
+  }
+}
+
+void broker_down() {
+  host_broker_up = false;
+  host_broker->open = false;
+}
+
+void broker_up() {
+  host_broker_up = true;
+}
+
+// Stamp (YYMMDDhhmm) of the minute starting s after 14:50:00 on 230806
+uint32_t minute_at(int s) {
+  return 2308060000 + (14 + (50 + s / 60) / 60) * 100 + (50 + s / 60) % 60;
+}
+
+void test_live() {
+  uint32_t published = host_mqtt_n;
+  seconds(61);    // 14:50:00 .. 14:51:00, one minute closed
+  TEST_ASSERT_TRUE(mqtt_conn.up);
+  TEST_ASSERT_EQUAL_UINT32(1, agg_min.seq);
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq, mqtt_min_seq);
+  const HOST_MSG *m = host_mqtt_last(MQTT_TOPIC "Minute");
+  TEST_ASSERT_NOT_NULL(m);
+  TEST_ASSERT_NOT_NULL(strstr((const char *)m->payload, "{\"t\": 2308061450,\"n\": 60,"));
+  TEST_ASSERT_GREATER_THAN(published, host_mqtt_n);
+  TEST_ASSERT_EQUAL_UINT32(0, outbox_depth(&outbox));
+}
+
+// A minute closes, the broker goes away before the MQTT task publishes it : queued
+void test_closed_before_link_loss() {
+  seconds(59);    // up to 14:51:59
+  uint32_t queued = outbox.queued;
+  feed(sec++);    // 14:52:00 closes 14:51
+  task_serial();
+  task_intervals();
+  TEST_ASSERT_EQUAL_UINT32(2, agg_min.seq);
+  TEST_ASSERT_EQUAL_UINT32(1, mqtt_min_seq);
+  broker_down();
+  run(1000);
+  TEST_ASSERT_FALSE(mqtt_conn.up);
+  seconds(1);
+  TEST_ASSERT_EQUAL_UINT32(queued + 1, outbox.queued);
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq, mqtt_min_seq);
+  OUTBOX_REC *r = outbox_head(&outbox);
+  TEST_ASSERT_NOT_NULL(r);
+  TEST_ASSERT_EQUAL_UINT32(minute_at(60), r->r.stamp);
+  TEST_ASSERT_EQUAL_UINT8(OUTBOX_MINUTE, r->kind);
+}
+
+// Broker down for minutes : every minute and the quarter queued, in order
+void test_link_down() {
+  uint32_t queued = outbox.queued;
+  uint32_t minutes = agg_min.seq;
+  uint32_t quarters = agg_qtr.seq;
+  seconds(9 * 60);    // 14:52:02 .. 15:01:01
+  TEST_ASSERT_EQUAL_UINT32(minutes + 9, agg_min.seq);
+  TEST_ASSERT_EQUAL_UINT32(quarters + 1, agg_qtr.seq);
+  TEST_ASSERT_EQUAL_UINT32(queued + 10, outbox.queued);
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq, mqtt_min_seq);
+  TEST_ASSERT_EQUAL_UINT32(agg_qtr.seq, mqtt_qtr_seq);
+  TEST_ASSERT_EQUAL_UINT32(11, outbox_depth(&outbox));
+  TEST_ASSERT_EQUAL_UINT32(0, outbox.dropped);
+}
+
+// Queue full and LittleFS refusing the spill : the seq waits for a free place, only the
+// intervals replaced before that are lost
+void test_queue_full() {
+  host_fs_full = true;
+  seconds(5 * 60);    // 15:01:02 .. 15:06:01
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM, outbox_depth(&outbox));
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq, mqtt_min_seq);
+  seconds(2 * 60);
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM, outbox_depth(&outbox));
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq - 2, mqtt_min_seq);    // one replaced and lost, the last waiting
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.dropped);
+  host_fs_full = false;
+  seconds(1);
+  TEST_ASSERT_EQUAL_UINT32(agg_min.seq, mqtt_min_seq);
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM + 1, outbox_depth(&outbox));
+  TEST_ASSERT_EQUAL_UINT32(1, outbox.spills);
+}
+
+// Broker back : the queue replays, oldest first with its own stamps, acked by the echo
+void test_replay() {
+  uint32_t depth = outbox_depth(&outbox);
+  broker_up();
+  while (!mqtt_conn.up) seconds(1);   // reconnect backoff
+  seconds(10);
+  TEST_ASSERT_EQUAL_UINT32(0, outbox_depth(&outbox));
+  TEST_ASSERT_EQUAL_UINT32(depth, outbox.acked);
+  TEST_ASSERT_EQUAL_UINT32(0, outbox.unacked);
+  const HOST_MSG *m = host_mqtt_last(MQTT_TOPIC "Backlog/Quarter");
+  TEST_ASSERT_NOT_NULL(m);
+  TEST_ASSERT_NOT_NULL(strstr((const char *)m->payload, "{\"t\": 2308061445,\"n\": "));
+  // History schema, not the one of Quarter
+  TEST_ASSERT_NOT_NULL(strstr((const char *)m->payload, ",\"P_avg\": "));
+  TEST_ASSERT_NOT_NULL(strstr((const char *)m->payload, ",\"I_L_max\": ["));
+  TEST_ASSERT_NULL(strstr((const char *)m->payload, "\"P_consumed\""));
+  TEST_ASSERT_FALSE(LittleFS.exists(OUTBOX_FILE));
+}
+
+// Interval i queued in o
+bool push(OUTBOX *o, int i) {
+  AGG a;
+  memset(a.min, 0, sizeof(a.min));
+  memset(a.max, 0, sizeof(a.max));
+  memset(a.sum, 0, sizeof(a.sum));
+  a.stamp = 2308061500 + i;
+  a.n = 60;
+  return outbox_push(o, OUTBOX_MINUTE, &a);
+}
+
+// File system full in the middle of a spill : depth and head unchanged, the partial write
+// cut off, appends go on once there is room. Cut off refused : no more appends to the file.
+void test_spill_failure() {
+  static OUTBOX o;
+  LittleFS.remove(OUTBOX_FILE);
+  outbox_begin(&o);
+  for (int i = 0; i <= OUTBOX_RAM; i++) TEST_ASSERT_TRUE(push(&o, i));   // one spill
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM, o.file_n);
+  TEST_ASSERT_EQUAL_UINT32(0, outbox_head(&o)->r.stamp - 2308061500);
+  outbox_pop(&o);   // first record of the file sent
+  TEST_ASSERT_EQUAL_UINT32(1, outbox_head(&o)->r.stamp - 2308061500);
+  for (int i = OUTBOX_RAM + 1; i < 2 * OUTBOX_RAM; i++) TEST_ASSERT_TRUE(push(&o, i));
+  uint32_t depth = outbox_depth(&o);
+  uint32_t errors = o.errors;
+
+  host_fs_room = sizeof(OUTBOX_REC) + 20;   // one record and a part of the next
+  TEST_ASSERT_FALSE(push(&o, 2 * OUTBOX_RAM));
+  host_fs_room = -1;
+  TEST_ASSERT_EQUAL_UINT32(depth, outbox_depth(&o));
+  TEST_ASSERT_EQUAL_UINT32(1, o.file_rd);
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM, o.file_n);
+  TEST_ASSERT_EQUAL_UINT32(errors + 1, o.errors);
+  TEST_ASSERT_EQUAL_UINT32(OUTBOX_RAM * sizeof(OUTBOX_REC), host_files[OUTBOX_FILE].size());
+  TEST_ASSERT_EQUAL_UINT32(1, outbox_head(&o)->r.stamp - 2308061500);
+  TEST_ASSERT_TRUE(push(&o, 2 * OUTBOX_RAM));
+  TEST_ASSERT_EQUAL_UINT32(2 * OUTBOX_RAM, o.file_n);
+
+  // partial write that cannot be cut off : the file is replayed, not appended to
+  for (int i = 2 * OUTBOX_RAM + 1; i < 3 * OUTBOX_RAM; i++) TEST_ASSERT_TRUE(push(&o, i));
+  depth = outbox_depth(&o);
+  host_fs_room = 20;
+  host_fs_trunc_fail = true;
+  TEST_ASSERT_FALSE(push(&o, 3 * OUTBOX_RAM));
+  host_fs_room = -1;
+  host_fs_trunc_fail = false;
+  TEST_ASSERT_TRUE(o.file_torn);
+  TEST_ASSERT_EQUAL_UINT32(depth, outbox_depth(&o));
+  TEST_ASSERT_FALSE(push(&o, 3 * OUTBOX_RAM));
+  TEST_ASSERT_EQUAL_UINT32(2 * OUTBOX_RAM * sizeof(OUTBOX_REC) + 20, host_files[OUTBOX_FILE].size());
+  for (int i = 1; i < 3 * OUTBOX_RAM; i++) {   // in order, none torn
+    OUTBOX_REC *r = outbox_head(&o);
+    TEST_ASSERT_NOT_NULL(r);
+    TEST_ASSERT_EQUAL_UINT32(i, r->r.stamp - 2308061500);
+    outbox_pop(&o);
+  }
+  TEST_ASSERT_FALSE(o.file_torn);
+  TEST_ASSERT_FALSE(LittleFS.exists(OUTBOX_FILE));
+  TEST_ASSERT_EQUAL_UINT32(0, outbox_depth(&o));
+  TEST_ASSERT_TRUE(push(&o, 3 * OUTBOX_RAM));
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  setup();
+  cfg.mqtt_intervals = true;
+  while (safecnt > 0) run(LOOP_MS);   // WiFi, servers and MQTT up, OTA window at boot over
+  UNITY_BEGIN();
+  RUN_TEST(test_live);
+  RUN_TEST(test_closed_before_link_loss);
+  RUN_TEST(test_link_down);
+  RUN_TEST(test_queue_full);
+  RUN_TEST(test_replay);
+  RUN_TEST(test_spill_failure);
+  return UNITY_END();
+}
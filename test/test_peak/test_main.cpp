@@ -0,0 +1,135 @@
+// Capacity tariff tracking (peak.h) : quarter rollover, incomplete quarters, the monthly
+// peak and its reset, PEAK_FLOOR, alerts and the headroom up to the end of a quarter.
+
+#include <host.h>
+#include <unity.h>
+#include <type_traits>
+#include "../../src/main.cpp"
+
+void setUp() {}
+void tearDown() {}
+
+// meter time of second s of the quarter starting at hhmm
+uint32_t quarter_time(uint32_t hhmm, int s) {
+  return (hhmm + s / 60) * 100 + s % 60;
+}
+
+// One telegram a second at constant import, seconds from to to - 1 of the quarter,
+// the meter sending no 1-0:1.4.0 (integrated demand)
+void run_quarter(PEAK *pk, uint32_t date, uint32_t hhmm, uint32_t power, int from = 0, int to = 900) {
+  for (int s = from; s < to; s++) peak_update(pk, date, quarter_time(hhmm, s), 0, power);
+}
+
+void test_quarter_rollover() {
+  PEAK pk;
+  run_quarter(&pk, 230806, 1445, 3000);
+  TEST_ASSERT_EQUAL_UINT32(2308061445, pk.quarter);
+  TEST_ASSERT_EQUAL_UINT16(899, pk.elapsed);
+  TEST_ASSERT_INT_WITHIN(2, 3000, pk.forecast);
+  TEST_ASSERT_EQUAL_UINT32(0, pk.last);
+
+  // first telegram of the next quarter closes it on its forecast
+  peak_update(&pk, 230806, 150000, 0, 0);
+  TEST_ASSERT_EQUAL_UINT32(2308061500, pk.quarter);
+  TEST_ASSERT_INT_WITHIN(2, 3000, pk.last);
+  TEST_ASSERT_EQUAL_UINT32(0, pk.incomplete);
+  TEST_ASSERT_EQUAL_UINT32(pk.last, pk.month_peak);
+  TEST_ASSERT_EQUAL_UINT32(2308061445, pk.month_peak_at);
+  TEST_ASSERT_FALSE(pk.saved);
+  TEST_ASSERT_EQUAL_UINT32(0, pk.forecast);
+
+  // last 5 minutes missing : closed on the demand so far, a lower bound
+  run_quarter(&pk, 230806, 1500, 4500, 1, 600);
+  peak_update(&pk, 230806, 151500, 0, 0);
+  TEST_ASSERT_INT_WITHIN(2, 4500 * 598 / 900, pk.last);   // import from the 2nd second on
+  TEST_ASSERT_EQUAL_UINT32(1, pk.incomplete);
+
+  // meter demand (1-0:1.4.0) wins over the integration
+  peak_update(&pk, 230806, 152000, 1800, 1000);
+  TEST_ASSERT_EQUAL_UINT32(1800, pk.demand);
+  TEST_ASSERT_EQUAL_UINT32(1800 + 1000 * 600 / 900, pk.forecast);
+}
+
+void test_month_peak() {
+  PEAK pk;
+  run_quarter(&pk, 230831, 2300, 6000);
+  run_quarter(&pk, 230831, 2315, 4000);
+  TEST_ASSERT_INT_WITHIN(2, 6000, pk.month_peak);
+  TEST_ASSERT_EQUAL_UINT32(2308312300, pk.month_peak_at);
+  run_quarter(&pk, 230831, 2345, 7000);
+
+  // the last quarter of August counts for August, then September starts from nothing
+  peak_update(&pk, 230901, 0, 0, 0);
+  TEST_ASSERT_INT_WITHIN(2, 7000, pk.last);
+  TEST_ASSERT_EQUAL_UINT32(2309, pk.month);
+  TEST_ASSERT_EQUAL_UINT32(0, pk.month_peak);
+  TEST_ASSERT_EQUAL_UINT32(0, pk.month_peak_at);
+  run_quarter(&pk, 230901, 0, 1000, 1);
+  peak_update(&pk, 230901, 1500, 0, 0);
+  TEST_ASSERT_INT_WITHIN(2, 1000, pk.month_peak);
+  TEST_ASSERT_EQUAL_UINT32(2309010000, pk.month_peak_at);
+}
+
+void test_floor_and_alerts() {
+  PEAK pk;
+  // month peak under the floor : the floor is the limit
+  TEST_ASSERT_EQUAL_UINT32(PEAK_FLOOR, peak_limit(&pk));
+  peak_update(&pk, 230806, 150730, 1000, 2000);   // 450 s in, forecast 2000 W
+  TEST_ASSERT_EQUAL_UINT32(2000, pk.forecast);
+  TEST_ASSERT_EQUAL_INT32((PEAK_FLOOR - 2000) * 900 / 450, pk.headroom);
+  TEST_ASSERT_EQUAL_UINT8(PEAK_OK, pk.alert);
+  peak_update(&pk, 230806, 150730, 1000, 2600);   // 2300 W
+  TEST_ASSERT_EQUAL_UINT8(PEAK_WARNING, pk.alert);
+  peak_update(&pk, 230806, 150730, 1000, 3200);   // 2600 W
+  TEST_ASSERT_EQUAL_UINT8(PEAK_NEW, pk.alert);
+  TEST_ASSERT_EQUAL_INT32(-200, pk.headroom);
+
+  // above the floor the month peak is the limit
+  pk.month_peak = 4000;
+  TEST_ASSERT_EQUAL_UINT32(4000, peak_limit(&pk));
+  peak_update(&pk, 230806, 150730, 1000, 3200);
+  TEST_ASSERT_EQUAL_UINT8(PEAK_OK, pk.alert);
+  TEST_ASSERT_EQUAL_INT32(2800, pk.headroom);
+}
+
+// Bounded up to the last second of the quarter, either sign
+void test_headroom_end_of_quarter() {
+  PEAK pk;
+  for (int s = 0; s < 900; s++) {
+    peak_update(&pk, 230806, quarter_time(1500, s), 1000, 1000);
+    int32_t margin = (int32_t)PEAK_FLOOR - (int32_t)pk.forecast;
+    int32_t left = (900 - s < PEAK_MIN_LEFT) ? PEAK_MIN_LEFT : 900 - s;
+    TEST_ASSERT_EQUAL_INT32(margin * 900 / left, pk.headroom);
+    TEST_ASSERT_LESS_OR_EQUAL(margin * 900 / PEAK_MIN_LEFT, pk.headroom);
+  }
+  TEST_ASSERT_EQUAL_INT32((PEAK_FLOOR - 1001) * 900 / PEAK_MIN_LEFT, pk.headroom);
+  peak_update(&pk, 230806, 151459, 3000, 5000);
+  TEST_ASSERT_EQUAL_INT32(((int32_t)PEAK_FLOOR - 3005) * 900 / PEAK_MIN_LEFT, pk.headroom);
+}
+
+// Negative headroom kept signed up to the payloads
+void test_headroom_output() {
+  static_assert(std::is_signed<decltype(DG::PeakHeadroom)>::value, "headroom is signed");
+  PEAK pk;
+  peak_update(&pk, 230806, 150730, 1000, 3200);
+  DG v;
+  v.PeakHeadroom = pk.headroom;
+  char value[600];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  http_dg_json(&v, &f);
+  TEST_ASSERT_NOT_NULL(strstr(value, "\"P_PeakHeadroom\": -200,"));
+  fmt_init(&f, value, sizeof(value));
+  fmt_json_fixed(&f, "headroom", v.PeakHeadroom, 3);
+  TEST_ASSERT_EQUAL_STRING("\"headroom\": -0.200", value);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_quarter_rollover);
+  RUN_TEST(test_month_peak);
+  RUN_TEST(test_floor_and_alerts);
+  RUN_TEST(test_headroom_end_of_quarter);
+  RUN_TEST(test_headroom_output);
+  return UNITY_END();
+}
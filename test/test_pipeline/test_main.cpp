@@ -0,0 +1,262 @@
+// Telegram pipeline on the host : the sample telegram and variants of it go through the
+// firmware, from the P1 port to the modified telegram, MQTT and HTTP. Decoded values and
+// the rewritten telegram are checked, then each stage is timed and its heap allocations
+// counted (pio test -e native -f test_pipeline -v shows the table).
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define VARIANTS 16
+#define RUNS 2000
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+
+void setUp() {}
+void tearDown() {}
+
+// Variant i of the sample : time + i s, injected power + 7i W, L1 current + 0.01i A
+int variant(char *buf, int i) {
+  char text[24];
+  memcpy(buf, sample, sample_len + 1);
+  snprintf(text, sizeof(text), "(2308061452%02uS)", 9 + i);
+  host_set(buf, "(230806145209S)", text);
+  snprintf(text, sizeof(text), "2.7.0(%02u.%03u*kW)", (1201 + 7 * i) / 1000, (1201 + 7 * i) % 1000);
+  host_set(buf, "2.7.0(01.201*kW)", text);
+  snprintf(text, sizeof(text), "31.7.0(%03u.%02u*A)", (184 + i) / 100, (184 + i) % 100);
+  host_set(buf, "31.7.0(001.84*A)", text);
+  return host_sign(buf, P1_BUF_SIZE);
+}
+
+// The same telegram as the firmware should rewrite it : 2 A more on each line
+int variant_mod(char *buf, int i) {
+  char text[24];
+  char mod[24];
+  variant(buf, i);
+  snprintf(text, sizeof(text), "31.7.0(%03u.%02u*A)", (184 + i) / 100, (184 + i) % 100);
+  snprintf(mod, sizeof(mod), "31.7.0(%03u.%02u*A)", (384 + i) / 100, (384 + i) % 100);
+  host_set(buf, text, mod);
+  host_set(buf, "51.7.0(001.99*A)", "51.7.0(003.99*A)");
+  host_set(buf, "71.7.0(002.22*A)", "71.7.0(004.22*A)");
+  return host_sign(buf, P1_BUF_SIZE);
+}
+
+// One telegram on the P1 port, decoded and output by the serial task
+void receive(const char *buf, int len) {
+  Serial.out_len = 0;
+  host_serial_feed(buf, len);
+  task_serial();
+}
+
+void test_sample_decode() {
+  TEST_ASSERT_GREATER_THAN(0, sample_len);
+  uint32_t frames = p1.frames;
+  receive(sample, sample_len);
+  TEST_ASSERT_EQUAL_UINT32(frames + 1, p1.frames);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.crc_errors);
+  TEST_ASSERT_EQUAL_INT(sample_len, tg.len);
+  TEST_ASSERT_EQUAL_UINT32(230806, dg.CurrentDate);
+  TEST_ASSERT_EQUAL_UINT32(145209, dg.CurrentTime);
+  TEST_ASSERT_EQUAL_UINT32(93898, dg.E_consumed_1);
+  TEST_ASSERT_EQUAL_UINT32(165920, dg.E_consumed_2);
+  TEST_ASSERT_EQUAL_UINT32(259818, dg.E_consumed);
+  TEST_ASSERT_EQUAL_UINT32(365262, dg.E_injected_1);
+  TEST_ASSERT_EQUAL_UINT32(125678, dg.E_injected_2);
+  TEST_ASSERT_EQUAL_UINT32(490940, dg.E_injected);
+  TEST_ASSERT_EQUAL_UINT32(0, dg.P_consumed);
+  TEST_ASSERT_EQUAL_UINT32(1201, dg.P_injected);
+  TEST_ASSERT_EQUAL_UINT32(2341, dg.U_L1);
+  TEST_ASSERT_EQUAL_UINT32(2317, dg.U_L2);
+  TEST_ASSERT_EQUAL_UINT32(2293, dg.U_L3);
+  TEST_ASSERT_EQUAL_UINT32(184, dg.I_L1);
+  TEST_ASSERT_EQUAL_UINT32(199, dg.I_L2);
+  TEST_ASSERT_EQUAL_UINT32(222, dg.I_L3);
+  TEST_ASSERT_EQUAL_INT32(-386, (int32_t)dg.P_act_L1);
+  TEST_ASSERT_EQUAL_INT32(-314, (int32_t)dg.P_act_L2);
+  TEST_ASSERT_EQUAL_INT32(-500, (int32_t)dg.P_act_L3);
+  // no rule changes a value : the telegram goes out as received
+  TEST_ASSERT_EQUAL_INT(0, tg.rw.n);
+  TEST_ASSERT_EQUAL_INT(sample_len, Serial.out_len);
+  TEST_ASSERT_EQUAL_MEMORY(sample, Serial.out, sample_len);
+}
+
+void test_modified_telegram() {
+  char buf[P1_BUF_SIZE];
+  char mod[P1_BUF_SIZE];
+  cfg.I_Shift = 2;
+  for (int i = 0; i < VARIANTS; i++) {
+    int len = variant(buf, i);
+    int mod_len = variant_mod(mod, i);
+    receive(buf, len);
+    TEST_ASSERT_EQUAL_UINT32(0, p1.crc_errors);
+    TEST_ASSERT_EQUAL_UINT32(145209 + i, dg.CurrentTime);
+    TEST_ASSERT_EQUAL_UINT32(1201 + 7 * i, dg.P_injected);
+    TEST_ASSERT_EQUAL_UINT32(184 + i, dg.I_L1);
+    TEST_ASSERT_EQUAL_UINT32(384 + i, dg.I_Mod_L1);
+    TEST_ASSERT_EQUAL_UINT32(399, dg.I_Mod_L2);
+    TEST_ASSERT_EQUAL_UINT32(422, dg.I_Mod_L3);
+    // original text kept, the modified one re-signed with the reference CRC
+    TEST_ASSERT_EQUAL_MEMORY(buf, tg.buf, len);
+    TEST_ASSERT_EQUAL_MEMORY(mod + mod_len - 6, tg.mod_tail, 6);
+    TEST_ASSERT_EQUAL_INT(mod_len, Serial.out_len);
+    TEST_ASSERT_EQUAL_MEMORY(mod, Serial.out, mod_len);
+    task_intervals();
+  }
+  cfg.I_Shift = 0;
+}
+
+void test_mqtt_output() {
+  TEST_ASSERT_TRUE(mqtt_conn.up);
+  cfg.mqtt_state = MQTT_STATE_JSON;
+  receive(sample, sample_len);
+  process_mqtt();
+  const HOST_MSG *m = host_mqtt_last(MQTT_TOPIC "State");
+  TEST_ASSERT_NOT_NULL(m);
+  TEST_ASSERT_EQUAL_STRING("{\"E_consumed\": 259818,\"E_injected\": 490940,\"P_consumed\": 0,\"P_injected\": 1201,"
+                           "\"U_L1\": 234.1,\"U_L2\": 231.7,\"U_L3\": 229.3,\"I_L1\": 1.84,\"I_L2\": 1.99,\"I_L3\": 2.22,"
+                           "\"P_L1\": -386,\"P_L2\": -314,\"P_L3\": -500,\"P_QuarterHourPeak\": 0}", (const char *)m->payload);
+  m = host_mqtt_last(MQTT_TOPIC "Power");
+  TEST_ASSERT_NOT_NULL(m);
+  TEST_ASSERT_EQUAL_STRING("{\"P_consumed\": 0,\"P_injected\": 1201}", (const char *)m->payload);
+
+  // running minute of the variants
+  char value[600];
+  FMT f;
+  fmt_init(&f, value, sizeof(value));
+  mqtt_interval_json(&agg_min.cur, &f);
+  TEST_ASSERT_FALSE(f.overflow);
+  TEST_ASSERT_NOT_NULL(strstr(value, "{\"t\": 2308061452,\"n\": 16,"));
+  TEST_ASSERT_NOT_NULL(strstr(value, "\"P\": [-1306,-1253,-1201]"));
+  TEST_ASSERT_NOT_NULL(strstr(value, "\"I_L1\": [1.84,1.91,1.99]"));
+  cfg.mqtt_state = MQTT_STATE_OFF;
+}
+
+// Message from the broker on MQTT_TOPIC sub
+void mqtt_cmd(const char *sub, const char *text) {
+  char topic[64];
+  uint8_t payload[32];
+  snprintf(topic, sizeof(topic), "%s%s", MQTT_TOPIC, sub);
+  int len = strlen(text);
+  memcpy(payload, text, len);
+  mqtt_callback(topic, payload, len);
+}
+
+// cmd/maxamp : 0 to 32 A as from the CLI, anything else is refused and not saved
+void test_mqtt_maxamp() {
+  const char *refused[] = { "", "33", "-1", "12A", "5 ", "0x", "99999999999999999999", "-99999999999999999999" };
+  cfg.I_Shift = 4;
+  cfg_dirty = false;
+  for (const char *text : refused) {
+    mqtt_cmd("cmd/maxamp", text);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(4, cfg.I_Shift, text);
+    TEST_ASSERT_FALSE_MESSAGE(cfg_dirty, text);
+  }
+  mqtt_cmd("cmd/maxamp", "32");
+  TEST_ASSERT_EQUAL_UINT32(32, cfg.I_Shift);
+  TEST_ASSERT_TRUE(cfg_dirty);
+  mqtt_cmd("cmd/maxamp", "0x10");
+  TEST_ASSERT_EQUAL_UINT32(16, cfg.I_Shift);
+  mqtt_cmd("cmd/maxamp", "0");
+  TEST_ASSERT_EQUAL_UINT32(0, cfg.I_Shift);
+  cfg_dirty = false;
+}
+
+// Time and allocations per stage, the stages also check their result
+void test_stage_bench() {
+  HOST_STAGE st_rx("p1_rx");
+  HOST_STAGE st_crc("crc16");
+  HOST_STAGE st_parse("obis_parse");
+  HOST_STAGE st_rw("rw_apply");
+  HOST_STAGE st_receive("receive");
+  HOST_STAGE st_json("state_json");
+  HOST_STAGE st_cbor("state_cbor");
+  HOST_STAGE st_interval("interval_json");
+  HOST_STAGE st_http("http_json");
+  HOST_STAGE st_mqtt("process_mqtt");
+  static char rx_buf[P1_BUF_SIZE];
+  P1_FRAME f;
+  p1_begin(&f, rx_buf, sizeof(rx_buf));
+  OBIS_VAL ov;
+  RW_SET rw;
+  uint32_t val[OBIS_COUNT];
+  char value[600];
+  uint8_t bin[96];
+  FMT fm;
+  DG v = dg;
+  cfg.I_Shift = 2;
+
+  for (int i = 0; i < RUNS; i++) {
+    bool done;
+    host_stage_begin(&st_rx);
+    int n = p1_rx_buf(&f, sample, sample_len, 0, UART_BYTE_US, &done);
+    host_stage_end(&st_rx);
+    TEST_ASSERT_TRUE(done && f.crc_valid && (n == sample_len - 2));  // CRLF after the CRC not read
+
+    host_stage_begin(&st_crc);
+    uint16_t crc = crc16_update(0, sample, sample_len - 6);
+    host_stage_end(&st_crc);
+    TEST_ASSERT_EQUAL_HEX16(f.crc, crc);
+
+    host_stage_begin(&st_parse);
+    obis_parse(sample, sample_len, &ov);
+    host_stage_end(&st_parse);
+    TEST_ASSERT_EQUAL_UINT32(1201, ov.val[OBIS_P_INJ]);
+
+    host_stage_begin(&st_rw);
+    crc = rw_apply(&rw, rw_rules, rw_rules_count, &f, f.buf, f.idx - 6, val);
+    host_stage_end(&st_rw);
+    TEST_ASSERT_EQUAL_UINT32(384, val[OBIS_I_L1]);
+
+    host_stage_begin(&st_receive);
+    receive(sample, sample_len);
+    host_stage_end(&st_receive);
+
+    host_stage_begin(&st_json);
+    fmt_init(&fm, value, sizeof(value));
+    mqtt_state_json(&v, &fm);
+    host_stage_end(&st_json);
+
+    host_stage_begin(&st_cbor);
+    size_t len = mqtt_state_cbor(&v, bin, sizeof(bin));
+    host_stage_end(&st_cbor);
+    TEST_ASSERT_GREATER_THAN(0, len);
+
+    host_stage_begin(&st_interval);
+    fmt_init(&fm, value, sizeof(value));
+    mqtt_interval_json(&agg_min.cur, &fm);
+    host_stage_end(&st_interval);
+
+    host_stage_begin(&st_http);
+    fmt_init(&fm, value, sizeof(value));
+    http_dg_json(&v, &fm);
+    host_stage_end(&st_http);
+    TEST_ASSERT_FALSE(fm.overflow);
+
+    host_stage_begin(&st_mqtt);
+    process_mqtt();
+    host_stage_end(&st_mqtt);
+  }
+  cfg.I_Shift = 0;
+
+  const HOST_STAGE *stages[] = { &st_rx, &st_crc, &st_parse, &st_rw, &st_receive, &st_json,
+                                 &st_cbor, &st_interval, &st_http, &st_mqtt };
+  printf("\nstage            time/run      heap allocations/run\n");
+  for (const HOST_STAGE *s : stages) {
+    host_stage_print(s);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, s->allocs, s->name);
+  }
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  setup();
+  task_net();    // WiFi and MQTT up
+  UNITY_BEGIN();
+  RUN_TEST(test_sample_decode);
+  RUN_TEST(test_modified_telegram);
+  RUN_TEST(test_mqtt_output);
+  RUN_TEST(test_mqtt_maxamp);
+  RUN_TEST(test_stage_bench);
+  return UNITY_END();
+}
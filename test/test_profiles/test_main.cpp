@@ -0,0 +1,228 @@
+// Meter profile of the build (METER_PROFILE) : a telegram of that meter decoded field by
+// field and rewritten, then timed. Runs in the native env (Fluvius) and in native_dsmr5
+// and native_lux, one per profile : pio test -e native_dsmr5 -v
+
+#include <host.h>
+#include <unity.h>
+#include <p1.h>
+#include <rewrite.h>
+
+#define RUNS 5000
+
+struct EXPECT {
+  OBIS_ID id;
+  uint32_t val;
+};
+
+#if METER_PROFILE == METER_FLUVIUS
+// Sample_P1_datagram.txt
+const char *telegram = NULL;
+const uint32_t expect_date = 230806;
+const uint32_t expect_time = 145209;
+const EXPECT expect[] = {
+  { OBIS_E_CONS_1, 93898 },   { OBIS_E_CONS_2, 165920 },  { OBIS_E_INJ_1, 365262 },  { OBIS_E_INJ_2, 125678 },
+  { OBIS_PEAK, 0 },           { OBIS_P_CONS, 0 },         { OBIS_P_INJ, 1201 },
+  { OBIS_P_CONS_L1, 0 },      { OBIS_P_CONS_L2, 0 },      { OBIS_P_CONS_L3, 0 },
+  { OBIS_P_INJ_L1, 386 },     { OBIS_P_INJ_L2, 314 },     { OBIS_P_INJ_L3, 500 },
+  { OBIS_U_L1, 2341 },        { OBIS_U_L2, 2317 },        { OBIS_U_L3, 2293 },
+  { OBIS_I_L1, 184 },         { OBIS_I_L2, 199 },         { OBIS_I_L3, 222 },
+};
+#elif METER_PROFILE == METER_DSMR5
+// DSMR 5.0.2 P1 companion standard example, shortened
+const char *telegram =
+  "/ISk5\\2MT382-1000\r\n\r\n"
+  "1-3:0.2.8(50)\r\n"
+  "0-0:1.0.0(101209113020W)\r\n"
+  "0-0:96.1.1(4B384547303034303436333935353037)\r\n"
+  "1-0:1.8.1(123456.789*kWh)\r\n"
+  "1-0:1.8.2(123456.789*kWh)\r\n"
+  "1-0:2.8.1(123456.789*kWh)\r\n"
+  "1-0:2.8.2(123456.789*kWh)\r\n"
+  "0-0:96.14.0(0002)\r\n"
+  "1-0:1.7.0(01.193*kW)\r\n"
+  "1-0:2.7.0(00.000*kW)\r\n"
+  "0-0:96.7.21(00004)\r\n"
+  "0-0:96.7.9(00002)\r\n"
+  "1-0:99.97.0(2)(0-0:96.7.19)(101208152415W)(0000000240*s)(101208151004W)(0000000301*s)\r\n"
+  "1-0:32.32.0(00002)\r\n"
+  "1-0:52.32.0(00001)\r\n"
+  "1-0:72.32.0(00000)\r\n"
+  "0-0:96.13.0(303132333435363738393A3B3C3D3E3F303132333435363738393A3B3C3D3E3F)\r\n"
+  "1-0:32.7.0(220.1*V)\r\n"
+  "1-0:52.7.0(220.2*V)\r\n"
+  "1-0:72.7.0(220.3*V)\r\n"
+  "1-0:31.7.0(001*A)\r\n"
+  "1-0:51.7.0(002*A)\r\n"
+  "1-0:71.7.0(003*A)\r\n"
+  "1-0:21.7.0(01.111*kW)\r\n"
+  "1-0:41.7.0(02.222*kW)\r\n"
+  "1-0:61.7.0(03.333*kW)\r\n"
+  "1-0:22.7.0(04.444*kW)\r\n"
+  "1-0:42.7.0(05.555*kW)\r\n"
+  "1-0:62.7.0(06.666*kW)\r\n"
+  "0-1:24.1.0(003)\r\n"
+  "0-1:96.1.0(3232323241424344313233343536373839)\r\n"
+  "0-1:24.2.1(101209112500W)(12785.123*m3)\r\n"
+  "!XXXX\r\n";
+const uint32_t expect_date = 101209;
+const uint32_t expect_time = 113020;
+const EXPECT expect[] = {
+  { OBIS_E_CONS_1, 123456789 }, { OBIS_E_CONS_2, 123456789 }, { OBIS_E_INJ_1, 123456789 }, { OBIS_E_INJ_2, 123456789 },
+  { OBIS_P_CONS, 1193 },        { OBIS_P_INJ, 0 },
+  { OBIS_P_CONS_L1, 1111 },     { OBIS_P_CONS_L2, 2222 },     { OBIS_P_CONS_L3, 3333 },
+  { OBIS_P_INJ_L1, 4444 },      { OBIS_P_INJ_L2, 5555 },      { OBIS_P_INJ_L3, 6666 },
+  { OBIS_U_L1, 2201 },          { OBIS_U_L2, 2202 },          { OBIS_U_L3, 2203 },
+  { OBIS_I_L1, 100 },           { OBIS_I_L2, 200 },           { OBIS_I_L3, 300 },
+};
+#elif METER_PROFILE == METER_LUX_DECRYPTED
+// Smarty telegram as a decrypting bridge forwards it
+const char *telegram =
+  "/Ene5\\T210-D ESMR5.0\r\n\r\n"
+  "1-3:0.2.8(50)\r\n"
+  "0-0:1.0.0(200512135409S)\r\n"
+  "0-0:42.0.0(53414731303330303030303030303030)\r\n"
+  "1-0:1.8.0(000123.456*kWh)\r\n"
+  "1-0:2.8.0(000000.000*kWh)\r\n"
+  "1-0:3.8.0(000012.345*kvarh)\r\n"
+  "1-0:4.8.0(000034.567*kvarh)\r\n"
+  "1-0:1.7.0(00.512*kW)\r\n"
+  "1-0:2.7.0(00.000*kW)\r\n"
+  "1-0:3.7.0(00.000*kvar)\r\n"
+  "1-0:4.7.0(00.123*kvar)\r\n"
+  "0-0:17.0.0(999.9*kW)\r\n"
+  "0-0:96.3.10(1)\r\n"
+  "0-0:96.13.0()\r\n"
+  "1-0:31.7.0(002*A)\r\n"
+  "1-0:51.7.0(000*A)\r\n"
+  "1-0:71.7.0(001*A)\r\n"
+  "1-0:21.7.0(00.250*kW)\r\n"
+  "1-0:41.7.0(00.012*kW)\r\n"
+  "1-0:61.7.0(00.250*kW)\r\n"
+  "1-0:22.7.0(00.000*kW)\r\n"
+  "1-0:42.7.0(00.000*kW)\r\n"
+  "1-0:62.7.0(00.000*kW)\r\n"
+  "1-0:32.7.0(233.8*V)\r\n"
+  "1-0:52.7.0(231.0*V)\r\n"
+  "1-0:72.7.0(232.4*V)\r\n"
+  "!XXXX\r\n";
+const uint32_t expect_date = 200512;
+const uint32_t expect_time = 135409;
+const EXPECT expect[] = {
+  { OBIS_E_CONS_1, 123456 },    { OBIS_E_INJ_1, 0 },
+  { OBIS_P_CONS, 512 },         { OBIS_P_INJ, 0 },
+  { OBIS_P_CONS_L1, 250 },      { OBIS_P_CONS_L2, 12 },       { OBIS_P_CONS_L3, 250 },
+  { OBIS_P_INJ_L1, 0 },         { OBIS_P_INJ_L2, 0 },         { OBIS_P_INJ_L3, 0 },
+  { OBIS_U_L1, 2338 },          { OBIS_U_L2, 2310 },          { OBIS_U_L3, 2324 },
+  { OBIS_I_L1, 200 },           { OBIS_I_L2, 0 },             { OBIS_I_L3, 100 },
+};
+#endif
+
+char text[P1_BUF_SIZE];
+int text_len = 0;
+char rx_buf[P1_BUF_SIZE];
+P1_FRAME p1;
+
+// Currents shifted by 2 A, as the modified telegram of the firmware
+const uint32_t shift = 2;
+const RW_RULE rules[] = {
+  { OBIS_I_L1, RW_ADD, &shift, 100 },
+  { OBIS_I_L2, RW_ADD, &shift, 100 },
+  { OBIS_I_L3, RW_ADD, &shift, 100 },
+};
+
+void setUp() {}
+void tearDown() {}
+
+bool receive(P1_FRAME *f, const char *buf, int len) {
+  bool done;
+  p1_rx_buf(f, buf, len, 0, 87, &done);
+  return done && f->crc_valid;
+}
+
+void test_decode() {
+  TEST_ASSERT_GREATER_THAN(0, text_len);
+  TEST_ASSERT_TRUE(receive(&p1, text, text_len));
+  TEST_ASSERT_EQUAL_UINT32(expect_date, p1.ov.date);
+  TEST_ASSERT_EQUAL_UINT32(expect_time, p1.ov.time);
+  // every field of the profile, and nothing decoded for the fields it lacks
+  uint32_t seen[OBIS_COUNT] = {};
+  for (unsigned int i = 0; i < OBIS_FIELDS; i++) {
+    OBIS_ID id = obis_fields[i].id;
+    if (id == OBIS_DATETIME) continue;
+    const EXPECT *e = NULL;
+    for (const EXPECT &x : expect) if (x.id == id) e = &x;
+    TEST_ASSERT_NOT_NULL_MESSAGE(e, obis_fields[i].code);
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(e->val, p1.ov.val[id], obis_fields[i].code);
+    seen[id] = 1;
+  }
+  for (int id = OBIS_DATETIME + 1; id < OBIS_COUNT; id++) {
+    if (!seen[id]) TEST_ASSERT_EQUAL_UINT32(0, p1.ov.val[id]);
+  }
+#if METER_PROFILE == METER_DSMR5
+  TEST_ASSERT_EQUAL_UINT8(MBUS_GAS, p1.ov.mbus[0].type);
+  TEST_ASSERT_EQUAL_UINT32(12785123, p1.ov.mbus[0].value);
+  TEST_ASSERT_EQUAL_STRING("m3", p1.ov.mbus[0].unit);
+#endif
+}
+
+// Modified telegram : currents 2 A higher in the telegram layout, valid CRC
+void test_rewrite() {
+  TEST_ASSERT_TRUE(receive(&p1, text, text_len));
+  RW_SET rw;
+  uint32_t val[OBIS_COUNT];
+  uint16_t crc = rw_apply(&rw, rules, 3, &p1, p1.buf, p1.idx - 6, val);
+  TEST_ASSERT_EQUAL_INT(3, rw.n);
+  static char mod[P1_BUF_SIZE];
+  int len = 0;
+  for (int pos = 0; pos < p1.idx - 6;) {
+    const char *p;
+    int n = rw_chunk(&rw, p1.buf, p1.idx - 6, pos, &p);
+    memcpy(mod + len, p, n);
+    len += n;
+    pos += n;
+  }
+  TEST_ASSERT_EQUAL_HEX16(host_crc16(mod, len), crc);
+  OBIS_VAL ov;
+  obis_parse(mod, len, &ov);
+  for (int id = OBIS_I_L1; id <= OBIS_I_L3; id++) TEST_ASSERT_EQUAL_UINT32(p1.ov.val[id] + 200, ov.val[id]);
+}
+
+void test_bench() {
+  HOST_STAGE rx("p1_rx");
+  HOST_STAGE parse("obis_parse");
+  HOST_STAGE rewrite("rw_apply");
+  RW_SET rw;
+  uint32_t val[OBIS_COUNT];
+  OBIS_VAL ov;
+  for (int i = 0; i < RUNS; i++) {
+    host_stage_begin(&rx);
+    bool ok = receive(&p1, text, text_len);
+    host_stage_end(&rx);
+    TEST_ASSERT_TRUE(ok);
+    host_stage_begin(&parse);
+    obis_parse(text, text_len, &ov);
+    host_stage_end(&parse);
+    host_stage_begin(&rewrite);
+    rw_apply(&rw, rules, 3, &p1, p1.buf, p1.idx - 6, val);
+    host_stage_end(&rewrite);
+  }
+  printf("\nprofile %s : %u fields, telegram %i bytes\n", METER_NAME, (unsigned int)OBIS_FIELDS, text_len);
+  host_stage_print(&rx);
+  host_stage_print(&parse);
+  host_stage_print(&rewrite);
+  TEST_ASSERT_EQUAL_UINT32(0, rx.allocs + parse.allocs + rewrite.allocs);
+}
+
+int main(int argc, char **argv) {
+  if (telegram == NULL) text_len = host_sample(text, sizeof(text));
+  else {
+    snprintf(text, sizeof(text), "%s", telegram);
+    text_len = host_sign(text, sizeof(text));
+  }
+  p1_begin(&p1, rx_buf, sizeof(rx_buf));
+  UNITY_BEGIN();
+  RUN_TEST(test_decode);
+  RUN_TEST(test_rewrite);
+  RUN_TEST(test_bench);
+  return UNITY_END();
+}
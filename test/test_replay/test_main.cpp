@@ -0,0 +1,290 @@
+// Replay and fuzz : a stream of telegrams derived from the capture (Sample_P1_datagram.txt)
+// then mutated ones go through the receive path of the firmware (p1_rx, CRC, OBIS decode,
+// rw_apply) in UART sized chunks. Frame, CRC error, restart and overflow counts must be
+// exactly the expected ones, and every modified telegram must carry a valid CRC.
+//
+// A capture of a meter replaces the derived stream when given as the program argument or
+// in P1_CAPTURE (pio test -e native -f test_replay -v -a <file>) : its '/' ... '!XXXX'
+// frames are replayed in turn, REPLAY telegrams at least, and the telegrams/s printed.
+
+#include <host.h>
+#include <unity.h>
+#include "../../src/main.cpp"
+
+#define REPLAY 20000
+#define FUZZ 20000
+#define CHUNK 64
+
+char sample[P1_BUF_SIZE];
+int sample_len = 0;
+const char *capture = NULL;   // file of a capture to replay, NULL : derived stream
+uint32_t rnd = 4242;
+uint32_t valid = 0;   // telegrams accepted
+
+void setUp() {}
+void tearDown() {}
+
+uint32_t rnd_next() {
+  rnd = rnd * 1103515245 + 12345;
+  return rnd >> 8;
+}
+
+// Telegram i of a day of captures : meter time and L1 current vary
+int make(char *buf, int i) {
+  char text[24];
+  memcpy(buf, sample, sample_len + 1);
+  snprintf(text, sizeof(text), "(2308%02u%02u%02u%02uS)", 6 + i / 86400 % 20, i / 3600 % 24, i / 60 % 60, i % 60);
+  host_set(buf, "(230806145209S)", text);
+  snprintf(text, sizeof(text), "31.7.0(%03u.%02u*A)", i % 40, i % 100);
+  host_set(buf, "31.7.0(001.84*A)", text);
+  return host_sign(buf, P1_BUF_SIZE);
+}
+
+// Modified telegram of the last one accepted, checked as a receiver would
+bool mod_valid() {
+  static char buf[P1_BUF_SIZE];
+  P1_FRAME f;
+  p1_begin(&f, buf, sizeof(buf));
+  int len = tg_length(true);
+  bool done = false;
+  for (int pos = 0; (pos < len) && !done;) {
+    const char *p;
+    int n = tg_chunk(true, pos, &p);
+    for (int i = 0; (i < n) && !done; i++) done = p1_rx(&f, p[i]);
+    pos += n;
+  }
+  return done && f.crc_valid;
+}
+
+// Bytes from the UART, as task_serial reads them
+void feed(const char *buf, int len) {
+  for (int pos = 0; pos < len; pos += CHUNK) {
+    int n = (len - pos < CHUNK) ? len - pos : CHUNK;
+    int i = 0;
+    while (i < n) {
+      bool done;
+      i += p1_rx_buf(&p1, buf + pos + i, n - i, 0, UART_BYTE_US, &done);
+      if (done && dg_receive(&dg, &p1)) {
+        valid++;
+        TEST_ASSERT_TRUE(mod_valid());
+      }
+    }
+  }
+}
+
+void test_replay() {
+  static char stream[P1_BUF_SIZE * 64];
+  static char t[P1_BUF_SIZE];
+  cfg.I_Shift = 3;
+  cfg.P_Scale = 150;
+  uint32_t frames = p1.frames;
+  int done = 0;
+  uint64_t ns = 0;
+  uint64_t bytes = 0;
+  while (done < REPLAY) {
+    int len = 0;
+    for (int n = 0; (n < 64) && (done < REPLAY); n++, done++) {
+      int l = make(t, done);
+      memcpy(stream + len, t, l);
+      len += l;
+    }
+    uint64_t t0 = host_ns();
+    feed(stream, len);
+    ns += host_ns() - t0;
+    bytes += len;
+  }
+  printf("\nreplay : %u telegrams, %.0f telegrams/s, %.1f MB/s\n", REPLAY, REPLAY * 1e9 / ns, bytes * 1e3 / ns);
+  TEST_ASSERT_EQUAL_UINT32(frames + REPLAY, p1.frames);
+  TEST_ASSERT_EQUAL_UINT32(REPLAY, valid);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.crc_errors);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.overflows);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.restarts);
+  // last one decoded, current shifted by 3 A in the modified one and clamped to 32 A
+  TEST_ASSERT_EQUAL_UINT32((REPLAY - 1) % 40 * 100 + (REPLAY - 1) % 100, dg.I_L1);
+  TEST_ASSERT_EQUAL_UINT32((dg.I_L1 + 300 < 3200) ? dg.I_L1 + 300 : 3200, dg.I_Mod_L1);
+}
+
+// Frames of a capture, back to back in frames : '/' up to '!' and its 4 CRC digits with
+// the line end after them. Text between frames is left out, and so are frames without CRC
+// digits or longer than the buffer. Returns the frames kept, their length in *len and
+// those with a wrong CRC in *bad.
+int split(const char *text, int text_len, char *frames, int *len, int *bad) {
+  int n = 0;
+  *len = 0;
+  *bad = 0;
+  const char *end = text + text_len;
+  for (const char *p = (const char *)memchr(text, '/', text_len); p != NULL;
+       p = (const char *)memchr(p, '/', end - p)) {
+    const char *bang = (const char *)memchr(p, '!', end - p);
+    if ((bang == NULL) || (end - bang < 5)) break;
+    const char *next = (const char *)memchr(p + 1, '/', bang - p - 1);
+    char hex[5] = { bang[1], bang[2], bang[3], bang[4], 0 };
+    char *hex_end;
+    uint32_t crc = strtoul(hex, &hex_end, 16);
+    if ((next != NULL) || (hex_end != hex + 4)) {   // cut short, or no CRC (DSMR 2.2)
+      p = (next != NULL) ? next : bang + 1;
+      continue;
+    }
+    const char *q = bang + 5;
+    while ((q < end) && ((*q == '\r') || (*q == '\n'))) q++;
+    if (q - p < P1_BUF_SIZE) {
+      memcpy(frames + *len, p, q - p);
+      *len += q - p;
+      if (crc != crc16_update(0, p, bang + 1 - p)) (*bad)++;
+      n++;
+    }
+    p = q;
+  }
+  return n;
+}
+
+void test_capture() {
+  FILE *f = fopen(capture, "rb");
+  TEST_ASSERT_NOT_NULL_MESSAGE(f, capture);
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *text = (char *)malloc(size + 1);
+  char *frames = (char *)malloc(size + 1);
+  TEST_ASSERT_EQUAL_INT(size, fread(text, 1, size, f));
+  fclose(f);
+  int len;
+  int bad;
+  int n = split(text, size, frames, &len, &bad);
+  TEST_ASSERT_GREATER_THAN_MESSAGE(0, n, "no telegram in the capture");
+  uint32_t frames_0 = p1.frames;
+  uint32_t crc_errors = p1.crc_errors;
+  uint32_t accepted = valid;
+  int passes = 0;
+  uint64_t ns = 0;
+  while (passes * n < REPLAY) {
+    uint64_t t0 = host_ns();
+    feed(frames, len);
+    ns += host_ns() - t0;
+    passes++;
+  }
+  printf("\ncapture %s : %d telegrams (%d CRC errors), %.0f telegrams/s, %.1f MB/s\n", capture, n, bad,
+         passes * n * 1e9 / ns, (double)passes * len * 1e3 / ns);
+  TEST_ASSERT_EQUAL_UINT32(passes * n, p1.frames - frames_0);
+  TEST_ASSERT_EQUAL_UINT32(passes * bad, p1.crc_errors - crc_errors);
+  TEST_ASSERT_EQUAL_UINT32(passes * (n - bad), valid - accepted);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.overflows);
+  TEST_ASSERT_EQUAL_UINT32(0, p1.restarts);
+  free(text);
+  free(frames);
+}
+
+enum MUTATION {
+  M_BYTE,       // one byte changed : CRC error
+  M_CRC_TEXT,   // CRC digits not hex : CRC error
+  M_CRC_WRONG,  // wrong CRC : CRC error
+  M_CUT,        // cut before its CRC, next telegram restarts the frame
+  M_OVERFLOW,   // longer than the buffer : dropped
+  M_GARBAGE,    // bytes outside a frame : ignored
+  M_BODY,       // random lines, valid CRC : accepted
+  M_VALUE,      // odd value text in a rewritten line, valid CRC : accepted
+  M_COUNT
+};
+
+// Mutation m of telegram t (len bytes) in place, returns its new length
+int mutate(char *t, int len, int m) {
+  static const char line_chars[] = "0123456789.*():-\r\n";
+  int bang = strchr(t, '!') - t;
+  switch (m) {
+    case M_BYTE: {
+      int p = 1 + rnd_next() % (bang - 1);
+      char c;
+      do c = rnd_next(); while ((c == t[p]) || (c == '/') || (c == '!'));
+      t[p] = c;
+      return len;
+    }
+    case M_CRC_TEXT:
+      t[bang + 1 + rnd_next() % 4] = 'Z';
+      return len;
+    case M_CRC_WRONG: {
+      char hex[5];
+      crc16_format(crc16_update(0, t, bang + 1) ^ (1 + rnd_next() % 0xFFFF), hex);
+      memcpy(t + bang + 1, hex, 4);
+      return len;
+    }
+    case M_CUT:
+      return 1 + rnd_next() % (bang + 4);
+    case M_OVERFLOW: {
+      int extra = P1_BUF_SIZE + rnd_next() % 2000;
+      static char tail[P1_BUF_SIZE];
+      memcpy(tail, t + bang, len - bang);
+      for (int i = 0; i < extra; i++) t[bang + i] = (i % 40 == 39) ? '\n' : '0' + i % 10;
+      memcpy(t + bang + extra, tail, len - bang);
+      return len + extra;
+    }
+    case M_GARBAGE: {
+      int n = rnd_next() % 3000;
+      for (int i = 0; i < n; i++) {
+        do t[i] = rnd_next(); while (t[i] == '/');
+      }
+      return n;
+    }
+    case M_BODY: {
+      int n = 1 + rnd_next() % 1500;
+      t[0] = '/';
+      for (int i = 1; i < n; i++) t[i] = line_chars[rnd_next() % (sizeof(line_chars) - 1)];
+      t[n] = '!';
+      t[n + 1] = 0;
+      return host_sign(t, P1_BUF_SIZE * 2);
+    }
+    case M_VALUE: {
+      static char rest[P1_BUF_SIZE];
+      char *p = strstr(t, "31.7.0(") + 7;
+      strcpy(rest, p);
+      int n = rnd_next() % 30;
+      for (int i = 0; i < n; i++) p[i] = "0123456789.*()"[rnd_next() % 14];
+      strcpy(p + n, rest);
+      return host_sign(t, P1_BUF_SIZE * 2);
+    }
+  }
+  return len;
+}
+
+void test_fuzz() {
+  static char t[P1_BUF_SIZE * 3];
+  static char next[P1_BUF_SIZE];
+  uint32_t frames = p1.frames;
+  uint32_t crc_errors = p1.crc_errors;
+  uint32_t restarts = p1.restarts;
+  uint32_t overflows = p1.overflows;
+  uint32_t accepted = valid;
+  uint32_t expect[M_COUNT] = {};
+  uint64_t ns = 0;
+  for (int i = 0; i < FUZZ; i++) {
+    int m = rnd_next() % M_COUNT;
+    int len = mutate(t, make(t, rnd_next() % 100000), m);
+    int next_len = make(next, i);
+    uint64_t t0 = host_ns();
+    feed(t, len);
+    feed(next, next_len);
+    ns += host_ns() - t0;
+    expect[m]++;
+  }
+  printf("fuzz : %u inputs, %.0f inputs/s\n", FUZZ, FUZZ * 1e9 / ns);
+  printf("frames %u, CRC errors %u, restarts %u, overflows %u\n", p1.frames - frames,
+         p1.crc_errors - crc_errors, p1.restarts - restarts, p1.overflows - overflows);
+  uint32_t errors = expect[M_BYTE] + expect[M_CRC_TEXT] + expect[M_CRC_WRONG];
+  uint32_t whole = errors + expect[M_BODY] + expect[M_VALUE];
+  TEST_ASSERT_EQUAL_UINT32(FUZZ + whole, p1.frames - frames);
+  TEST_ASSERT_EQUAL_UINT32(errors, p1.crc_errors - crc_errors);
+  TEST_ASSERT_EQUAL_UINT32(expect[M_CUT], p1.restarts - restarts);
+  TEST_ASSERT_EQUAL_UINT32(expect[M_OVERFLOW], p1.overflows - overflows);
+  TEST_ASSERT_EQUAL_UINT32(FUZZ + expect[M_BODY] + expect[M_VALUE], valid - accepted);
+}
+
+int main(int argc, char **argv) {
+  sample_len = host_sample(sample, sizeof(sample));
+  capture = (argc > 1) ? argv[1] : getenv("P1_CAPTURE");
+  p1_begin(&p1, p1_buf[0], P1_BUF_SIZE);
+  tg.buf = p1_buf[1];
+  UNITY_BEGIN();
+  if (capture != NULL) RUN_TEST(test_capture);
+  else RUN_TEST(test_replay);
+  RUN_TEST(test_fuzz);
+  return UNITY_END();
+}